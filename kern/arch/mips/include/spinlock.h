@@ -43,6 +43,13 @@ typedef unsigned spinlock_data_t;
 void spinlock_data_set(volatile spinlock_data_t *sd, unsigned val);
 spinlock_data_t spinlock_data_get(volatile spinlock_data_t *sd);
 spinlock_data_t spinlock_data_testandset(volatile spinlock_data_t *sd);
+spinlock_data_t spinlock_data_fetchadd(volatile spinlock_data_t *sd,
+				       unsigned delta);
+spinlock_data_t spinlock_data_swap(volatile spinlock_data_t *sd,
+				   spinlock_data_t val);
+spinlock_data_t spinlock_data_cas(volatile spinlock_data_t *sd,
+				  spinlock_data_t oldval,
+				  spinlock_data_t newval);
 
 ////////////////////////////////////////////////////////////
 
@@ -93,5 +100,86 @@ spinlock_data_testandset(volatile spinlock_data_t *sd)
 	return x;
 }
 
+/*
+ * The rest use LL/SC too, but retry until the SC succeeds, since
+ * (unlike testandset) there's no failure value to hand back.
+ */
+
+/*
+ * Add DELTA to *SD; return the old value.
+ */
+SPINLOCK_INLINE
+spinlock_data_t
+spinlock_data_fetchadd(volatile spinlock_data_t *sd, unsigned delta)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	do {
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			"ll %0, 0(%3);"		/*   x = *sd */
+			"addu %1, %0, %2;"	/*   y = x + delta */
+			"sc %1, 0(%3);"		/*   *sd = y; y = success? */
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "=&r" (y) : "r" (delta), "r" (sd));
+	} while (y == 0);
+	return x;
+}
+
+/*
+ * Store VAL in *SD; return the old value.
+ */
+SPINLOCK_INLINE
+spinlock_data_t
+spinlock_data_swap(volatile spinlock_data_t *sd, spinlock_data_t val)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	do {
+		y = val;
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			"ll %0, 0(%2);"		/*   x = *sd */
+			"sc %1, 0(%2);"		/*   *sd = y; y = success? */
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "+r" (y) : "r" (sd));
+	} while (y == 0);
+	return x;
+}
+
+/*
+ * If *SD is OLDVAL, store NEWVAL in it. Return the value found, so
+ * the store happened if and only if that's OLDVAL.
+ */
+SPINLOCK_INLINE
+spinlock_data_t
+spinlock_data_cas(volatile spinlock_data_t *sd, spinlock_data_t oldval,
+		  spinlock_data_t newval)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	do {
+		y = newval;
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			"ll %0, 0(%3);"		/*   x = *sd */
+			"bne %0, %2, 1f;"	/*   if (x != oldval) skip */
+			"nop;"			/*   (delay slot) */
+			"sc %1, 0(%3);"		/*   *sd = y; y = success? */
+			"1:"
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "+r" (y) : "r" (oldval), "r" (sd));
+	} while (x == oldval && y == 0);
+	return x;
+}
 
 #endif /* _MIPS_SPINLOCK_H_ */
@@ -244,6 +244,19 @@ mips_trap(struct trapframe *tf)
 		}
 
 		curthread->t_in_interrupt = old_in;
+#if OPT_A2
+		if (!iskern && curproc->p_exiting) {
+			/*
+			 * Another thread is taking the process down.
+			 * Get back in sync with the interrupts-on state
+			 * we came from (as below) so we can block in
+			 * uthread_checkexit.
+			 */
+			spl = splhigh();
+			splx(spl);
+			goto done;
+		}
+#endif
 		goto done2;
 	}
 
@@ -364,6 +377,12 @@ mips_trap(struct trapframe *tf)
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+#if OPT_A2
+	/* If another thread is taking the process down, go along. */
+	if (!iskern) {
+		uthread_checkexit();
+	}
+#endif
 	/*
 	 * Turn interrupts off on the processor, without affecting the
 	 * stored interrupt state.
@@ -35,6 +35,7 @@
 #include <thread.h>
 #include <current.h>
 #include <syscall.h>
+#include <objcache.h>
 #include "opt-A2.h"
 
 
@@ -109,6 +110,33 @@ syscall(struct trapframe *tf)
 		err = sys___time((userptr_t)tf->tf_a0,
 				 (userptr_t)tf->tf_a1);
 		break;
+
+	    case SYS_nanosleep:
+		err = sys_nanosleep((userptr_t)tf->tf_a0,
+				    (userptr_t)tf->tf_a1);
+		break;
+#if OPT_A2
+	    case SYS___thread_create:
+		err = sys___thread_create(tf, (userptr_t)tf->tf_a0,
+					  (userptr_t)tf->tf_a1,
+					  (userptr_t)tf->tf_a2,
+					  (userptr_t)tf->tf_a3,
+					  &retval);
+		break;
+	    case SYS___thread_exit:
+		sys___thread_exit((int)tf->tf_a0);
+		panic("unexpected return from sys___thread_exit");
+		break;
+	    case SYS___thread_join:
+		err = sys___thread_join((int)tf->tf_a0,
+					(userptr_t)tf->tf_a1);
+		break;
+	    case SYS___futex:
+		err = sys___futex((userptr_t)tf->tf_a0, (int)tf->tf_a1,
+				  (int)tf->tf_a2, (userptr_t)tf->tf_a3,
+				  &retval);
+		break;
+#endif
 #ifdef UW
 	case SYS_write:
 	  err = sys_write((int)tf->tf_a0,
@@ -136,10 +164,16 @@ syscall(struct trapframe *tf)
 	case SYS_fork:
 	  err = sys_fork(tf,(pid_t *)&retval);
 	  break;
+	case SYS_vfork:
+	  err = sys_vfork(tf,(pid_t *)&retval);
+	  break;
 	case SYS_execv:
+		/* only returns on failure, which a vfork child must see */
 		err = sys_execv((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
-
-		panic("sys_execv shall not return... I will just die for now...");
+		break;
+	case SYS_spawn:
+		err = sys_spawn((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1,
+				(userptr_t)tf->tf_a2, (pid_t *)&retval);
 		break;
 #endif
 	default:
@@ -189,8 +223,93 @@ void
 enter_forked_process(struct trapframe *tf)
 {
 	struct trapframe tf_copy = *((struct trapframe*) tf);
+
+#if OPT_A2
+	/* It's on our stack now; give back the copy sys_fork made. */
+	trapframe_free(tf);
+#endif
 	tf_copy.tf_epc += 4;
 	tf_copy.tf_v0 = 0;
 	tf_copy.tf_a3 = 0;
 	mips_usermode(&tf_copy);
 }
+
+#if OPT_A2
+/*
+ * Cache for the copies of the parent's trapframe that sys_fork hands
+ * to the child thread. The child copies it onto its own stack in
+ * enter_forked_process and frees it there.
+ */
+static struct objcache *trapframe_cache;
+
+void
+trapframe_bootstrap(void)
+{
+	trapframe_cache = objcache_create("trapframe",
+					  sizeof(struct trapframe),
+					  NULL, NULL);
+	if (trapframe_cache == NULL) {
+		panic("trapframe_bootstrap: Out of memory\n");
+	}
+}
+
+struct trapframe *
+trapframe_copy(const struct trapframe *tf)
+{
+	struct trapframe *newtf;
+
+	newtf = objcache_alloc(trapframe_cache);
+	if (newtf == NULL) {
+		return NULL;
+	}
+	*newtf = *tf;
+	return newtf;
+}
+
+void
+trapframe_free(struct trapframe *tf)
+{
+	objcache_free(trapframe_cache, tf);
+}
+
+/*
+ * Make the trapframe for a new user thread in the current process.
+ * It starts as a copy of the creating thread's, so that registers the
+ * ABI expects to be set up once per process (the global pointer in
+ * particular) carry over, and then is pointed at ENTRY with the given
+ * arguments and stack.
+ */
+struct trapframe *
+trapframe_newthread(const struct trapframe *tf, vaddr_t entry,
+		    userptr_t arg1, userptr_t arg2, vaddr_t stack)
+{
+	struct trapframe *newtf;
+
+	newtf = trapframe_copy(tf);
+	if (newtf == NULL) {
+		return NULL;
+	}
+	newtf->tf_epc = entry;
+	newtf->tf_a0 = (vaddr_t)arg1;
+	newtf->tf_a1 = (vaddr_t)arg2;
+	newtf->tf_sp = stack;
+	newtf->tf_ra = 0;
+	newtf->tf_v0 = 0;
+	newtf->tf_a3 = 0;
+	return newtf;
+}
+
+/*
+ * Enter user mode in a new thread, using a trapframe from
+ * trapframe_newthread. As in enter_forked_process, it has to be
+ * moved onto our own stack first.
+ */
+void
+enter_new_thread(struct trapframe *tf)
+{
+	struct trapframe tf_copy = *tf;
+
+	trapframe_free(tf);
+	mips_usermode(&tf_copy);
+}
+#endif /* OPT_A2 */
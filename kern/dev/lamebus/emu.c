@@ -48,6 +48,7 @@
 #include <array.h>
 #include <uio.h>
 #include <synch.h>
+#include <callout.h>
 #include <lamebus/emu.h>
 #include <platform/bus.h>
 #include <vfs.h>
@@ -159,14 +160,31 @@ translate_err(struct emu_softc *sc, uint32_t code)
 	return EAGAIN;
 }
 
+/*
+ * How long an operation may take before we complain about it.
+ */
+#define EMU_TIMEOUT   2000000   /* usec */
+
 /*
  * Wait for an operation to complete, and return an errno for the result.
+ *
+ * An operation that takes too long is reported, so a stuck device
+ * shows up on the console, but not abandoned or reissued: not all the
+ * operations can safely be done twice, and a completion arriving
+ * after we'd given up would be taken for the next operation's.
  */
 static
 int
 emu_waitdone(struct emu_softc *sc)
 {
-	P(sc->e_sem);
+	uint32_t deadline;
+
+	deadline = callout_now() + callout_usec2ticks(EMU_TIMEOUT);
+	if (sem_timedP(sc->e_sem, deadline) == ETIMEDOUT) {
+		kprintf("emu%d: operation timed out, still waiting\n",
+			sc->e_unit);
+		P(sc->e_sem);
+	}
 	return translate_err(sc, sc->e_result);
 }
 
@@ -36,6 +36,7 @@
 #include <lib.h>
 #include <uio.h>
 #include <synch.h>
+#include <callout.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -59,6 +60,13 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/*
+ * How long to wait for a sector before reporting that the disk is
+ * slow to answer. A sector normally takes a few ms even on a slow
+ * disk.
+ */
+#define LHD_TIMEOUT     1000000   /* usec */
+
 /*
  * Shortcut for reading a register.
  */
@@ -206,7 +214,7 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
+	uint32_t i, deadline;
 	uint32_t statval = LHD_WORKING;
 	int result;
 
@@ -249,8 +257,20 @@ lhd_io(struct device *d, struct uio *uio)
 		/* and start the operation. */
 		lhd_wreg(lh, LHD_REG_STAT, statval);
 
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
+		/*
+		 * Now wait until the interrupt handler tells us we're
+		 * done. If that's taking too long, say so, but keep
+		 * waiting: the request can't be reissued safely, since
+		 * if the first one then completed late its completion
+		 * would be taken for the next sector's, and we'd read
+		 * the buffer before that sector had been transferred.
+		 */
+		deadline = callout_now() + callout_usec2ticks(LHD_TIMEOUT);
+		if (sem_timedP(lh->lh_done, deadline) == ETIMEDOUT) {
+			kprintf("lhd%d: sector %u: timed out, still waiting\n",
+				lh->lh_unit, sector+i);
+			P(lh->lh_done);
+		}
 
 		/* Get the result value saved by the interrupt handler. */
 		result = lh->lh_result;
@@ -282,6 +282,12 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return ENXIO;
 	}
 
+	result = sfs_vnode_cache_init();
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
 	if (sfs==NULL) {
@@ -44,11 +44,33 @@
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
+#include <objcache.h>
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/* In-memory vnodes, shared by all mounted sfs volumes. */
+static struct objcache *sfs_vnode_cache;
+
+/*
+ * Create sfs_vnode_cache if this is the first mount. Called from
+ * sfs_domount with the vfs biglock held.
+ */
+int
+sfs_vnode_cache_init(void)
+{
+	if (sfs_vnode_cache == NULL) {
+		sfs_vnode_cache = objcache_create("sfs_vnode",
+						  sizeof(struct sfs_vnode),
+						  NULL, NULL);
+		if (sfs_vnode_cache == NULL) {
+			return ENOMEM;
+		}
+	}
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
@@ -953,7 +975,7 @@ sfs_reclaim(struct vnode *v)
 	vfs_biglock_release();
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	objcache_free(sfs_vnode_cache, sv);
 
 	/* Done */
 	return 0;
@@ -1685,7 +1707,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = objcache_alloc(sfs_vnode_cache);
 	if (sv==NULL) {
 		return ENOMEM;
 	}
@@ -1699,7 +1721,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
-		kfree(sv);
+		objcache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -1736,7 +1758,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		objcache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -1747,7 +1769,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
 	if (result) {
 		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
+		objcache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -0,0 +1,49 @@
+#ifndef _CALLOUT_H_
+#define _CALLOUT_H_
+
+/*
+ * Callouts: functions to be called once at some point in the future.
+ *
+ * Time is measured in callout ticks, which are calls to timerclock()
+ * (one every LT_GRANULARITY usec, on one cpu). callout_now() returns
+ * the current tick count; it wraps, so compare times only with
+ * callout_expired. callout_usec2ticks converts a duration, rounding
+ * up, so a sleep of at least that long can be requested.
+ *
+ * A callout's function runs in interrupt context on the timer cpu,
+ * with no locks held, so it may do the things an interrupt handler
+ * may do (wake threads up, for instance) but not sleep.
+ *
+ * The struct callout belongs to the caller, who must keep it around
+ * until it has either fired or been stopped. callout_stop waits for
+ * the function to finish if it is running at the time, so once it
+ * returns the callout and its argument may be freed. Consequently
+ * callout_stop must not be called from the callout's own function,
+ * or while holding a spinlock that function takes.
+ */
+
+struct callout {
+	struct callout *co_next;	/* wheel slot list */
+	struct callout **co_prevp;	/* pointer to us, or NULL if idle */
+	uint32_t co_expire;		/* tick to fire at */
+	void (*co_func)(void *);
+	void *co_arg;
+};
+
+void callout_init(struct callout *co, void (*func)(void *), void *arg);
+
+/* Arrange for CO to fire at tick DEADLINE (or TICKS ticks from now). */
+void callout_schedule_at(struct callout *co, uint32_t deadline);
+void callout_schedule(struct callout *co, unsigned ticks);
+
+/* Cancel CO. Returns true if it was pending and now will not fire. */
+bool callout_stop(struct callout *co);
+
+uint32_t callout_now(void);
+bool callout_expired(uint32_t deadline);
+unsigned callout_usec2ticks(uint64_t usec);
+
+/* Called from timerclock. */
+void callout_tick(void);
+
+#endif /* _CALLOUT_H_ */
@@ -38,10 +38,14 @@
  * hardclock() is called on every CPU HZ times a second, possibly only
  * when the CPU is not idle, for scheduling.
  *
- * timerclock() is called on one CPU once a second to allow simple
- * timed operations. (This is a fairly simpleminded interface.)
+ * timerclock() is called on one CPU every LT_GRANULARITY usec and
+ * advances the callout wheel (see callout.h), which handles timed
+ * operations.
  *
  * gettime() may be used to fetch the current time of day.
+ * gettime_ns() returns the same thing as a single count of
+ * nanoseconds, for timestamping; it returns 0 if called before the
+ * clock device has been attached.
  * getinterval() computes the time from time1 to time2.
  *
  * XXX we have struct timespec now, let's use it.
@@ -56,12 +60,19 @@
 #define HZ  100
 #endif
 
+/*
+ * Timing constants. These should be tuned along with any work done on
+ * the scheduler.
+ */
+#define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
+
 void hardclock_bootstrap(void);
 
 void hardclock(void);
 void timerclock(void);
 
 void gettime(time_t *seconds, uint32_t *nanoseconds);
+uint64_t gettime_ns(void);
 
 void getinterval(time_t secs1, uint32_t nsecs,
                  time_t secs2, uint32_t nsecs2,
@@ -70,8 +81,6 @@ void getinterval(time_t secs1, uint32_t nsecs,
 /*
  * clocksleep() suspends execution for the requested number of seconds,
  * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
- *
- *  this will be more efficient than clocknap() for longer sleeps
  */
 void clocksleep(int seconds);
 
@@ -80,8 +89,11 @@ void clocksleep(int seconds);
  *
  * the timer ticks every LT_GRANULARITY usec (see kern/dev/ltimer.h)
  *
+ * clocksleep_usec() suspends execution for at least the requested
+ * number of microseconds; it is accurate to one timer tick.
  */
 void clocknap(int ticks);
+void clocksleep_usec(uint64_t usecs);
 
 
 #endif /* _CLOCK_H_ */
@@ -35,6 +35,15 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+/*
+ * Number of scheduler priority levels. Each cpu has one run queue per
+ * level; level 0 is the highest priority. See schedule() in thread.c.
+ */
+#define NPRIORITIES 4
+
+/* Buckets in the run queue wait histogram; see thread.c. */
+#define RQWAIT_BUCKETS 16
+
 
 /*
  * Per-cpu structure
@@ -60,13 +69,35 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_idleclocks;		/* hardclock() calls while idle */
+	unsigned c_steals;		/* Threads stolen from other cpus */
+	unsigned c_stealmisses;		/* Steal attempts that got nothing */
+	unsigned c_wakemoves;		/* Wakeups we sent to an idle cpu */
+	unsigned c_wakeups;		/* Woken threads switched to here */
+	uint64_t c_wakelat;		/* Their total wakeup latency (ns) */
+	uint64_t c_wakelatmax;		/* Their worst wakeup latency (ns) */
+	unsigned c_rqwait[RQWAIT_BUCKETS]; /* Run queue wait histogram */
+	struct threadlist c_threadpool;	/* Dead threads kept for reuse */
+	unsigned c_poolhits;		/* thread_create calls using the pool */
+	unsigned c_poolmisses;		/* thread_create calls that didn't */
+	unsigned c_forks;		/* thread_fork calls */
+	uint64_t c_forktime;		/* Total time in thread_fork (ns) */
+	unsigned c_lockfree;		/* lock_acquires that didn't wait */
+	unsigned c_lockspins;		/* ...that spun but didn't sleep */
+	unsigned c_lockblocks;		/* ...that slept */
+
+	/*
+	 * Written only by this cpu; read by other cpus without locking.
+	 */
+	volatile unsigned c_epochgen;	/* Bumped by each thread_switch */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[NPRIORITIES]; /* Run queues, by level */
+	unsigned c_runcount;		/* Threads on all the run queues */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -0,0 +1,59 @@
+#ifndef _EPOCH_H_
+#define _EPOCH_H_
+
+/*
+ * Epoch-based deferred reclamation, for read-mostly tables.
+ *
+ * Readers of a table protected this way take no locks. They bracket
+ * each lookup with epoch_enter and epoch_exit, and may not sleep (or
+ * otherwise switch threads) in between. A writer changes the table by
+ * building a new version and storing a pointer to it; the old version
+ * may still be in use by readers that got there first, so instead of
+ * freeing it right away the writer hands it to epoch_call. It is
+ * freed once every cpu has been through thread_switch, or been idle,
+ * since then, because by that time no reader can still be looking at
+ * it.
+ *
+ * Writers still need a lock among themselves; this only takes the
+ * readers out of it.
+ *
+ * A read section keeps interrupts off (that's what keeps us from
+ * switching threads), so it should be short: a lookup, not a walk
+ * over something big. Read sections may be nested. They are for
+ * thread context only; interrupt handlers must not use them, since
+ * an idle cpu counts as having passed through.
+ *
+ * Functions:
+ *    epoch_enter        Begin a read section.
+ *    epoch_exit         End it.
+ *    epoch_call         Call FUNC(ARG) once all read sections running
+ *                       now have ended. EC is storage for the request,
+ *                       usually embedded in the object being freed,
+ *                       and must stay put until FUNC is called. Does
+ *                       not sleep.
+ *    epoch_defer        The same, but allocates the request itself;
+ *                       if that fails it waits for the read sections
+ *                       and calls FUNC before returning. May sleep.
+ *    epoch_synchronize  Wait until all read sections running now have
+ *                       ended. May sleep.
+ *
+ * The callbacks are run by a kernel thread started by
+ * epoch_bootstrap; until then they accumulate.
+ */
+
+struct epochcb {
+	struct epochcb *ec_next;
+	void (*ec_func)(void *);
+	void *ec_arg;
+};
+
+void epoch_bootstrap(void);
+
+void epoch_enter(void);
+void epoch_exit(void);
+
+void epoch_call(struct epochcb *ec, void (*func)(void *), void *arg);
+void epoch_defer(void (*func)(void *), void *arg);
+void epoch_synchronize(void);
+
+#endif /* _EPOCH_H_ */
@@ -0,0 +1,19 @@
+#ifndef _KERN_FUTEX_H_
+#define _KERN_FUTEX_H_
+
+/*
+ * Operations for __futex().
+ *
+ * FUTEX_WAIT	If the int at UADDR is still VAL, sleep until woken by
+ *		FUTEX_WAKE on the same address, or until TIMEOUT (a
+ *		relative time; NULL means forever) passes. Fails with
+ *		EAGAIN if the value had already changed, and ETIMEDOUT
+ *		if the time ran out.
+ *
+ * FUTEX_WAKE	Wake up to VAL threads waiting on UADDR. Returns how
+ *		many were woken.
+ */
+#define FUTEX_WAIT	0
+#define FUTEX_WAKE	1
+
+#endif /* _KERN_FUTEX_H_ */
@@ -197,6 +197,15 @@
 #define SYS_reboot       119
 //#define SYS___sysctl   120
 
+//                              -- Threads --
+#define SYS___thread_create 121
+#define SYS___thread_exit   122
+#define SYS___thread_join   123
+#define SYS___futex         124
+
+//                              -- Process-related (cont.) --
+#define SYS_spawn           125
+
 /*CALLEND*/
 
 
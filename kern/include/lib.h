@@ -127,6 +127,14 @@ void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
 
+/*
+ * kmalloc_from is kmalloc for allocation wrappers: with the kmalloc
+ * profiler compiled in, the block is charged to CALLER rather than to
+ * the wrapper. kmprof_printstats dumps the profile.
+ */
+void *kmalloc_from(size_t size, const void *caller);
+void kmprof_printstats(void);
+
 /*
  * C string functions. 
  *
@@ -0,0 +1,42 @@
+#ifndef _LOCKSTAT_H_
+#define _LOCKSTAT_H_
+
+/*
+ * Lock statistics.
+ *
+ * With "options lockstat" in the kernel config, spinlock_acquire and
+ * lock_acquire record, per lock: how many times it was acquired, how
+ * many of those found it held, how many times they went around the
+ * spin loop, how long they waited in all, and the longest time it was
+ * held. The "lockstat" menu command prints the locks sorted by
+ * contention.
+ *
+ * Locks are looked up by address in a fixed table, so nothing has to
+ * be added to the lock structures. A lock's entry is given back when
+ * the lock is destroyed, and its numbers are added to the "(others)"
+ * line, which also has the locks that didn't fit in the table.
+ *
+ * Sleep locks are named after the lock; spinlocks have no names, so
+ * they're shown with the address of the first place they were
+ * acquired from, unless given a name with lockstat_setname.
+ *
+ * The hooks called by the lock code exist only when the option is
+ * on; lockstat_setname, lockstat_clear, and lockstat_printstats always
+ * exist, and do nothing (or say so) when it's off.
+ */
+
+#include "opt-lockstat.h"
+
+#if OPT_LOCKSTAT
+void lockstat_init(const void *lock, const char *name, bool sleep);
+void lockstat_acquired(const void *lock, const void *caller, bool sleep,
+		       bool contended, unsigned spins, uint64_t waitstart);
+void lockstat_released(const void *lock);
+void lockstat_fini(const void *lock);
+#endif
+
+void lockstat_setname(const void *lock, const char *name);
+void lockstat_clear(void);
+void lockstat_printstats(bool all);
+
+#endif /* _LOCKSTAT_H_ */
@@ -0,0 +1,46 @@
+#ifndef _MCSLOCK_H_
+#define _MCSLOCK_H_
+
+/*
+ * MCS queue spinlocks.
+ *
+ * Like a struct spinlock, an MCS lock is held by a cpu, with
+ * interrupts off, and handed out in the order it was asked for. The
+ * difference is where the waiters spin: each brings its own queue
+ * node, links it on the end of the line with an atomic swap, and
+ * spins on a flag in that node until the holder before it clears it.
+ * So a release touches one other cpu's node rather than a word every
+ * waiter is spinning on, which matters for heavily contended locks.
+ *
+ * The node is passed to both acquire and release and must stay put in
+ * between; a local variable in the function holding the lock does
+ * nicely, since nothing can switch threads while it's held.
+ */
+
+#include <spinlock.h>
+
+struct mcsnode {
+	volatile spinlock_data_t mn_next;	/* next in line, or 0 */
+	volatile spinlock_data_t mn_wait;	/* nonzero until our turn */
+};
+
+struct mcslock {
+	volatile spinlock_data_t ml_tail;	/* last in line; 0 if free */
+	struct cpu *ml_holder;			/* CPU holding this lock */
+};
+
+#define MCSLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+
+/*
+ * init, cleanup, acquire, release, and do_i_hold are as for spinlocks.
+ */
+void mcslock_init(struct mcslock *lk);
+void mcslock_cleanup(struct mcslock *lk);
+
+void mcslock_acquire(struct mcslock *lk, struct mcsnode *node);
+void mcslock_release(struct mcslock *lk, struct mcsnode *node);
+
+bool mcslock_do_i_hold(struct mcslock *lk);
+bool mcslock_is_busy(struct mcslock *lk);
+
+#endif /* _MCSLOCK_H_ */
@@ -0,0 +1,63 @@
+#ifndef _OBJCACHE_H_
+#define _OBJCACHE_H_
+
+/*
+ * Object caches (slab allocator).
+ *
+ * An object cache hands out fixed-size objects carved from whole
+ * pages. Unlike kmalloc, the objects are kept in their constructed
+ * state while they sit in the cache: the constructor runs once when
+ * a slab is populated and the destructor runs once when the slab is
+ * given back to the VM system, not on every alloc and free. So an
+ * object's embedded spinlocks, list nodes, sub-objects, and so forth
+ * must be returned to objcache_free in the same state the constructor
+ * left them in.
+ *
+ * The constructor returns 0 or an error code; if it fails the
+ * allocation that needed the object fails too.
+ *
+ * Objects must be at most OBJCACHE_MAXSIZE bytes. They are aligned
+ * to 8 bytes, or to more with objcache_create_aligned (for objects
+ * with members that must start a cache line).
+ */
+
+#define OBJCACHE_MAXSIZE  1024
+
+struct objcache;
+
+typedef int (*objcache_ctor_t)(void *obj);
+typedef void (*objcache_dtor_t)(void *obj);
+
+/*
+ * Create a cache of SIZE-byte objects. NAME should be a string
+ * constant. CTOR and DTOR may be NULL. Returns NULL if out of memory.
+ */
+struct objcache *objcache_create(const char *name, size_t size,
+				 objcache_ctor_t ctor, objcache_dtor_t dtor);
+
+/*
+ * The same, but the objects are aligned to ALIGN bytes, which must be
+ * a power of 2 no bigger than OBJCACHE_MAXSIZE.
+ */
+struct objcache *objcache_create_aligned(const char *name, size_t size,
+					 size_t align, objcache_ctor_t ctor,
+					 objcache_dtor_t dtor);
+
+/*
+ * Destroy a cache. All of its objects must already have been freed.
+ */
+void objcache_destroy(struct objcache *oc);
+
+/*
+ * Get an object from the cache, or return one to it. objcache_alloc
+ * returns NULL if out of memory or if the constructor failed.
+ */
+void *objcache_alloc(struct objcache *oc);
+void objcache_free(struct objcache *oc, void *obj);
+
+/*
+ * Print usage statistics for all caches.
+ */
+void objcache_printstats(void);
+
+#endif /* _OBJCACHE_H_ */
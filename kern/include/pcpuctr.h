@@ -0,0 +1,68 @@
+#ifndef _PCPUCTR_H_
+#define _PCPUCTR_H_
+
+/*
+ * Per-cpu statistics counters.
+ *
+ * A struct pcpuctr is a set of NUM counters, each of which every cpu
+ * keeps its own copy of. Each cpu's copies are together in their own
+ * cache lines, so counting something touches only memory that cpu
+ * already owns: no lock, no atomic operation, and no cache line
+ * bouncing between cpus. Reading a counter adds up the copies, so it
+ * costs MAXCPUS loads and is only as current as the copies are; it's
+ * meant for statistics, not for anything that has to be exact at an
+ * instant.
+ *
+ * The storage is supplied by the user so that the counters can be
+ * static, and so usable before kmalloc works (or by kmalloc itself):
+ *
+ *    static PCPUCTR_STORAGE(mystats_slots, MYSTAT_COUNT);
+ *    static struct pcpuctr mystats =
+ *            PCPUCTR_INITIALIZER(mystats_slots, MYSTAT_COUNT);
+ *
+ * Functions:
+ *    pcpuctr_add     Add DELTA to counter WHICH for the current cpu.
+ *                    Safe from interrupt handlers.
+ *    pcpuctr_inc     Add 1.
+ *    pcpuctr_read    Get the sum of counter WHICH over all cpus.
+ *    pcpuctr_readcpu Get cpu CPUNUM's copy of counter WHICH.
+ *    pcpuctr_zero    Zero all the counters. Increments on other cpus
+ *                    at the same moment may or may not survive.
+ */
+
+#include <platform/maxcpus.h>
+
+#define PCPUCTR_LINE  64	/* cache line size, or a multiple of it */
+
+/* Words of counters per cpu: NUM rounded up to whole cache lines. */
+#define PCPUCTR_STRIDE(num) \
+	((((num) * sizeof(unsigned)) + PCPUCTR_LINE - 1) / PCPUCTR_LINE * \
+	 (PCPUCTR_LINE / sizeof(unsigned)))
+
+#define PCPUCTR_STORAGE(name, num) \
+	volatile unsigned name[MAXCPUS * PCPUCTR_STRIDE(num)] \
+		__attribute__((__aligned__(PCPUCTR_LINE)))
+
+struct pcpuctr {
+	volatile unsigned *pc_slots;	/* MAXCPUS rows of pc_stride */
+	unsigned pc_num;		/* counters in the set */
+	unsigned pc_stride;		/* words per cpu row */
+};
+
+#define PCPUCTR_INITIALIZER(slots, num) \
+	{ (slots), (num), PCPUCTR_STRIDE(num) }
+
+void pcpuctr_add(struct pcpuctr *pc, unsigned which, unsigned delta);
+unsigned pcpuctr_read(struct pcpuctr *pc, unsigned which);
+unsigned pcpuctr_readcpu(struct pcpuctr *pc, unsigned which,
+			 unsigned cpunum);
+void pcpuctr_zero(struct pcpuctr *pc);
+
+static inline
+void
+pcpuctr_inc(struct pcpuctr *pc, unsigned which)
+{
+	pcpuctr_add(pc, which, 1);
+}
+
+#endif /* _PCPUCTR_H_ */
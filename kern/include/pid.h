@@ -0,0 +1,59 @@
+#ifndef _PID_H_
+#define _PID_H_
+
+/*
+ * Process id table.
+ *
+ * Each pid has an entry, which holds the process while it runs and
+ * its exit status after that, until the parent collects it with
+ * waitpid; then the pid goes back on the free list. If the parent
+ * exits first, or was the kernel (pid 0), nobody will collect it, so
+ * the pid is freed as soon as the process exits.
+ *
+ * Entries are allocated PID_CHUNK at a time, as needed, up to PID_MAX,
+ * and never move or go away once allocated, so a pointer to one stays
+ * good. Free pids are handed out oldest first, so a pid isn't reused
+ * until all the others that were free have been.
+ *
+ * Each entry is also the record of that process as a child: it's on
+ * its parent's list of running children, and moves to the parent's
+ * list of exited children when it exits. So waiting for a particular
+ * child, or for any child, and disowning them all at exit, don't
+ * involve looking at anyone else's entries. Each entry has its own
+ * spinlock and two wait channels: one where the parent waits for that
+ * process in particular, and one where the process itself waits for
+ * any of its children. An exit wakes only its parent. The table lock
+ * is only taken to allocate and free pids; finding the entry for a
+ * pid takes no locks, since entries never move or go away.
+ *
+ * Functions:
+ *    pid_bootstrap   Set up the table. Call once at startup.
+ *    pid_alloc       Get a pid for PROC, whose parent is PARENT (0 if
+ *                    none). Fails with ENPROC if they're all in use.
+ *    pid_exit        Record that the process with this pid has exited
+ *                    with status STATUS, and wake its parent if it's
+ *                    waiting. Its own children are disowned.
+ *    pid_wait        Wait for child PID of PARENT to exit, or for any
+ *                    child if PID is WAIT_ANY, and collect its status
+ *                    and pid. With NOHANG, don't wait; hand back pid
+ *                    0 if there's nothing to collect yet. Fails with
+ *                    ECHILD if PID isn't a child of PARENT, or has
+ *                    already been collected, or (for WAIT_ANY) if
+ *                    PARENT has no children left.
+ *    pid_unalloc     Give back PID if PROC still holds it and never
+ *                    exited (e.g., fork failed after allocating it).
+ *                    Does nothing otherwise. Called from proc_destroy.
+ */
+
+struct proc;
+
+#define PID_CHUNK  64		/* entries allocated at a time */
+
+void pid_bootstrap(void);
+int pid_alloc(struct proc *proc, pid_t parent, pid_t *retval);
+void pid_exit(pid_t pid, int status);
+int pid_wait(pid_t pid, pid_t parent, bool nohang,
+	     int *status, pid_t *retpid);
+void pid_unalloc(pid_t pid, struct proc *proc);
+
+#endif /* _PID_H_ */
@@ -48,17 +48,6 @@ struct semaphore;
 
 #endif // UW
 
-#ifdef OPT_A2
-	struct lock *lk_pid;
-	volatile pid_t counter_pid;
-	struct proc *procTable[64]; //lookup table for child PID
-	volatile int exitTable[64];
-	struct lock * lk_tb;
-	struct lock * mutex;
-	volatile int aliveTable[64];
-#endif
-
-
 /*
  * Process structure.
  */
@@ -83,15 +72,17 @@ struct proc {
 #endif
 
 #ifdef OPT_A2
-	pid_t pid;
-	int countChild;
-	struct cv * cv_child;
-	pid_t childArray[64]; //Maximum 64 childrens
-	struct lock *lk_child;
-	volatile bool isAlive;
-	volatile int code;
-	volatile int status;
+	pid_t pid;			/* See pid.h; 0 for kproc */
+
+	/* User-level threads; see thread_syscalls.c */
+	struct lock *p_thlock;		/* Protects the fields below */
+	struct cv *p_thcv;		/* Signalled when a thread exits */
+	struct uthread *p_uthreads;	/* Threads from __thread_create */
+	int p_nexttid;			/* Next thread id to hand out */
+	volatile bool p_exiting;	/* Other threads must exit */
 
+	/* Set while borrowing the parent's address space; see sys_vfork */
+	struct semaphore *p_vforksem;
 #endif
 	/* add more material here as needed */
 };
@@ -119,6 +110,22 @@ int proc_addthread(struct proc *proc, struct thread *t);
 /* Detach a thread from its process. */
 void proc_remthread(struct thread *t);
 
+#if OPT_A2
+/*
+ * User-level thread support, in thread_syscalls.c.
+ *
+ * uthread_killothers makes every other thread in the current process
+ * exit and waits for them; it's used by _exit and execv. If another
+ * thread got there first, the caller exits instead and it does not
+ * return. uthread_checkexit is called on the way back to user mode
+ * and exits the current thread if that is under way.
+ * uthread_cleanup frees a dead process's thread records.
+ */
+void uthread_killothers(void);
+void uthread_checkexit(void);
+void uthread_cleanup(struct proc *proc);
+#endif
+
 /* Fetch the address space of the current process. */
 struct addrspace *curproc_getas(void);
 
@@ -87,5 +87,8 @@ int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
+/* Set up the vnode cache on first mount */
+int sfs_vnode_cache_init(void);
+
 
 #endif /* _SFS_H_ */
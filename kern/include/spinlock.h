@@ -50,19 +50,27 @@
  *
  * Note that spinlocks are held by CPUs, not by threads.
  *
+ * This is a ticket lock: each cpu that wants the lock takes the next
+ * number from lk_next, and waits until lk_serving gets to it, so the
+ * lock is handed out in the order it was asked for and no cpu can be
+ * starved. Waiters only read lk_serving while they spin; it is only
+ * written once per release.
+ *
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
  */
 struct spinlock {
-	volatile spinlock_data_t lk_lock; /* The memory word where we spin. */
+	volatile spinlock_data_t lk_next;    /* Next ticket to hand out. */
+	volatile spinlock_data_t lk_serving; /* Ticket holding the lock. */
 	struct cpu *lk_holder;		/* CPU holding this lock. */
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER \
+	{ SPINLOCK_DATA_INITIALIZER, SPINLOCK_DATA_INITIALIZER, NULL }
 
 /*
  * Spinlock functions.
@@ -74,6 +82,9 @@ struct spinlock {
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ *
+ * is_busy	Check if any CPU holds the lock. This is only a snapshot,
+ *		for statistics; it may be stale by the time it returns.
  */
 
 void spinlock_init(struct spinlock *lk);
@@ -83,6 +94,7 @@ void spinlock_acquire(struct spinlock *lk);
 void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
+bool spinlock_is_busy(struct spinlock *lk);
 
 
 #endif /* _SPINLOCK_H_ */
@@ -37,6 +37,12 @@
 
 #include <spinlock.h>
 
+/*
+ * Call once during system startup, after wchan_bootstrap and before
+ * any of the primitives below are created.
+ */
+void synch_bootstrap(void);
+
 /*
  * Dijkstra-style semaphore.
  *
@@ -62,6 +68,13 @@ void sem_destroy(struct semaphore *);
 void P(struct semaphore *);
 void V(struct semaphore *);
 
+/*
+ * Like P, but give up once callout tick DEADLINE (see callout.h) has
+ * passed. Returns 0 on success, or ETIMEDOUT without decrementing the
+ * count.
+ */
+int sem_timedP(struct semaphore *, uint32_t deadline);
+
 
 /*
  * Simple lock for mutual exclusion.
@@ -98,6 +111,12 @@ void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 void lock_destroy(struct lock *);
 
+/*
+ * Print counts of uncontended, spinning, and sleeping acquisitions.
+ * (This lives in thread.c with the other per-cpu statistics.)
+ */
+void lock_printstats(void);
+
 
 /*
  * Condition variable.
@@ -127,16 +146,90 @@ void cv_destroy(struct cv *);
  *                   waking up again, re-acquire the lock.
  *    cv_signal    - Wake up one thread that's sleeping on this CV.
  *    cv_broadcast - Wake up all threads sleeping on this CV.
+ *    cv_timedwait - Like cv_wait, but give up once callout tick DEADLINE
+ *                   (see callout.h) has passed. Returns 0 if woken up,
+ *                   or ETIMEDOUT. The lock is re-acquired either way.
  *
- * For all three operations, the current thread must hold the lock passed
+ * For all four operations, the current thread must hold the lock passed
  * in. Note that under normal circumstances the same lock should be used
- * on all operations with any particular CV.
+ * on all operations with any particular CV. (Woken threads are queued
+ * on that lock and get it in turn as it's released, so it must be.)
  *
  * These operations must be atomic. You get to write them.
  */
 void cv_wait(struct cv *cv, struct lock *lock);
+int cv_timedwait(struct cv *cv, struct lock *lock, uint32_t deadline);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of threads may hold the lock for reading at once, or one
+ * thread may hold it for writing. Like the lock above, it may be held
+ * across sleeps but not taken in interrupt handlers.
+ *
+ * The reader count is split over RWLOCK_NSLOTS slots, each in its own
+ * cache line with its own spinlock (the slots are aligned to
+ * RWLOCK_SLOTSIZE, and rwlock_create's allocations honour that); a reader bumps the slot of the cpu
+ * it's on, so readers on different cpus don't touch the same memory.
+ * A writer sets rwl_writer, which turns new readers away, and then
+ * waits for the sum of the slots to drain to zero. (A reader may be
+ * released on a different cpu than it acquired on, so individual
+ * slots can go negative; only the sum means anything.)
+ *
+ * Once a writer has the lock or is draining readers, new readers
+ * wait. If the lock is created with WRITERPREF set, new readers also
+ * wait while any writer is queued, and a writer releasing the lock
+ * hands it to the next writer ahead of waiting readers; otherwise
+ * a writer's release lets all waiting readers in first. The former
+ * keeps a stream of readers from starving writers; the latter keeps
+ * a stream of writers from starving readers.
+ */
+#define RWLOCK_NSLOTS    8
+#define RWLOCK_SLOTSIZE  64	/* at least one cache line */
+
+struct rwlock_slot {
+	union {
+		struct {
+			struct spinlock rs_lock;
+			volatile int rs_readers;
+		} rs;
+		char rs_pad[RWLOCK_SLOTSIZE];
+	} rs_u;
+} __attribute__((__aligned__(RWLOCK_SLOTSIZE)));
+
+struct rwlock {
+	char *rwl_name;
+	struct rwlock_slot rwl_slots[RWLOCK_NSLOTS];
+	struct spinlock rwl_lock;	/* protects what follows */
+	struct wchan *rwl_readwc;	/* readers waiting */
+	struct wchan *rwl_writewc;	/* writers waiting for other writers */
+	struct wchan *rwl_drainwc;	/* writer waiting for readers to leave */
+	volatile bool rwl_writer;	/* a writer holds it or is draining */
+	struct thread *rwl_owner;	/* that writer */
+	volatile unsigned rwl_writers_waiting;
+	bool rwl_writerpref;
+};
+
+struct rwlock *rwlock_create(const char *name, bool writerpref);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading, shared with other
+ *                           readers.
+ *    rwlock_acquire_write - Get the lock for writing, exclusively.
+ *    rwlock_release       - Give up the lock, either way it was acquired.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                           the lock for writing. (There is no way to
+ *                           tell whether a thread holds it for reading.)
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
@@ -47,6 +47,33 @@ void syscall(struct trapframe *tf);
 /* Helper for fork(). You write this. */
 void enter_forked_process(struct trapframe *tf);
 
+#if OPT_A2
+/*
+ * Trapframe copies passed from sys_fork to enter_forked_process,
+ * which frees them.
+ */
+void trapframe_bootstrap(void);
+struct trapframe *trapframe_copy(const struct trapframe *tf);
+void trapframe_free(struct trapframe *tf);
+
+/*
+ * Trapframes for new threads in an existing process, passed from
+ * sys___thread_create to enter_new_thread, which frees them.
+ */
+struct trapframe *trapframe_newthread(const struct trapframe *tf,
+				      vaddr_t entry, userptr_t arg1,
+				      userptr_t arg2, vaddr_t stack);
+void enter_new_thread(struct trapframe *tf);
+
+/*
+ * Futex wait queues (futex.c). futex_interrupt wakes everything
+ * waiting on a futex in an address space, with EINTR.
+ */
+struct addrspace;
+void futex_bootstrap(void);
+void futex_interrupt(struct addrspace *as);
+#endif
+
 /* Enter user mode. Does not return. */
 void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 		       vaddr_t entrypoint);
@@ -58,6 +85,7 @@ void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(userptr_t user_req, userptr_t user_rem);
 
 #ifdef UW
 int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
@@ -69,7 +97,17 @@ int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
 
 #if OPT_A2
 int sys_fork(struct trapframe *tf, pid_t *retval);
+int sys_vfork(struct trapframe *tf, pid_t *retval);
 int sys_execv(userptr_t interface_progname, userptr_t interface_args);
+int sys_spawn(userptr_t upath, userptr_t uargv, userptr_t uconsole,
+	      pid_t *retval);
+int sys___thread_create(struct trapframe *tf, userptr_t entry,
+			userptr_t arg1, userptr_t arg2, userptr_t stack,
+			int32_t *retval);
+void sys___thread_exit(int value);
+int sys___thread_join(int tid, userptr_t value);
+int sys___futex(userptr_t uaddr, int op, int val, userptr_t timeout,
+		int32_t *retval);
 #endif // OPT_A2
 
 
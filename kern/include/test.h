@@ -57,9 +57,16 @@ int queuetest(int, char **);
 int threadtest(int, char **);
 int threadtest2(int, char **);
 int threadtest3(int, char **);
+int schedtest(int, char **);
+int forkbenchtest(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int timedtest(int, char **);
+int epochtest(int, char **);
+int rwtest(int, char **);
+int rwperftest(int, char **);
+int spinlocktest(int, char **);
 
 #ifdef UW
 /* Another thread and synchronization test */
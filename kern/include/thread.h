@@ -55,6 +55,9 @@ struct cpu;
 /* Macro to test if two addresses are on the same kernel stack */
 #define SAME_STACK(p1, p2)     (((p1) & STACK_MASK) == ((p2) & STACK_MASK))
 
+/* Most dead threads (with their stacks) each cpu keeps for reuse */
+#define THREADPOOL_MAX  8
+
 
 /* States a thread can be in. */
 typedef enum {
@@ -83,6 +86,22 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	unsigned t_priority;		/* Scheduler level; 0 is highest */
+	unsigned t_ticks;		/* Hardclocks used at this level */
+	uint64_t t_lastrun;		/* gettime_ns() when it last stopped */
+	uint64_t t_waketime;		/* gettime_ns() when woken, or 0 */
+	struct wchan *t_wchan;		/* Wait channel, if on one */
+
+	/* Scheduler statistics (times in ns, from gettime_ns) */
+	unsigned t_migrations;		/* Times moved to a different cpu */
+	unsigned t_wakeups;		/* Times woken from sleep */
+	uint64_t t_wakelat;		/* Total time from wakeup to running */
+	uint64_t t_statetime;		/* When t_state last changed */
+	uint64_t t_runtime;		/* Total time running */
+	uint64_t t_readytime;		/* Total time on a run queue */
+	uint64_t t_sleeptime;		/* Total time asleep */
+	struct thread *t_allprev;	/* On the list of all threads */
+	struct thread *t_allnext;
 
 	/*
 	 * Interrupt state fields.
@@ -158,15 +177,37 @@ void thread_exit(void);
 void thread_yield(void);
 
 /*
- * Reshuffle the run queue. Called from the timer interrupt.
+ * Adjust scheduling priorities. Called from the timer interrupt.
  */
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Wait until every cpu has been through thread_switch, or idle, since
+ * the call. Used by epoch_synchronize; may sleep.
+ */
+void thread_waitquiescent(void);
+
+/*
+ * Print per-cpu scheduler statistics (idle time, work stealing).
+ */
+void thread_printstats(void);
+
+/*
+ * Totals of the per-cpu scheduler statistics, for tests to check.
+ */
+struct threadstats {
+	unsigned ts_ncpus;		/* Number of cpus */
+	unsigned ts_steals;		/* Threads stolen, all cpus */
+	unsigned ts_poolhits;		/* Threads taken from the pools */
+	unsigned ts_poolmax;		/* Longest pool on any cpu */
+};
+void thread_getstats(struct threadstats *ts);
+
+/*
+ * Print each thread's run, run queue, and sleep time, and a histogram
+ * of run queue waits.
  */
-void thread_consider_migration(void);
+void thread_printtimes(void);
 
 
 #endif /* _THREAD_H_ */
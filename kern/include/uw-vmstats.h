@@ -18,6 +18,9 @@
  *
  * Generally you will use the functions whose names
  * do not begin with '_'.
+ *
+ * The counts are per-cpu counters (see pcpuctr.h), so incrementing
+ * one takes no lock either way and is cheap enough to leave on.
  */
 
 
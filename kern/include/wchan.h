@@ -35,8 +35,14 @@
  */
 
 
+struct thread; /* from <thread.h> */
 struct wchan; /* Opaque */
 
+/*
+ * Call once during system startup, before any wait channel is created.
+ */
+void wchan_bootstrap(void);
+
 /*
  * Create a wait channel. Use NAME as a symbolic name for the channel.
  * NAME should be a string constant; if not, the caller is responsible
@@ -71,6 +77,14 @@ void wchan_unlock(struct wchan *wc);
  */
 void wchan_sleep(struct wchan *wc);
 
+/*
+ * Like wchan_sleep, but also wake up once callout tick DEADLINE (see
+ * callout.h) has passed. Returns 0 if woken up by someone else, or
+ * ETIMEDOUT if the deadline passed first. The channel is unlocked
+ * upon return either way.
+ */
+int wchan_sleep_deadline(struct wchan *wc, uint32_t deadline);
+
 /*
  * Wake up one thread, or all threads, sleeping on a wait channel.
  * The queue should not already be locked.
@@ -81,5 +95,22 @@ void wchan_sleep(struct wchan *wc);
 void wchan_wakeone(struct wchan *wc);
 void wchan_wakeall(struct wchan *wc);
 
+/*
+ * wchan_wakeone in two steps: take the first thread off the channel
+ * (returning NULL if there are none), then wake it up. In between,
+ * the caller can hand the thread what it was waiting for, such as
+ * ownership of a lock, before it gets a chance to run. The channel
+ * should not already be locked.
+ */
+struct thread *wchan_takeone(struct wchan *wc);
+void wchan_wakethread(struct thread *t);
+
+/*
+ * Move the first thread, or all threads, sleeping on FROM to the end
+ * of TO without waking them up. Neither channel should already be
+ * locked; FROM is locked first.
+ */
+void wchan_move(struct wchan *from, struct wchan *to, bool all);
+
 
 #endif /* _WCHAN_H_ */
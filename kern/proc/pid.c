@@ -0,0 +1,527 @@
+/*
+ * Process id table. See pid.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/wait.h>
+#include <limits.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <synch.h>
+#include <pid.h>
+
+#define PID_NCHUNKS  ((PID_MAX - PID_MIN + PID_CHUNK) / PID_CHUNK)
+
+/* Entry states */
+#define PE_FREE    0	/* not in use */
+#define PE_RUN     1	/* process is running */
+#define PE_ZOMBIE  2	/* exited; status not collected yet */
+
+struct pident;
+
+/* A list of children, linked through pe_sibprev/pe_sibnext. */
+struct pidlist {
+	struct pident *pl_head;
+	struct pident *pl_tail;
+};
+
+/*
+ * One entry. pe_pid and the wait channels never change, and
+ * pe_nextfree is protected by pid_lock. The rest is protected by
+ * pe_lock, except that the sibling links belong to the parent's
+ * lists and so are protected by the parent's pe_lock.
+ *
+ * When taking two entries' locks, take the parent's first.
+ */
+struct pident {
+	struct spinlock pe_lock;
+	struct wchan *pe_wchan;		/* parent waits for us here */
+	struct wchan *pe_anywchan;	/* we wait for any child here */
+	pid_t pe_pid;			/* pid of this entry; fixed */
+	int pe_state;			/* PE_* */
+	struct proc *pe_proc;		/* the process, while running */
+	pid_t pe_parent;		/* parent's pid, or 0 if none */
+	int pe_status;			/* exit status, once a zombie */
+	struct pidlist pe_live;		/* our running children */
+	struct pidlist pe_zombies;	/* our exited children, oldest first */
+	struct pident *pe_sibprev;	/* on one of our parent's lists */
+	struct pident *pe_sibnext;
+	struct pident *pe_nextfree;	/* free list */
+};
+
+/*
+ * The chunk directory has room for every pid, so it never needs to
+ * grow; chunks are added to it under pid_lock and never removed, so
+ * it can be read without locking.
+ */
+static struct pident *volatile pid_chunks[PID_NCHUNKS];
+static unsigned pid_nchunks;
+
+static struct lock *pid_lock;
+static struct pident *pid_freehead, *pid_freetail;
+
+/*
+ * Find the entry for PID, or NULL if it's out of range or hasn't been
+ * allocated.
+ */
+static
+struct pident *
+pid_entry(pid_t pid)
+{
+	struct pident *chunk;
+	unsigned index;
+
+	if (pid < PID_MIN || pid > PID_MAX) {
+		return NULL;
+	}
+	index = pid - PID_MIN;
+	chunk = pid_chunks[index / PID_CHUNK];
+	if (chunk == NULL) {
+		return NULL;
+	}
+	return &chunk[index % PID_CHUNK];
+}
+
+static
+void
+pidlist_init(struct pidlist *pl)
+{
+	pl->pl_head = pl->pl_tail = NULL;
+}
+
+static
+void
+pidlist_addtail(struct pidlist *pl, struct pident *pe)
+{
+	pe->pe_sibprev = pl->pl_tail;
+	pe->pe_sibnext = NULL;
+	if (pl->pl_tail == NULL) {
+		pl->pl_head = pe;
+	}
+	else {
+		pl->pl_tail->pe_sibnext = pe;
+	}
+	pl->pl_tail = pe;
+}
+
+static
+void
+pidlist_remove(struct pidlist *pl, struct pident *pe)
+{
+	if (pe->pe_sibprev == NULL) {
+		KASSERT(pl->pl_head == pe);
+		pl->pl_head = pe->pe_sibnext;
+	}
+	else {
+		pe->pe_sibprev->pe_sibnext = pe->pe_sibnext;
+	}
+	if (pe->pe_sibnext == NULL) {
+		KASSERT(pl->pl_tail == pe);
+		pl->pl_tail = pe->pe_sibprev;
+	}
+	else {
+		pe->pe_sibnext->pe_sibprev = pe->pe_sibprev;
+	}
+	pe->pe_sibprev = pe->pe_sibnext = NULL;
+}
+
+/*
+ * Add a chunk of entries and put them on the free list. pid_lock
+ * must be held.
+ */
+static
+int
+pid_grow(void)
+{
+	struct pident *chunk;
+	unsigned i, j;
+	pid_t pid;
+
+	KASSERT(lock_do_i_hold(pid_lock));
+
+	if (pid_nchunks >= PID_NCHUNKS) {
+		return ENPROC;
+	}
+	chunk = kmalloc(PID_CHUNK * sizeof(*chunk));
+	if (chunk == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<PID_CHUNK; i++) {
+		chunk[i].pe_wchan = wchan_create("pid");
+		chunk[i].pe_anywchan = wchan_create("pid_any");
+		if (chunk[i].pe_wchan == NULL || chunk[i].pe_anywchan == NULL) {
+			if (chunk[i].pe_wchan != NULL) {
+				wchan_destroy(chunk[i].pe_wchan);
+			}
+			if (chunk[i].pe_anywchan != NULL) {
+				wchan_destroy(chunk[i].pe_anywchan);
+			}
+			for (j=0; j<i; j++) {
+				wchan_destroy(chunk[j].pe_anywchan);
+				wchan_destroy(chunk[j].pe_wchan);
+				spinlock_cleanup(&chunk[j].pe_lock);
+			}
+			kfree(chunk);
+			return ENOMEM;
+		}
+		spinlock_init(&chunk[i].pe_lock);
+		chunk[i].pe_pid = PID_MIN + pid_nchunks * PID_CHUNK + i;
+		chunk[i].pe_state = PE_FREE;
+		chunk[i].pe_proc = NULL;
+		chunk[i].pe_parent = 0;
+		chunk[i].pe_status = 0;
+		pidlist_init(&chunk[i].pe_live);
+		pidlist_init(&chunk[i].pe_zombies);
+		chunk[i].pe_sibprev = chunk[i].pe_sibnext = NULL;
+		chunk[i].pe_nextfree = NULL;
+	}
+
+	/*
+	 * Queue them in pid order. The last chunk runs past PID_MAX;
+	 * those entries just never get used.
+	 */
+	for (i=0; i<PID_CHUNK; i++) {
+		pid = chunk[i].pe_pid;
+		if (pid > PID_MAX) {
+			break;
+		}
+		if (pid_freetail == NULL) {
+			pid_freehead = &chunk[i];
+		}
+		else {
+			pid_freetail->pe_nextfree = &chunk[i];
+		}
+		pid_freetail = &chunk[i];
+	}
+
+	pid_chunks[pid_nchunks++] = chunk;
+	return 0;
+}
+
+/*
+ * Put an entry on the end of the free list. Its pe_lock must not be
+ * held, and it must already be marked free.
+ */
+static
+void
+pid_free(struct pident *pe)
+{
+	lock_acquire(pid_lock);
+	pe->pe_nextfree = NULL;
+	if (pid_freetail == NULL) {
+		pid_freehead = pe;
+	}
+	else {
+		pid_freetail->pe_nextfree = pe;
+	}
+	pid_freetail = pe;
+	lock_release(pid_lock);
+}
+
+void
+pid_bootstrap(void)
+{
+	pid_lock = lock_create("pid_lock");
+	if (pid_lock == NULL) {
+		panic("pid_bootstrap: Out of memory\n");
+	}
+	pid_nchunks = 0;
+	pid_freehead = pid_freetail = NULL;
+}
+
+/*
+ * The parent's entry is found by pid; it can't go away under us,
+ * because it can't exit while it's in fork or wait, which are the
+ * only callers that start from a parent.
+ */
+int
+pid_alloc(struct proc *proc, pid_t parent, pid_t *retval)
+{
+	struct pident *pe, *pp;
+	int result;
+
+	pp = NULL;
+	if (parent != 0) {
+		pp = pid_entry(parent);
+		KASSERT(pp != NULL);
+	}
+
+	lock_acquire(pid_lock);
+	if (pid_freehead == NULL) {
+		result = pid_grow();
+		if (result) {
+			lock_release(pid_lock);
+			return result;
+		}
+	}
+	pe = pid_freehead;
+	pid_freehead = pe->pe_nextfree;
+	if (pid_freehead == NULL) {
+		pid_freetail = NULL;
+	}
+	pe->pe_nextfree = NULL;
+	lock_release(pid_lock);
+
+	if (pp != NULL) {
+		spinlock_acquire(&pp->pe_lock);
+	}
+	spinlock_acquire(&pe->pe_lock);
+	KASSERT(pe->pe_state == PE_FREE);
+	pe->pe_state = PE_RUN;
+	pe->pe_parent = parent;
+	pe->pe_status = 0;
+	pe->pe_proc = proc;
+	if (pp != NULL) {
+		pidlist_addtail(&pp->pe_live, pe);
+	}
+	spinlock_release(&pe->pe_lock);
+	if (pp != NULL) {
+		spinlock_release(&pp->pe_lock);
+	}
+
+	*retval = pe->pe_pid;
+	return 0;
+}
+
+/*
+ * Disown PE's children: take them all off its lists. The running ones
+ * will free their own pids when they exit; the ones that already have
+ * exited are freed here.
+ */
+static
+void
+pid_disown(struct pident *pe)
+{
+	struct pident *c, *zombies;
+
+	spinlock_acquire(&pe->pe_lock);
+	while ((c = pe->pe_live.pl_head) != NULL) {
+		spinlock_acquire(&c->pe_lock);
+		pidlist_remove(&pe->pe_live, c);
+		c->pe_parent = 0;
+		spinlock_release(&c->pe_lock);
+	}
+	zombies = pe->pe_zombies.pl_head;
+	pidlist_init(&pe->pe_zombies);
+	for (c = zombies; c != NULL; c = c->pe_sibnext) {
+		spinlock_acquire(&c->pe_lock);
+		KASSERT(c->pe_state == PE_ZOMBIE);
+		c->pe_parent = 0;
+		c->pe_state = PE_FREE;
+		spinlock_release(&c->pe_lock);
+	}
+	spinlock_release(&pe->pe_lock);
+
+	/* pid_free sleeps on pid_lock, so do this part unlocked. */
+	while (zombies != NULL) {
+		c = zombies;
+		zombies = c->pe_sibnext;
+		c->pe_sibprev = c->pe_sibnext = NULL;
+		pid_free(c);
+	}
+}
+
+/*
+ * Lock PE and its parent's entry, parent first, and return the
+ * parent's entry, or NULL (with just PE locked) if it has none. The
+ * parent can change while we aren't holding PE's lock, so check it
+ * again once we have both.
+ */
+static
+struct pident *
+pid_lockfamily(struct pident *pe)
+{
+	struct pident *pp;
+	pid_t parent;
+
+	while (1) {
+		spinlock_acquire(&pe->pe_lock);
+		parent = pe->pe_parent;
+		if (parent == 0) {
+			return NULL;
+		}
+		spinlock_release(&pe->pe_lock);
+
+		pp = pid_entry(parent);
+		KASSERT(pp != NULL);
+		spinlock_acquire(&pp->pe_lock);
+		spinlock_acquire(&pe->pe_lock);
+		if (pe->pe_parent == parent) {
+			return pp;
+		}
+		spinlock_release(&pe->pe_lock);
+		spinlock_release(&pp->pe_lock);
+	}
+}
+
+void
+pid_exit(pid_t pid, int status)
+{
+	struct pident *pe, *pp;
+	bool dofree = false;
+
+	pe = pid_entry(pid);
+	KASSERT(pe != NULL);
+
+	pid_disown(pe);
+
+	pp = pid_lockfamily(pe);
+	KASSERT(pe->pe_state == PE_RUN);
+	pe->pe_proc = NULL;
+	pe->pe_status = status;
+	if (pp == NULL) {
+		pe->pe_state = PE_FREE;
+		dofree = true;
+	}
+	else {
+		pe->pe_state = PE_ZOMBIE;
+		pidlist_remove(&pp->pe_live, pe);
+		pidlist_addtail(&pp->pe_zombies, pe);
+		wchan_wakeall(pe->pe_wchan);
+		wchan_wakeall(pp->pe_anywchan);
+	}
+	spinlock_release(&pe->pe_lock);
+	if (pp != NULL) {
+		spinlock_release(&pp->pe_lock);
+	}
+
+	if (dofree) {
+		pid_free(pe);
+	}
+}
+
+/*
+ * Collect zombie child PE of PP. Both must be locked; both are
+ * unlocked on return, and PE's pid is freed.
+ */
+static
+void
+pid_reap(struct pident *pp, struct pident *pe, int *status, pid_t *retpid)
+{
+	KASSERT(pe->pe_state == PE_ZOMBIE);
+	pidlist_remove(&pp->pe_zombies, pe);
+	*status = pe->pe_status;
+	*retpid = pe->pe_pid;
+	pe->pe_state = PE_FREE;
+	pe->pe_parent = 0;
+	spinlock_release(&pe->pe_lock);
+	spinlock_release(&pp->pe_lock);
+
+	pid_free(pe);
+}
+
+/*
+ * Wait for any child of PP: the oldest zombie if there is one,
+ * otherwise the next to exit.
+ */
+static
+int
+pid_waitany(struct pident *pp, bool nohang, int *status, pid_t *retpid)
+{
+	struct pident *pe;
+
+	spinlock_acquire(&pp->pe_lock);
+	while (pp->pe_zombies.pl_head == NULL) {
+		if (pp->pe_live.pl_head == NULL) {
+			spinlock_release(&pp->pe_lock);
+			return ECHILD;
+		}
+		if (nohang) {
+			spinlock_release(&pp->pe_lock);
+			*retpid = 0;
+			return 0;
+		}
+		wchan_lock(pp->pe_anywchan);
+		spinlock_release(&pp->pe_lock);
+		wchan_sleep(pp->pe_anywchan);
+		spinlock_acquire(&pp->pe_lock);
+	}
+	pe = pp->pe_zombies.pl_head;
+	spinlock_acquire(&pe->pe_lock);
+	pid_reap(pp, pe, status, retpid);
+	return 0;
+}
+
+int
+pid_wait(pid_t pid, pid_t parent, bool nohang, int *status, pid_t *retpid)
+{
+	struct pident *pe, *pp;
+
+	pp = pid_entry(parent);
+	if (pp == NULL) {
+		return ECHILD;
+	}
+	if (pid == WAIT_ANY) {
+		return pid_waitany(pp, nohang, status, retpid);
+	}
+
+	pe = pid_entry(pid);
+	if (pe == NULL || pe == pp) {
+		/* no such pid, or it's us; we'd take our own lock twice */
+		return ECHILD;
+	}
+
+	spinlock_acquire(&pp->pe_lock);
+	spinlock_acquire(&pe->pe_lock);
+	while (pe->pe_state == PE_RUN && pe->pe_parent == parent) {
+		if (nohang) {
+			spinlock_release(&pe->pe_lock);
+			spinlock_release(&pp->pe_lock);
+			*retpid = 0;
+			return 0;
+		}
+		wchan_lock(pe->pe_wchan);
+		spinlock_release(&pe->pe_lock);
+		spinlock_release(&pp->pe_lock);
+		wchan_sleep(pe->pe_wchan);
+		spinlock_acquire(&pp->pe_lock);
+		spinlock_acquire(&pe->pe_lock);
+	}
+	if (pe->pe_state != PE_ZOMBIE || pe->pe_parent != parent) {
+		/* not ours, or another of our threads collected it */
+		spinlock_release(&pe->pe_lock);
+		spinlock_release(&pp->pe_lock);
+		return ECHILD;
+	}
+	pid_reap(pp, pe, status, retpid);
+	return 0;
+}
+
+void
+pid_unalloc(pid_t pid, struct proc *proc)
+{
+	struct pident *pe, *pp;
+	bool dofree = false;
+
+	pe = pid_entry(pid);
+	if (pe == NULL) {
+		return;
+	}
+
+	pp = pid_lockfamily(pe);
+	if (pe->pe_state == PE_RUN && pe->pe_proc == proc) {
+		if (pp != NULL) {
+			/*
+			 * The parent may be waiting for it already (it
+			 * was on the live list); let it see it's gone.
+			 */
+			pidlist_remove(&pp->pe_live, pe);
+			wchan_wakeall(pe->pe_wchan);
+			wchan_wakeall(pp->pe_anywchan);
+		}
+		pe->pe_proc = NULL;
+		pe->pe_parent = 0;
+		pe->pe_state = PE_FREE;
+		dofree = true;
+	}
+	spinlock_release(&pe->pe_lock);
+	if (pp != NULL) {
+		spinlock_release(&pp->pe_lock);
+	}
+
+	if (dofree) {
+		pid_free(pe);
+	}
+}
@@ -43,6 +43,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
@@ -51,6 +52,8 @@
 #include <synch.h>
 #include <kern/fcntl.h>
 #include <syscall.h>
+#include <objcache.h>
+#include <pid.h>
 #include "opt-A2.h"
 #include <mips/trapframe.h>
 
@@ -60,6 +63,12 @@
  */
 struct proc *kproc;
 
+/*
+ * Cache of proc structures. See proc_ctor for what stays constructed
+ * while a proc sits in the cache.
+ */
+static struct objcache *proc_cache;
+
 /*
  * Mechanism for making the kernel menu thread sleep while processes are running
  */
@@ -75,6 +84,53 @@ struct semaphore *no_proc_sem;
 
 
 
+/*
+ * Constructor and destructor for proc_cache. The thread array, p_lock,
+ * and the thread lock and cv are set up once here and kept across
+ * reuse; the thread array keeps whatever storage it has grown.
+ */
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_init(&proc->p_threads);
+	spinlock_init(&proc->p_lock);
+
+#if OPT_A2
+	proc->p_thlock = lock_create("p_thlock");
+	if (proc->p_thlock == NULL) {
+		spinlock_cleanup(&proc->p_lock);
+		threadarray_cleanup(&proc->p_threads);
+		return ENOMEM;
+	}
+	proc->p_thcv = cv_create("p_thcv");
+	if (proc->p_thcv == NULL) {
+		lock_destroy(proc->p_thlock);
+		spinlock_cleanup(&proc->p_lock);
+		threadarray_cleanup(&proc->p_threads);
+		return ENOMEM;
+	}
+#endif /* OPT_A2 */
+
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+#if OPT_A2
+	cv_destroy(proc->p_thcv);
+	lock_destroy(proc->p_thlock);
+#endif /* OPT_A2 */
+	threadarray_cleanup(&proc->p_threads);
+	spinlock_cleanup(&proc->p_lock);
+}
+
 /*
  * Create a proc structure.
  */
@@ -84,18 +140,17 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = objcache_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		objcache_free(proc_cache, proc);
 		return NULL;
 	}
 
-	threadarray_init(&proc->p_threads);
-	spinlock_init(&proc->p_lock);
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -107,6 +162,13 @@ proc_create(const char *name)
 	proc->console = NULL;
 #endif // UW
 
+#if OPT_A2
+	proc->pid = 0;
+	proc->p_vforksem = NULL;
+	proc->p_uthreads = NULL;
+	proc->p_nexttid = 1;
+	proc->p_exiting = false;
+#endif /* OPT_A2 */
 
 	return proc;
 }
@@ -167,14 +229,18 @@ proc_destroy(struct proc *proc)
 	  vfs_close(proc->console);
 	}
 #endif // UW
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
+
 #if OPT_A2
-    cv_destroy(procTable[proc->pid - 2]->cv_child);
-#endif
-	threadarray_cleanup(&proc->p_threads);
-	spinlock_cleanup(&proc->p_lock);
+	uthread_cleanup(proc);
+#endif /* OPT_A2 */
 
+#if OPT_A2
+	/* Give back the pid if we never got as far as exiting. */
+	pid_unalloc(proc->pid, proc);
+#endif
 	kfree(proc->p_name);
-	kfree(proc);
+	objcache_free(proc_cache, proc);
 
 #ifdef UW
 	/* decrement the process count */
@@ -200,6 +266,11 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+  proc_cache = objcache_create("proc", sizeof(struct proc),
+			       proc_ctor, proc_dtor);
+  if (proc_cache == NULL) {
+    panic("could not create proc cache\n");
+  }
   kproc = proc_create("[kernel]");
   if (kproc == NULL) {
     panic("proc_create for kproc failed\n");
@@ -217,20 +288,7 @@ proc_bootstrap(void)
 #endif // UW
 
 #if OPT_A2
-	lk_pid = lock_create("pid_lock");
-
-	if (lk_pid == NULL) {
-		panic("could not create lock\n");
-	}
-	int c = 2;
-	counter_pid = (pid_t) c;
-	lk_tb = lock_create("table_lock");
-
-
-	if (!lk_tb) panic("could not create lock\n");
-	mutex = lock_create("mutex");
-	if (!mutex) panic("could not create lock\n");
-	for (int i = 0; i < 64; i++) { aliveTable[i] = true; }
+	pid_bootstrap();
 #endif /* OPT_A2 */
 
 
@@ -297,27 +355,11 @@ proc_create_runprogram(const char *name)
 	V(proc_count_mutex);
 #endif // UW
 #if OPT_A2
-	lock_acquire(lk_pid);
-	proc->pid = counter_pid;
-	procTable[(int)counter_pid - 2] = proc;
-	counter_pid++;
-
-
-	lock_release(lk_pid);
-	proc->countChild = 0;
-	proc->lk_child = lock_create("child");
-
-	if (proc->lk_child == NULL) {
-		panic("could not create lock\n");
+	/* the menu's processes (kproc's) have no parent to wait for them */
+	if (pid_alloc(proc, curproc->pid, &proc->pid)) {
+		proc_destroy(proc);
+		return NULL;
 	}
-	proc->cv_child = cv_create("cv_proc");
-	proc->isAlive = true;
-	if (!proc->cv_child) {
-        kfree(proc->p_name);
-        kfree(proc);
-        return NULL;
-  }
-
 #endif /* OPT_A2 */
 
 
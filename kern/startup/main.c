@@ -42,6 +42,8 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
+#include <epoch.h>
 #include <vm.h>
 #include <mainbus.h>
 #include <vfs.h>
@@ -107,6 +109,12 @@ boot(void)
 
 	/* Early initialization. */
 	ram_bootstrap();
+	wchan_bootstrap();
+	synch_bootstrap();
+#if OPT_A2
+	trapframe_bootstrap();
+	futex_bootstrap();
+#endif
 	proc_bootstrap();
 	thread_bootstrap();
 	hardclock_bootstrap();
@@ -125,6 +133,7 @@ boot(void)
 	vm_bootstrap();
 	kprintf_bootstrap();
 	thread_start_cpus();
+	epoch_bootstrap();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
@@ -41,6 +41,8 @@
 #include <vfs.h>
 #include <sfs.h>
 #include <syscall.h>
+#include <objcache.h>
+#include <lockstat.h>
 #include <test.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
@@ -406,6 +408,69 @@ cmd_kheapstats(int nargs, char **args)
     (void)args;
 
     kheap_printstats();
+    objcache_printstats();
+
+    return 0;
+}
+
+static
+int
+cmd_schedstats(int nargs, char **args)
+{
+    (void)nargs;
+    (void)args;
+
+    thread_printstats();
+
+    return 0;
+}
+
+static
+int
+cmd_threadtimes(int nargs, char **args)
+{
+    (void)nargs;
+    (void)args;
+
+    thread_printtimes();
+
+    return 0;
+}
+
+static
+int
+cmd_khprof(int nargs, char **args)
+{
+    (void)nargs;
+    (void)args;
+
+    kmprof_printstats();
+
+    return 0;
+}
+
+/*
+ * Command for printing lock statistics, most contended first.
+ * "lockstat all" prints every lock; "lockstat clear" starts over.
+ */
+static
+int
+cmd_lockstat(int nargs, char **args)
+{
+    if (nargs > 2) {
+	kprintf("Usage: lockstat [all | clear]\n");
+	return EINVAL;
+    }
+    if (nargs == 2 && !strcmp(args[1], "clear")) {
+	lockstat_clear();
+	return 0;
+    }
+    if (nargs == 2 && strcmp(args[1], "all")) {
+	kprintf("Usage: lockstat [all | clear]\n");
+	return EINVAL;
+    }
+
+    lockstat_printstats(nargs == 2);
 
     return 0;
 }
@@ -474,12 +539,19 @@ static const char *testmenu[] = {
         "[tt1] Thread test 1                 ",
         "[tt2] Thread test 2                 ",
         "[tt3] Thread test 3                 ",
+        "[st1] Scheduler test                ",
+        "[st2] Thread fork/exit test         ",
 #if OPT_NET
         "[net] Network test                  ",
 #endif
         "[sy1] Semaphore test                ",
         "[sy2] Lock test             (1)     ",
         "[sy3] CV test               (1)     ",
+        "[sy4] RW lock test [w]              ",
+        "[sy5] RW lock performance test      ",
+        "[sy6] Spinlock throughput test      ",
+        "[sy7] Timed wait test               ",
+        "[sy8] Epoch reclamation test        ",
 #ifdef UW
 "[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -520,6 +592,10 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
         "[kh] Kernel heap stats              ",
+        "[khprof] kmalloc call-site profile  ",
+        "[cs] CPU scheduler stats            ",
+        "[ts] Thread times and run queue wait",
+        "[lockstat] Lock contention stats    ",
         "[q] Quit and shut down              ",
         NULL
 };
@@ -577,6 +653,10 @@ static struct {
 
         /* stats */
         { "kh",         cmd_kheapstats },
+        { "khprof",     cmd_khprof },
+        { "cs",         cmd_schedstats },
+        { "ts",         cmd_threadtimes },
+        { "lockstat",   cmd_lockstat },
 
         /* base system tests */
         { "at",		arraytest },
@@ -589,11 +669,18 @@ static struct {
         { "tt1",	threadtest },
         { "tt2",	threadtest2 },
         { "tt3",	threadtest3 },
+        { "st1",	schedtest },
+        { "st2",	forkbenchtest },
         { "sy1",	semtest },
 
         /* synchronization assignment tests */
         { "sy2",	locktest },
         { "sy3",	cvtest },
+        { "sy4",	rwtest },
+        { "sy5",	rwperftest },
+        { "sy6",	spinlocktest },
+        { "sy7",	timedtest },
+        { "sy8",	epochtest },
 #ifdef UW
 { "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
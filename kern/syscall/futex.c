@@ -0,0 +1,291 @@
+/*
+ * Futexes: wait queues for user-level synchronization.
+ *
+ * A futex is just an int in user memory. User code does the fast
+ * path with atomic operations on it and only calls __futex to sleep
+ * when it has to wait, or to wake sleepers when it sees there are
+ * some (see user/lib/libc/unix/mutex.c).
+ *
+ * Queues are keyed by address space and user address, and hashed
+ * into FUTEX_NBUCKETS buckets, each with a sleep lock and a list of
+ * the queues in it. A queue exists only while somebody is waiting on
+ * it; it has a wait channel and a count of its waiters, and the last
+ * waiter to leave frees it. The bucket lock is held across reading
+ * the user's int in FUTEX_WAIT and across FUTEX_WAKE, so a wakeup
+ * can't slip in between the check and the sleep: the waiter locks
+ * the queue's channel before letting go of the bucket.
+ *
+ * A process's threads may be waiting on a futex when another calls
+ * _exit, and nobody is going to wake them; uthread_killothers calls
+ * futex_interrupt to get them out with EINTR.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/futex.h>
+#include <kern/time.h>
+#include <lib.h>
+#include <synch.h>
+#include <wchan.h>
+#include <callout.h>
+#include <current.h>
+#include <proc.h>
+#include <vm.h>
+#include <copyinout.h>
+#include <syscall.h>
+#include "opt-A2.h"
+
+#if OPT_A2
+
+#define FUTEX_NBUCKETS  64	/* must be a power of 2 */
+
+struct futexq {
+	struct futexq *fq_next;		/* on the bucket's list */
+	struct addrspace *fq_as;	/* key: address space */
+	userptr_t fq_uaddr;		/* key: user address */
+	struct wchan *fq_wchan;		/* where the waiters sleep */
+	unsigned fq_waiters;		/* how many */
+	bool fq_interrupted;		/* woken by futex_interrupt */
+};
+
+struct futexbucket {
+	struct lock *fb_lock;
+	struct futexq *fb_queues;
+};
+
+static struct futexbucket futextable[FUTEX_NBUCKETS];
+
+void
+futex_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<FUTEX_NBUCKETS; i++) {
+		futextable[i].fb_lock = lock_create("futex");
+		if (futextable[i].fb_lock == NULL) {
+			panic("futex_bootstrap: out of memory\n");
+		}
+		futextable[i].fb_queues = NULL;
+	}
+}
+
+static
+struct futexbucket *
+futex_bucket(struct addrspace *as, userptr_t uaddr)
+{
+	uint32_t hash;
+
+	hash = ((uint32_t)(uintptr_t)as >> 4) ^ ((uint32_t)uaddr >> 2);
+	hash *= 2654435761U;
+	return &futextable[(hash >> 16) & (FUTEX_NBUCKETS - 1)];
+}
+
+/*
+ * Find the queue for (AS, UADDR) in FB, or create it if CREATE is
+ * set. Returns NULL if it doesn't exist (or couldn't be created).
+ */
+static
+struct futexq *
+futexq_find(struct futexbucket *fb, struct addrspace *as, userptr_t uaddr,
+	    bool create)
+{
+	struct futexq *fq;
+
+	KASSERT(lock_do_i_hold(fb->fb_lock));
+
+	for (fq = fb->fb_queues; fq != NULL; fq = fq->fq_next) {
+		if (fq->fq_as == as && fq->fq_uaddr == uaddr) {
+			return fq;
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+
+	fq = kmalloc(sizeof(*fq));
+	if (fq == NULL) {
+		return NULL;
+	}
+	fq->fq_wchan = wchan_create("futex");
+	if (fq->fq_wchan == NULL) {
+		kfree(fq);
+		return NULL;
+	}
+	fq->fq_as = as;
+	fq->fq_uaddr = uaddr;
+	fq->fq_waiters = 0;
+	fq->fq_interrupted = false;
+	fq->fq_next = fb->fb_queues;
+	fb->fb_queues = fq;
+	return fq;
+}
+
+/*
+ * Drop a waiter from FQ, freeing it if that was the last.
+ */
+static
+void
+futexq_leave(struct futexbucket *fb, struct futexq *fq)
+{
+	struct futexq **pp;
+
+	KASSERT(lock_do_i_hold(fb->fb_lock));
+	KASSERT(fq->fq_waiters > 0);
+
+	fq->fq_waiters--;
+	if (fq->fq_waiters > 0) {
+		return;
+	}
+	for (pp = &fb->fb_queues; *pp != fq; pp = &(*pp)->fq_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = fq->fq_next;
+	wchan_destroy(fq->fq_wchan);
+	kfree(fq);
+}
+
+static
+int
+futex_wait(userptr_t uaddr, int val, userptr_t user_timeout)
+{
+	struct addrspace *as = curproc->p_addrspace;
+	struct futexbucket *fb;
+	struct futexq *fq;
+	struct timespec ts;
+	uint32_t deadline = 0;
+	bool timed;
+	int cur, result;
+
+	timed = user_timeout != NULL;
+	if (timed) {
+		result = copyin(user_timeout, &ts, sizeof(ts));
+		if (result) {
+			return result;
+		}
+		if (ts.tv_sec < 0 || ts.tv_nsec < 0 ||
+		    ts.tv_nsec >= 1000000000) {
+			return EINVAL;
+		}
+		deadline = callout_now() + callout_usec2ticks(
+			(uint64_t)ts.tv_sec * 1000000 +
+			(ts.tv_nsec + 999) / 1000);
+	}
+
+	fb = futex_bucket(as, uaddr);
+	lock_acquire(fb->fb_lock);
+
+	result = copyin(uaddr, &cur, sizeof(cur));
+	if (result) {
+		lock_release(fb->fb_lock);
+		return result;
+	}
+	if (cur != val) {
+		lock_release(fb->fb_lock);
+		return EAGAIN;
+	}
+	if (curproc->p_exiting) {
+		lock_release(fb->fb_lock);
+		return EINTR;
+	}
+
+	fq = futexq_find(fb, as, uaddr, true);
+	if (fq == NULL) {
+		lock_release(fb->fb_lock);
+		return ENOMEM;
+	}
+	fq->fq_waiters++;
+
+	wchan_lock(fq->fq_wchan);
+	lock_release(fb->fb_lock);
+	if (timed) {
+		result = wchan_sleep_deadline(fq->fq_wchan, deadline);
+	}
+	else {
+		wchan_sleep(fq->fq_wchan);
+	}
+
+	lock_acquire(fb->fb_lock);
+	if (result == 0 && fq->fq_interrupted) {
+		result = EINTR;
+	}
+	futexq_leave(fb, fq);
+	lock_release(fb->fb_lock);
+
+	return result;
+}
+
+static
+int
+futex_wake(userptr_t uaddr, int val, int32_t *retval)
+{
+	struct addrspace *as = curproc->p_addrspace;
+	struct futexbucket *fb;
+	struct futexq *fq;
+	struct thread *t;
+	int n;
+
+	n = 0;
+	fb = futex_bucket(as, uaddr);
+	lock_acquire(fb->fb_lock);
+	fq = futexq_find(fb, as, uaddr, false);
+	while (fq != NULL && n < val) {
+		t = wchan_takeone(fq->fq_wchan);
+		if (t == NULL) {
+			break;
+		}
+		wchan_wakethread(t);
+		n++;
+	}
+	lock_release(fb->fb_lock);
+
+	*retval = n;
+	return 0;
+}
+
+int
+sys___futex(userptr_t uaddr, int op, int val, userptr_t user_timeout,
+	    int32_t *retval)
+{
+	if (uaddr == NULL || (vaddr_t)uaddr % sizeof(int) != 0) {
+		return EINVAL;
+	}
+	if ((vaddr_t)uaddr >= USERSPACETOP) {
+		return EFAULT;
+	}
+
+	switch (op) {
+	    case FUTEX_WAIT:
+		*retval = 0;
+		return futex_wait(uaddr, val, user_timeout);
+	    case FUTEX_WAKE:
+		if (val < 0) {
+			return EINVAL;
+		}
+		return futex_wake(uaddr, val, retval);
+	}
+	return EINVAL;
+}
+
+/*
+ * Wake up everything waiting on a futex in AS, with EINTR.
+ */
+void
+futex_interrupt(struct addrspace *as)
+{
+	struct futexq *fq;
+	unsigned i;
+
+	for (i=0; i<FUTEX_NBUCKETS; i++) {
+		lock_acquire(futextable[i].fb_lock);
+		for (fq = futextable[i].fb_queues; fq != NULL;
+		     fq = fq->fq_next) {
+			if (fq->fq_as == as) {
+				fq->fq_interrupted = true;
+				wchan_wakeall(fq->fq_wchan);
+			}
+		}
+		lock_release(futextable[i].fb_lock);
+	}
+}
+
+#endif /* OPT_A2 */
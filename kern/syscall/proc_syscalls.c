@@ -11,26 +11,29 @@
 #include <copyinout.h>
 #include <vfs.h>
 #include <kern/fcntl.h>
+#include <limits.h>
+#include <synch.h>
 #include <mips/trapframe.h>
+#include <pid.h>
 #include "opt-A2.h"
 
 #if OPT_A2
-static void isExist(pid_t pid, int *child_flag) {
-
-  lock_acquire(curproc->lk_child);
+/*
+ * Called by a vfork child once it's off its parent's address space
+ * (see sys_vfork), to let the parent go on.
+ */
+static
+void
+vfork_release(void)
+{
+	struct semaphore *sem;
 
-  for (int i = 0; i < curproc->countChild; i++){
-    if (curproc->childArray[i] == pid) {
-      *child_flag = 1;
-      break;
-    }
-  }
-  lock_release(curproc->lk_child);
-  //return child_flag;
+	sem = curproc->p_vforksem;
+	KASSERT(sem != NULL);
+	curproc->p_vforksem = NULL;
+	V(sem);
 }
-
-
-#endif //OPT_A2
+#endif
 
 
   /* this implementation of sys__exit does not do anything with the exit code */
@@ -50,18 +53,11 @@ void sys__exit(int exitcode) {
 
 #if OPT_A2
 
-  lock_acquire(lk_tb);
-
-  curproc->isAlive = false;
-  curproc->code = exitcode;
-  curproc->status = _MKWAIT_EXIT(exitcode);
-
-  exitTable[curproc->pid - 2] = exitcode;
-  aliveTable[curproc->pid - 2] = false;
-
-  cv_broadcast(curproc->cv_child, lk_tb);
+  /* take any other threads in the process down first */
+  uthread_killothers();
 
-  lock_release(lk_tb);
+  /* post the exit status for our parent, and disown our children */
+  pid_exit(curproc->pid, _MKWAIT_EXIT(exitcode));
 
 #endif //OPT_A2
 
@@ -75,7 +71,17 @@ void sys__exit(int exitcode) {
    * messily fatal.
    */
   as = curproc_setas(NULL);
+#if OPT_A2
+  if (curproc->p_vforksem != NULL) {
+    /* it's our parent's; hand it back instead */
+    vfork_release();
+  }
+  else {
+    as_destroy(as);
+  }
+#else
   as_destroy(as);
+#endif
 
   /* detach this thread from its process */
   /* note: curproc cannot be used after this call */
@@ -116,9 +122,17 @@ sys_waitpid(pid_t pid,
 {
   int exitstatus;
   int result;
+#if OPT_A2
+  pid_t reaped;
+
+  if ((options & ~WNOHANG) != 0) {
+    return(EINVAL);
+  }
+#else
   if (options != 0) {
     return(EINVAL);
   }
+#endif
 
 
 
@@ -126,25 +140,21 @@ sys_waitpid(pid_t pid,
 
   if (!status) return EFAULT;
 
-  int child_flag = 0;
-  int *ptr = &child_flag;
-  isExist(pid, ptr);
-  if(*ptr == 0){
-      //*retval = ECHILD;
-      return ECHILD;
+  /*
+   * pid may be WAIT_ANY. Fails with ECHILD unless there's a child
+   * (that one, or any) we haven't waited for.
+   */
+  result = pid_wait(pid, curproc->pid, (options & WNOHANG) != 0,
+		    &exitstatus, &reaped);
+  if (result) {
+    return result;
   }
-
-  lock_acquire(lk_tb);
-  while (aliveTable[pid - 2] == true) {
-    cv_wait(procTable[pid - 2]->cv_child, lk_tb);
+  if (reaped == 0) {
+    /* WNOHANG, and nobody has exited yet */
+    *retval = 0;
+    return 0;
   }
-
-
-  int exitcode = exitTable[pid - 2];
-
-  exitstatus = _MKWAIT_EXIT(exitcode);
-
-  lock_release(lk_tb);
+  pid = reaped;
 
 #endif //OPT_A2
 
@@ -191,22 +201,21 @@ sys_fork(struct trapframe *tf, pid_t *retval) {
       proc_destroy(childProc);
       return result;
     }
-    spinlock_acquire(&curproc->p_lock);
-
-    curproc->childArray[curproc->countChild] = childProc->pid;
-    curproc->countChild++;
-    spinlock_release(&curproc->p_lock);
-
-    struct trapframe *childTf = kmalloc(sizeof(struct trapframe));
-
+    struct trapframe *childTf = trapframe_copy(tf);
+    if (childTf == NULL) {
+      proc_destroy(childProc);
+      return ENOMEM;
+    }
 
-	  memcpy(childTf,tf,sizeof(struct trapframe));
+    /* once it's running it can exit and be freed at any time */
+    pid_t childPid = childProc->pid;
     result = thread_fork("child process", childProc, (void*)enter_forked_process, (void*)childTf,0);
     if (result) {
+      trapframe_free(childTf);
       proc_destroy(childProc);
       return result;
     }
-    *retval = childProc->pid; //success
+    *retval = childPid; //success
     return 0;
   } else {
     proc_destroy(childProc);
@@ -214,10 +223,198 @@ sys_fork(struct trapframe *tf, pid_t *retval) {
 
   }
 }
+
+/*
+ * vfork: like fork, but the child runs in the parent's address space
+ * instead of a copy, and the calling thread sleeps until the child
+ * is done with it, which is when it execs or exits. So nothing is
+ * copied, which is all a child that's about to exec needs. The child
+ * must not return from the function that called vfork, or change
+ * anything the parent cares about, since it's all the parent's.
+ *
+ * The child holds the semaphore in p_vforksem while it's borrowing
+ * the address space; vfork_release gives it back.
+ */
+int
+sys_vfork(struct trapframe *tf, pid_t *retval)
+{
+	struct proc *child;
+	struct trapframe *childtf;
+	struct semaphore *sem;
+	pid_t pid;
+	int result;
+
+	sem = sem_create("vfork", 0);
+	if (sem == NULL) {
+		return ENOMEM;
+	}
+	child = proc_create_runprogram("children");
+	if (child == NULL) {
+		sem_destroy(sem);
+		return ENOMEM;
+	}
+	child->p_addrspace = curproc->p_addrspace;
+	child->p_vforksem = sem;
+
+	/* once it's running it can exit and be freed at any time */
+	pid = child->pid;
+
+	childtf = trapframe_copy(tf);
+	if (childtf == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+	result = thread_fork("child process", child,
+			     (void *)enter_forked_process, childtf, 0);
+	if (result) {
+		trapframe_free(childtf);
+		goto fail;
+	}
+
+	*retval = pid;
+	P(sem);
+	sem_destroy(sem);
+	return 0;
+
+ fail:
+	child->p_addrspace = NULL;
+	child->p_vforksem = NULL;
+	proc_destroy(child);
+	sem_destroy(sem);
+	return result;
+}
 #endif
 
 #ifdef OPT_A2
 
+/*
+ * Argument vectors for execv and spawn, copied in from the caller and
+ * then out onto the new program's stack. The strings are packed into
+ * one ARG_MAX buffer, and together with the pointers to them must fit
+ * in it.
+ */
+struct argbuf {
+	char **ab_argv;			/* the arguments, NULL terminated */
+	int ab_argc;
+	char *ab_buf;			/* holds the strings */
+};
+
+static
+void
+argbuf_init(struct argbuf *ab)
+{
+	ab->ab_argv = NULL;
+	ab->ab_argc = 0;
+	ab->ab_buf = NULL;
+}
+
+static
+void
+argbuf_cleanup(struct argbuf *ab)
+{
+	kfree(ab->ab_argv);
+	kfree(ab->ab_buf);
+	argbuf_init(ab);
+}
+
+/*
+ * Copy in the argument vector UARGV. The user's pointers are only
+ * ever read with copyin, never dereferenced.
+ */
+static
+int
+argbuf_copyin(struct argbuf *ab, userptr_t uargv)
+{
+	userptr_t uarg;
+	size_t used, len;
+	int argc, i, result;
+
+	/* count them, and check the pointers can be read */
+	argc = 0;
+	do {
+		if ((argc + 1) * sizeof(userptr_t) > ARG_MAX) {
+			return E2BIG;
+		}
+		result = copyin(uargv + argc * sizeof(userptr_t),
+				&uarg, sizeof(uarg));
+		if (result) {
+			return result;
+		}
+		argc++;
+	} while (uarg != NULL);
+	argc--;
+
+	ab->ab_argv = kmalloc((argc + 1) * sizeof(char *));
+	ab->ab_buf = kmalloc(ARG_MAX);
+	if (ab->ab_argv == NULL || ab->ab_buf == NULL) {
+		return ENOMEM;
+	}
+
+	used = (argc + 1) * sizeof(userptr_t);
+	for (i = 0; i < argc; i++) {
+		result = copyin(uargv + i * sizeof(userptr_t),
+				&uarg, sizeof(uarg));
+		if (result) {
+			return result;
+		}
+		if (uarg == NULL) {
+			/* someone changed it under us */
+			return EFAULT;
+		}
+		result = copyinstr(uarg, ab->ab_buf + used,
+				   ARG_MAX - used, &len);
+		if (result == ENAMETOOLONG) {
+			return E2BIG;
+		}
+		else if (result) {
+			return result;
+		}
+		ab->ab_argv[i] = ab->ab_buf + used;
+		used += len;
+	}
+	ab->ab_argv[argc] = NULL;
+	ab->ab_argc = argc;
+	return 0;
+}
+
+/*
+ * Put the arguments on the current address space's stack, starting at
+ * *STACKPTR, the way runprogram does: the strings at the top, and the
+ * argv array below them. Hands back the new stack pointer, which is
+ * also where argv is. Reuses ab_argv for the user addresses, so it
+ * can only be done once.
+ */
+static
+int
+argbuf_copyout(struct argbuf *ab, vaddr_t *stackptr)
+{
+	vaddr_t sp, uarg;
+	size_t len;
+	int i, result;
+
+	sp = *stackptr;
+	for (i = ab->ab_argc - 1; i >= 0; i--) {
+		len = strlen(ab->ab_argv[i]) + 1;
+		sp -= ROUNDUP(len, 8);
+		result = copyoutstr(ab->ab_argv[i], (userptr_t)sp, len, NULL);
+		if (result) {
+			return result;
+		}
+		ab->ab_argv[i] = (char *)sp;
+	}
+	for (i = ab->ab_argc; i >= 0; i--) {
+		uarg = (vaddr_t)ab->ab_argv[i];
+		sp -= sizeof(uarg);
+		result = copyout(&uarg, (userptr_t)sp, sizeof(uarg));
+		if (result) {
+			return result;
+		}
+	}
+
+	*stackptr = sp;
+	return 0;
+}
+
 /*
 From Coursenote: Replaces currently executing program with a newly loaded program image. Process id
 remains unchanged. Path of the program is passed in as program. Arguments to the
@@ -226,107 +423,86 @@ NULL pointer. In the new user program, argv[argc] should == NULL.
 */
 
 int
-sys_execv(userptr_t interface_progname, userptr_t interface_args){
-  char * progname = (char*) interface_progname;
-	char ** args = (char**) interface_args;
-
-  /* Sanity Check */
-  if(progname == NULL || args == NULL) return EFAULT;
-
-	struct addrspace *as;
+sys_execv(userptr_t interface_progname, userptr_t interface_args)
+{
+	struct argbuf args;
+	struct addrspace *as, *oldas;
 	struct vnode *v;
 	vaddr_t entrypoint, stackptr;
-	int result;
-
-  /* Count number of arguments */
-  int argc = 0;
-  while(args[argc])	{ argc++; }
-
-  /* Allocate memory in the kernel's address as copyinster does not create memory */
-  char * addr_name = kmalloc(sizeof(char) * (strlen(progname) + 1));
-  char ** argv = kmalloc(sizeof(char *) * (argc + 1));
+	char *progname;
+	int argc, result;
 
-  if (addr_name == NULL || argv == NULL) return ENOMEM;
+	argbuf_init(&args);
 
-  /* copy program name from user to kernel address */
-  if (copyinstr((const_userptr_t) progname, addr_name, strlen(progname) + 1, NULL)) {
-    return result;
-  }
-
-  /* Copy each argument str from user to kernel address */
-  for(int i = 0; i < argc; i++) {
-		argv[i] = kmalloc(sizeof(char) * (strlen(args[i]) + 1));
-		if (argv[i] == NULL) return ENOMEM;
-		result = copyinstr((const_userptr_t)args[i], argv[i], strlen(args[i]) + 1, NULL);
-		if (result) return result;
+	/* Copy in the program name and arguments. */
+	progname = kmalloc(PATH_MAX);
+	if (progname == NULL) {
+		return ENOMEM;
+	}
+	result = copyinstr(interface_progname, progname, PATH_MAX, NULL);
+	if (result) {
+		goto fail;
+	}
+	result = argbuf_copyin(&args, interface_args);
+	if (result) {
+		goto fail;
 	}
 
-  /* Must set explicitly the last element as Null */
-  argv[argc] = NULL;
-
-	/* Open the file. */
+	/* Open the file. (vfs_open may scribble on the name; it's ours.) */
 	result = vfs_open(progname, O_RDONLY, 0, &v);
 	if (result) {
-		return result;
+		goto fail;
 	}
 
+	/* The old image is going away; so are any other threads using it. */
+	uthread_killothers();
 
 	/* Create a new address space. */
 	as = as_create();
 	if (as == NULL) {
 		vfs_close(v);
-		return ENOMEM;
+		result = ENOMEM;
+		goto fail;
 	}
 
 	/* Switch to it and activate it. */
-	struct addrspace* oldAddrSpc = curproc_setas(as); //curproc_setas return the old address space
+	oldas = curproc_setas(as);
 	as_activate();
 
 	/* Load the executable. */
 	result = load_elf(v, &entrypoint);
-	if (result) {
-		/* p_addrspace will go away when curproc is destroyed */
-    curproc_setas(oldAddrSpc); //reverse
-		vfs_close(v);
-		return result;
-	}
 
 	/* Done with the file now. */
 	vfs_close(v);
 
+	if (result) {
+		goto restore;
+	}
+
 	/* Define the user stack in the address space */
 	result = as_define_stack(as, &stackptr);
 	if (result) {
-		/* p_addrspace will go away when curproc is destroyed */
-    curproc_setas(oldAddrSpc); //reverse
-		return result;
+		goto restore;
+	}
+
+	/* Put the arguments on it. */
+	result = argbuf_copyout(&args, &stackptr);
+	if (result) {
+		goto restore;
 	}
 
-//int argumentPassing(vaddr_t *stackptr) {
-  vaddr_t strAddr[argc+1];
-	strAddr[argc] = 0;
+	argc = args.ab_argc;
+	argbuf_cleanup(&args);
+	kfree(progname);
 
-  /* copy program argument strings to stack first */
-	for (int i = argc - 1; i >= 0; i--) {
-		stackptr -= ROUNDUP((sizeof(char) * (strlen(argv[i]) + 1)), 8);
-		strAddr[i] = stackptr;
-		result = copyoutstr(argv[i], (userptr_t)(stackptr), (sizeof(char) * (strlen(argv[i]) + 1)), NULL);
-    //kfree(argv[i]);
-    if(result) {
-      return result;
-    }
+	/* Delete old address space, or give it back if it was lent by vfork */
+	if (curproc->p_vforksem != NULL) {
+		vfork_release();
 	}
-  /* make each of the upper part of stack point to the lower corresponding string */
-  for (int i = argc; i >= 0; i--) {
-    stackptr -= ROUNDUP(sizeof(vaddr_t), 4);
-		copyout(&strAddr[i], (userptr_t)(stackptr), ROUNDUP(sizeof(vaddr_t), 4));
-    if(result) {
-      return result;
-    }
-  }
-//}
-  /* Delete old address space */
-  as_destroy(oldAddrSpc);
+	else {
+		as_destroy(oldas);
+	}
+
 	/* Warp to user mode. */
 	enter_new_process(argc /*argc*/, (userptr_t)stackptr /*userspace addr of argv*/,
 			  stackptr, entrypoint);
@@ -334,8 +510,222 @@ sys_execv(userptr_t interface_progname, userptr_t interface_args){
 	/* enter_new_process does not return. */
 	panic("enter_new_process returned\n");
 	return EINVAL;
+
+ restore:
+	/* go back to the old image; we're returning to it */
+	curproc_setas(oldas);
+	as_activate();
+	as_destroy(as);
+ fail:
+	argbuf_cleanup(&args);
+	kfree(progname);
+	return result;
+}
+
+
+
+/*
+ * spawn: start a new process running PATH with arguments ARGV, all in
+ * one go. Unlike fork and execv, nothing of ours is copied: the new
+ * process starts with an empty address space, and its first thread
+ * loads the program itself (see spawn_enter). We wait until it has,
+ * so that if it can't be run the error comes back from spawn like it
+ * would from execv, and no process is left behind.
+ *
+ * If CONSOLE isn't NULL, it's the name of a device (or file) to open
+ * for the new process's standard output and standard error instead of
+ * the console. That's the only file descriptor action there is, since
+ * the console is the only thing a process here has open.
+ */
+
+/* What sys_spawn hands the new process's first thread. */
+struct spawnargs {
+	char *sa_path;			/* program to run */
+	struct argbuf sa_args;		/* its arguments */
+	struct semaphore *sa_done;	/* V'd once it's loaded, or failed */
+	int sa_result;			/* and the error if it failed */
+};
+
+static
+void
+spawnargs_destroy(struct spawnargs *sa)
+{
+	if (sa->sa_done != NULL) {
+		sem_destroy(sa->sa_done);
+	}
+	kfree(sa->sa_path);
+	argbuf_cleanup(&sa->sa_args);
+	kfree(sa);
 }
 
+/*
+ * Load the program into the current (new, empty) process and put the
+ * arguments on its stack. On success the entry point and initial
+ * stack pointer are handed back; on failure the address space is
+ * left for the caller to throw away.
+ */
+static
+int
+spawn_load(struct spawnargs *sa, vaddr_t *entrypoint, vaddr_t *stackptr)
+{
+	struct addrspace *as;
+	struct vnode *v;
+	int result;
+
+	/* vfs_open may scribble on the name; it's ours, so that's fine */
+	result = vfs_open(sa->sa_path, O_RDONLY, 0, &v);
+	if (result) {
+		return result;
+	}
+
+	as = as_create();
+	if (as == NULL) {
+		vfs_close(v);
+		return ENOMEM;
+	}
+	curproc_setas(as);
+	as_activate();
+
+	result = load_elf(v, entrypoint);
+	vfs_close(v);
+	if (result) {
+		return result;
+	}
 
+	result = as_define_stack(as, stackptr);
+	if (result) {
+		return result;
+	}
+
+	return argbuf_copyout(&sa->sa_args, stackptr);
+}
+
+/*
+ * First thread of a spawned process.
+ */
+static
+void
+spawn_enter(void *data1, unsigned long data2)
+{
+	struct spawnargs *sa = data1;
+	struct proc *p = curproc;
+	struct addrspace *as;
+	vaddr_t entrypoint, stackptr;
+	int argc, result;
+
+	(void)data2;
+
+	argc = sa->sa_args.ab_argc;
+	result = spawn_load(sa, &entrypoint, &stackptr);
+
+	if (result == 0) {
+		/* sa belongs to our parent again after this */
+		V(sa->sa_done);
+		enter_new_process(argc, (userptr_t)stackptr, stackptr,
+				  entrypoint);
+		panic("enter_new_process returned\n");
+	}
+
+	/*
+	 * Couldn't load it. We never ran, so nobody is waiting for us;
+	 * proc_destroy gives the pid back. Otherwise as in sys__exit.
+	 * Do all this before telling our parent, so that by the time
+	 * spawn returns we're not its child any more.
+	 */
+	as_deactivate();
+	as = curproc_setas(NULL);
+	if (as != NULL) {
+		as_destroy(as);
+	}
+	proc_remthread(curthread);
+	proc_destroy(p);
+
+	sa->sa_result = result;
+	V(sa->sa_done);
+	thread_exit();
+}
+
+int
+sys_spawn(userptr_t upath, userptr_t uargv, userptr_t uconsole,
+	  pid_t *retval)
+{
+	struct spawnargs *sa;
+	struct proc *child;
+	struct vnode *con;
+	char *conpath;
+	pid_t pid;
+	int result;
+
+	sa = kmalloc(sizeof(*sa));
+	if (sa == NULL) {
+		return ENOMEM;
+	}
+	argbuf_init(&sa->sa_args);
+	sa->sa_done = NULL;
+	sa->sa_result = 0;
+
+	sa->sa_path = kmalloc(PATH_MAX);
+	if (sa->sa_path == NULL) {
+		spawnargs_destroy(sa);
+		return ENOMEM;
+	}
+	result = copyinstr(upath, sa->sa_path, PATH_MAX, NULL);
+	if (result) {
+		spawnargs_destroy(sa);
+		return result;
+	}
+	result = argbuf_copyin(&sa->sa_args, uargv);
+	if (result) {
+		spawnargs_destroy(sa);
+		return result;
+	}
+	sa->sa_done = sem_create("spawn", 0);
+	if (sa->sa_done == NULL) {
+		spawnargs_destroy(sa);
+		return ENOMEM;
+	}
+
+	child = proc_create_runprogram(sa->sa_path);
+	if (child == NULL) {
+		spawnargs_destroy(sa);
+		return ENOMEM;
+	}
+
+	if (uconsole != NULL) {
+		conpath = kmalloc(PATH_MAX);
+		if (conpath == NULL) {
+			result = ENOMEM;
+			goto fail;
+		}
+		result = copyinstr(uconsole, conpath, PATH_MAX, NULL);
+		if (result == 0) {
+			result = vfs_open(conpath, O_WRONLY, 0, &con);
+		}
+		kfree(conpath);
+		if (result) {
+			goto fail;
+		}
+		vfs_close(child->console);
+		child->console = con;
+	}
+
+	/* once it's running it can exit and be freed at any time */
+	pid = child->pid;
+	result = thread_fork("spawned process", child, spawn_enter, sa, 0);
+	if (result) {
+		goto fail;
+	}
+
+	*retval = pid;
+	P(sa->sa_done);
+	result = sa->sa_result;
+	spawnargs_destroy(sa);
+	return result;
+
+ fail:
+	proc_destroy(child);
+	spawnargs_destroy(sa);
+	return result;
+}
 
 #endif //OPT_A2
@@ -0,0 +1,314 @@
+/*
+ * User-level threads.
+ *
+ * A process may have several threads, all sharing its address space
+ * and its other state. The main thread is the one the process
+ * started with; __thread_create starts others, each of which gets a
+ * thread id (starting at 1) that other threads can __thread_join on
+ * to get its exit value. The main thread can't be joined.
+ *
+ * User stacks are supplied by the caller of __thread_create, the way
+ * clone() does it, since the address space has only the one stack
+ * region. The new thread starts at ENTRY with ARG1 and ARG2 as its
+ * first two arguments and everything else copied from its creator's
+ * registers; it's up to the C library to call __thread_exit when
+ * the thread's function returns.
+ *
+ * _exit ends the whole process. The exiting thread sets p_exiting
+ * and waits for the other threads to notice and exit, which they do
+ * on their next trip back to user mode (so within one hardclock if
+ * they're computing) or when woken in __thread_join or __futex. A
+ * thread blocked in some other system call exits when that call
+ * returns. The last thread to __thread_exit exits the process with
+ * status 0.
+ *
+ * Each thread from __thread_create has a struct uthread on the
+ * process's list, which holds its exit value until it's joined; all
+ * of that is protected by p_thlock. Changes to p_threads made here
+ * are also done with p_thlock held, so that the thread count can be
+ * checked under it.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <thread.h>
+#include <synch.h>
+#include <current.h>
+#include <proc.h>
+#include <vm.h>
+#include <copyinout.h>
+#include <syscall.h>
+#include "opt-A2.h"
+
+#if OPT_A2
+
+struct uthread {
+	struct uthread *ut_next;	/* on p_uthreads */
+	int ut_tid;			/* thread id */
+	struct thread *ut_thread;	/* kernel thread, once started */
+	struct trapframe *ut_tf;	/* initial user state, until started */
+	bool ut_done;			/* has exited */
+	bool ut_joining;		/* someone is waiting in join */
+	int ut_value;			/* exit value, once done */
+};
+
+/*
+ * Find the record for thread id TID, or for kernel thread T.
+ */
+static
+struct uthread *
+uthread_bytid(struct proc *p, int tid)
+{
+	struct uthread *ut;
+
+	KASSERT(lock_do_i_hold(p->p_thlock));
+	for (ut = p->p_uthreads; ut != NULL; ut = ut->ut_next) {
+		if (ut->ut_tid == tid) {
+			return ut;
+		}
+	}
+	return NULL;
+}
+
+static
+struct uthread *
+uthread_bythread(struct proc *p, struct thread *t)
+{
+	struct uthread *ut;
+
+	KASSERT(lock_do_i_hold(p->p_thlock));
+	for (ut = p->p_uthreads; ut != NULL; ut = ut->ut_next) {
+		if (ut->ut_thread == t) {
+			return ut;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Unlink a record and free it.
+ */
+static
+void
+uthread_free(struct proc *p, struct uthread *ut)
+{
+	struct uthread **pp;
+
+	for (pp = &p->p_uthreads; *pp != ut; pp = &(*pp)->ut_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = ut->ut_next;
+	kfree(ut);
+}
+
+/*
+ * Make the current thread leave its process and exit, recording
+ * VALUE for join. Called with p_thlock held. Does not return.
+ */
+static
+void
+uthread_die(struct proc *p, int value)
+{
+	struct uthread *ut;
+
+	KASSERT(lock_do_i_hold(p->p_thlock));
+	KASSERT(threadarray_num(&p->p_threads) > 1);
+
+	ut = uthread_bythread(p, curthread);
+	if (ut != NULL) {
+		ut->ut_done = true;
+		ut->ut_value = value;
+		ut->ut_thread = NULL;
+	}
+	proc_remthread(curthread);
+	cv_broadcast(p->p_thcv, p->p_thlock);
+	lock_release(p->p_thlock);
+
+	thread_exit();
+}
+
+/*
+ * Kernel-side start of a new user thread.
+ */
+static
+void
+uthread_start(void *data, unsigned long junk)
+{
+	struct uthread *ut = data;
+	struct proc *p = curproc;
+	struct trapframe *tf;
+
+	(void)junk;
+
+	lock_acquire(p->p_thlock);
+	ut->ut_thread = curthread;
+	tf = ut->ut_tf;
+	ut->ut_tf = NULL;
+	if (p->p_exiting) {
+		trapframe_free(tf);
+		uthread_die(p, 0);
+	}
+	lock_release(p->p_thlock);
+
+	enter_new_thread(tf);
+	panic("enter_new_thread returned\n");
+}
+
+void
+uthread_killothers(void)
+{
+	struct proc *p = curproc;
+
+	lock_acquire(p->p_thlock);
+	if (p->p_exiting) {
+		/* Someone else is already doing this. */
+		uthread_die(p, 0);
+	}
+	p->p_exiting = true;
+	/* Get any joiners and futex waiters moving. */
+	cv_broadcast(p->p_thcv, p->p_thlock);
+	futex_interrupt(p->p_addrspace);
+	while (threadarray_num(&p->p_threads) > 1) {
+		cv_wait(p->p_thcv, p->p_thlock);
+	}
+	p->p_exiting = false;
+	lock_release(p->p_thlock);
+}
+
+void
+uthread_checkexit(void)
+{
+	struct proc *p = curproc;
+
+	/* Unlocked peek; this is on every return to user mode. */
+	if (!p->p_exiting) {
+		return;
+	}
+
+	lock_acquire(p->p_thlock);
+	if (p->p_exiting) {
+		uthread_die(p, 0);
+	}
+	lock_release(p->p_thlock);
+}
+
+void
+uthread_cleanup(struct proc *p)
+{
+	struct uthread *ut;
+
+	while ((ut = p->p_uthreads) != NULL) {
+		KASSERT(ut->ut_thread == NULL);
+		p->p_uthreads = ut->ut_next;
+		kfree(ut);
+	}
+	p->p_nexttid = 1;
+}
+
+int
+sys___thread_create(struct trapframe *tf, userptr_t entry,
+		    userptr_t arg1, userptr_t arg2, userptr_t stack,
+		    int32_t *retval)
+{
+	struct proc *p = curproc;
+	struct uthread *ut;
+	int result;
+
+	if (entry == NULL || stack == NULL ||
+	    (vaddr_t)entry >= USERSPACETOP || (vaddr_t)stack > USERSPACETOP) {
+		return EFAULT;
+	}
+
+	ut = kmalloc(sizeof(*ut));
+	if (ut == NULL) {
+		return ENOMEM;
+	}
+	ut->ut_thread = NULL;
+	ut->ut_done = false;
+	ut->ut_joining = false;
+	ut->ut_value = 0;
+	ut->ut_tf = trapframe_newthread(tf, (vaddr_t)entry, arg1, arg2,
+					(vaddr_t)stack);
+	if (ut->ut_tf == NULL) {
+		kfree(ut);
+		return ENOMEM;
+	}
+
+	lock_acquire(p->p_thlock);
+	if (p->p_exiting) {
+		/* We're about to be killed off; don't bother. */
+		lock_release(p->p_thlock);
+		trapframe_free(ut->ut_tf);
+		kfree(ut);
+		return EINTR;
+	}
+	ut->ut_tid = p->p_nexttid++;
+	ut->ut_next = p->p_uthreads;
+	p->p_uthreads = ut;
+
+	result = thread_fork("uthread", p, uthread_start, ut, 0);
+	if (result) {
+		trapframe_free(ut->ut_tf);
+		uthread_free(p, ut);
+		lock_release(p->p_thlock);
+		return result;
+	}
+	*retval = ut->ut_tid;
+	lock_release(p->p_thlock);
+
+	return 0;
+}
+
+void
+sys___thread_exit(int value)
+{
+	struct proc *p = curproc;
+
+	lock_acquire(p->p_thlock);
+	if (threadarray_num(&p->p_threads) == 1 && !p->p_exiting) {
+		/* Last one out. */
+		lock_release(p->p_thlock);
+		sys__exit(0);
+	}
+	uthread_die(p, value);
+}
+
+int
+sys___thread_join(int tid, userptr_t user_value)
+{
+	struct proc *p = curproc;
+	struct uthread *ut;
+	int value, result;
+
+	lock_acquire(p->p_thlock);
+	ut = uthread_bytid(p, tid);
+	if (ut == NULL) {
+		lock_release(p->p_thlock);
+		return ESRCH;
+	}
+	if (ut->ut_thread == curthread || ut->ut_joining) {
+		lock_release(p->p_thlock);
+		return EINVAL;
+	}
+	ut->ut_joining = true;
+	while (!ut->ut_done) {
+		if (p->p_exiting) {
+			uthread_die(p, 0);
+		}
+		cv_wait(p->p_thcv, p->p_thlock);
+	}
+	value = ut->ut_value;
+	uthread_free(p, ut);
+	lock_release(p->p_thlock);
+
+	if (user_value != NULL) {
+		result = copyout(&value, user_value, sizeof(value));
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+#endif /* OPT_A2 */
@@ -0,0 +1,304 @@
+/*
+ * Reader-writer lock tests.
+ *
+ * rwtest is a stress test: a crowd of threads take the lock, mostly
+ * for reading, and check that writers are alone, that readers never
+ * see a half-written table, and that readers really do share the lock.
+ * Run it both ways: "sy4" for reader preference, "sy4 w" for writer
+ * preference.
+ *
+ * rwperftest times a read-mostly workload under a struct rwlock and
+ * under a plain struct lock. With several cpus the rwlock should win,
+ * since readers run in parallel and don't share a cache line.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define RW_NTHREADS    16
+#define RW_NLOOPS      400
+#define RW_TABLESIZE   32
+#define RW_WRITEEVERY  8	/* one op in this many is a write */
+
+#define RWPERF_NTHREADS  8
+#define RWPERF_NLOOPS    2000
+#define RWPERF_WORK      200	/* loops of "work" while holding the lock */
+
+static struct rwlock *testrw;
+static struct lock *testlk;
+static struct semaphore *rwdonesem;
+
+/* The data being protected: writers set every entry to the same value. */
+static volatile unsigned long rwtable[RW_TABLESIZE];
+
+/* Who's in the lock, for checking; protected by rwcount_lock. */
+static struct spinlock rwcount_lock = SPINLOCK_INITIALIZER;
+static unsigned rw_readers_in, rw_writers_in, rw_maxreaders;
+static volatile bool rw_failed;
+
+static
+void
+rwfail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: %s\n", num, msg);
+	rw_failed = true;
+}
+
+/*
+ * Cheap per-thread pseudorandom numbers, so the threads don't all
+ * serialize on the random device.
+ */
+static
+unsigned long
+rwrand(unsigned long *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return (*seed >> 16) & 0x7fff;
+}
+
+static
+void
+rw_enter(unsigned long num, bool writer)
+{
+	spinlock_acquire(&rwcount_lock);
+	if (writer) {
+		if (rw_readers_in > 0 || rw_writers_in > 0) {
+			rwfail(num, "writer got in with others");
+		}
+		rw_writers_in++;
+	}
+	else {
+		if (rw_writers_in > 0) {
+			rwfail(num, "reader got in with a writer");
+		}
+		rw_readers_in++;
+		if (rw_readers_in > rw_maxreaders) {
+			rw_maxreaders = rw_readers_in;
+		}
+	}
+	spinlock_release(&rwcount_lock);
+}
+
+static
+void
+rw_leave(bool writer)
+{
+	spinlock_acquire(&rwcount_lock);
+	if (writer) {
+		rw_writers_in--;
+	}
+	else {
+		rw_readers_in--;
+	}
+	spinlock_release(&rwcount_lock);
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	unsigned long seed, val;
+	unsigned i, j;
+	bool writer;
+
+	(void)junk;
+
+	seed = num;
+	for (i=0; i<RW_NLOOPS; i++) {
+		writer = rwrand(&seed) % RW_WRITEEVERY == 0;
+		if (writer) {
+			rwlock_acquire_write(testrw);
+			KASSERT(rwlock_do_i_hold_write(testrw));
+		}
+		else {
+			rwlock_acquire_read(testrw);
+		}
+		rw_enter(num, writer);
+
+		if (writer) {
+			val = num * RW_NLOOPS + i;
+			for (j=0; j<RW_TABLESIZE; j++) {
+				rwtable[j] = val;
+				if (j == RW_TABLESIZE / 2) {
+					/* give readers a chance to see it */
+					thread_yield();
+				}
+			}
+		}
+		else {
+			val = rwtable[0];
+			for (j=1; j<RW_TABLESIZE; j++) {
+				if (rwtable[j] != val) {
+					rwfail(num, "reader saw a torn table");
+					break;
+				}
+				if (j == RW_TABLESIZE / 2) {
+					/* let other readers pile in */
+					thread_yield();
+				}
+			}
+		}
+
+		rw_leave(writer);
+		rwlock_release(testrw);
+	}
+	V(rwdonesem);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	bool writerpref;
+	unsigned i;
+	int result;
+
+	writerpref = nargs > 1 && args[1][0] == 'w';
+
+	testrw = rwlock_create("rwtest", writerpref);
+	rwdonesem = sem_create("rwtest", 0);
+	if (testrw == NULL || rwdonesem == NULL) {
+		panic("rwtest: out of memory\n");
+	}
+	for (i=0; i<RW_TABLESIZE; i++) {
+		rwtable[i] = 0;
+	}
+	rw_readers_in = rw_writers_in = rw_maxreaders = 0;
+	rw_failed = false;
+
+	kprintf("Starting rwlock test (%s preference)...\n",
+		writerpref ? "writer" : "reader");
+
+	for (i=0; i<RW_NTHREADS; i++) {
+		result = thread_fork("rwtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<RW_NTHREADS; i++) {
+		P(rwdonesem);
+	}
+
+	if (rw_maxreaders < 2) {
+		kprintf("rwtest: readers never shared the lock\n");
+		rw_failed = true;
+	}
+	kprintf("rwtest: at most %u readers at once\n", rw_maxreaders);
+
+	rwlock_destroy(testrw);
+	sem_destroy(rwdonesem);
+	testrw = NULL;
+	rwdonesem = NULL;
+
+	kprintf("Rwlock test %s.\n", rw_failed ? "FAILED" : "done");
+	return rw_failed ? 1 : 0;
+}
+
+static
+void
+rwperfthread(void *junk, unsigned long userw)
+{
+	volatile unsigned long sum;
+	unsigned long seed;
+	unsigned i, j;
+	bool writer;
+
+	seed = (unsigned long)junk;
+	sum = 0;
+	for (i=0; i<RWPERF_NLOOPS; i++) {
+		writer = rwrand(&seed) % (RW_WRITEEVERY * 8) == 0;
+		if (userw) {
+			if (writer) {
+				rwlock_acquire_write(testrw);
+			}
+			else {
+				rwlock_acquire_read(testrw);
+			}
+		}
+		else {
+			lock_acquire(testlk);
+		}
+
+		for (j=0; j<RWPERF_WORK; j++) {
+			sum += rwtable[j % RW_TABLESIZE];
+		}
+		if (writer) {
+			rwtable[i % RW_TABLESIZE] = sum;
+		}
+
+		if (userw) {
+			rwlock_release(testrw);
+		}
+		else {
+			lock_release(testlk);
+		}
+	}
+	V(rwdonesem);
+}
+
+/*
+ * Run the workload with RWPERF_NTHREADS threads and return how long
+ * it took, in microseconds.
+ */
+static
+uint64_t
+rwperfrun(bool userw)
+{
+	uint64_t start;
+	unsigned i;
+	int result;
+
+	start = gettime_ns();
+	for (i=0; i<RWPERF_NTHREADS; i++) {
+		result = thread_fork("rwperf", NULL, rwperfthread,
+				     (void *)(uintptr_t)(i + 1), userw);
+		if (result) {
+			panic("rwperftest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<RWPERF_NTHREADS; i++) {
+		P(rwdonesem);
+	}
+	return (gettime_ns() - start) / 1000;
+}
+
+int
+rwperftest(int nargs, char **args)
+{
+	uint64_t lktime, rwtime;
+
+	(void)nargs;
+	(void)args;
+
+	testrw = rwlock_create("rwperf", false);
+	testlk = lock_create("rwperf");
+	rwdonesem = sem_create("rwperf", 0);
+	if (testrw == NULL || testlk == NULL || rwdonesem == NULL) {
+		panic("rwperftest: out of memory\n");
+	}
+
+	kprintf("Starting rwlock performance test: %u threads, "
+		"%u ops each, 1 in %u a write...\n", RWPERF_NTHREADS,
+		RWPERF_NLOOPS, RW_WRITEEVERY * 8);
+
+	lktime = rwperfrun(false);
+	kprintf("rwperftest: lock:   %llu us\n", lktime);
+	rwtime = rwperfrun(true);
+	kprintf("rwperftest: rwlock: %llu us\n", rwtime);
+
+	rwlock_destroy(testrw);
+	lock_destroy(testlk);
+	sem_destroy(rwdonesem);
+	testrw = NULL;
+	testlk = NULL;
+	rwdonesem = NULL;
+
+	kprintf("Rwlock performance test done.\n");
+	return 0;
+}
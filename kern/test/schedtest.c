@@ -0,0 +1,201 @@
+/*
+ * Scheduler tests.
+ *
+ * These are meant to be run with several cpus configured in
+ * sys161.conf. The menu prints how long each command took, which is
+ * the completion time of the workload; the per-cpu statistics
+ * printed before and after show where the idle time went. Each test
+ * also checks its results and prints FAILED if they are wrong.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+/* number of compute threads (default and most), spin loops per unit */
+#define SCHED_NTHREADS   12
+#define SCHED_MAXTHREADS 64
+#define SCHED_UNITLOOPS  200000
+
+/* fork test: rounds, and threads forked per round */
+#define FORK_NROUNDS     50
+#define FORK_PERROUND    8
+
+static struct semaphore *schedtest_donesem;
+static volatile bool schedtest_ran[SCHED_MAXTHREADS];
+
+/*
+ * Thread NUM gets NUM%4+1 units of work.
+ */
+static
+void
+spinner_thread(void *junk, unsigned long num)
+{
+	volatile unsigned long i;
+
+	(void)junk;
+
+	for (i=0; i<(num % 4 + 1) * SCHED_UNITLOOPS; i++) {
+		/* nothing */
+	}
+	schedtest_ran[num] = true;
+	V(schedtest_donesem);
+}
+
+/*
+ * Fork a batch of cpu-bound threads with uneven amounts of work, all
+ * on the current cpu, and wait for them. With push migration the
+ * other cpus sit idle until the next migration tick and end up idle
+ * again as the short threads finish; with work stealing they should
+ * pick up work as soon as they run dry.
+ *
+ * Fails if any thread didn't run, or if there were at least two
+ * threads per cpu and no cpu stole one: after the first few threads
+ * are placed on idle cpus, the rest queue here, and the other cpus
+ * go idle as their short threads finish.
+ */
+int
+schedtest(int nargs, char **args)
+{
+	struct threadstats before, after;
+	char name[16];
+	unsigned i, nthreads;
+	bool failed;
+	int result;
+
+	nthreads = SCHED_NTHREADS;
+	if (nargs > 1) {
+		nthreads = atoi(args[1]);
+	}
+	if (nthreads > SCHED_MAXTHREADS) {
+		kprintf("schedtest: at most %u threads\n", SCHED_MAXTHREADS);
+		return EINVAL;
+	}
+
+	schedtest_donesem = sem_create("schedtest", 0);
+	if (schedtest_donesem == NULL) {
+		panic("schedtest: sem_create failed\n");
+	}
+
+	kprintf("Starting scheduler test: %u threads...\n", nthreads);
+	thread_printstats();
+	thread_getstats(&before);
+
+	for (i=0; i<nthreads; i++) {
+		schedtest_ran[i] = false;
+	}
+	for (i=0; i<nthreads; i++) {
+		snprintf(name, sizeof(name), "spinner%u", i);
+		result = thread_fork(name, NULL, spinner_thread, NULL, i);
+		if (result) {
+			panic("schedtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(schedtest_donesem);
+	}
+
+	thread_printstats();
+	thread_getstats(&after);
+	sem_destroy(schedtest_donesem);
+	schedtest_donesem = NULL;
+
+	failed = false;
+	for (i=0; i<nthreads; i++) {
+		if (!schedtest_ran[i]) {
+			kprintf("schedtest: spinner%u never ran\n", i);
+			failed = true;
+		}
+	}
+	if (after.ts_ncpus > 1 && nthreads >= 2 * after.ts_ncpus &&
+	    after.ts_steals == before.ts_steals) {
+		kprintf("schedtest: no threads stolen with %u threads on "
+			"%u cpus\n", nthreads, after.ts_ncpus);
+		failed = true;
+	}
+	kprintf("Scheduler test %s.\n", failed ? "FAILED" : "done");
+
+	return 0;
+}
+
+static
+void
+null_thread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	V(schedtest_donesem);
+}
+
+/*
+ * Fork and reap batches of threads that exit immediately, so nearly
+ * all the time goes to thread creation and destruction. After the
+ * first round the thread pool should be supplying most of the
+ * threads; the per-cpu statistics printed at the end show the hit
+ * rate and the average time spent in thread_fork.
+ *
+ * Fails if, with more than one round, no thread came from a pool
+ * (thread_fork keeps the first threads of each round on this cpu
+ * while it is lightly loaded, so some die and are pooled here), or if
+ * any cpu's pool grew past THREADPOOL_MAX.
+ */
+int
+forkbenchtest(int nargs, char **args)
+{
+	struct threadstats before, after;
+	unsigned i, j, nrounds;
+	bool failed;
+	int result;
+
+	nrounds = FORK_NROUNDS;
+	if (nargs > 1) {
+		nrounds = atoi(args[1]);
+	}
+
+	schedtest_donesem = sem_create("forkbench", 0);
+	if (schedtest_donesem == NULL) {
+		panic("forkbenchtest: sem_create failed\n");
+	}
+
+	kprintf("Starting fork test: %u rounds of %u threads...\n",
+		nrounds, FORK_PERROUND);
+	thread_printstats();
+	thread_getstats(&before);
+
+	for (i=0; i<nrounds; i++) {
+		for (j=0; j<FORK_PERROUND; j++) {
+			result = thread_fork("forkbench", NULL, null_thread,
+					     NULL, j);
+			if (result) {
+				panic("forkbenchtest: thread_fork failed: "
+				      "%s\n", strerror(result));
+			}
+		}
+		for (j=0; j<FORK_PERROUND; j++) {
+			P(schedtest_donesem);
+		}
+	}
+
+	thread_printstats();
+	thread_getstats(&after);
+	sem_destroy(schedtest_donesem);
+	schedtest_donesem = NULL;
+
+	failed = false;
+	if (nrounds > 1 && after.ts_poolhits == before.ts_poolhits) {
+		kprintf("forkbenchtest: no thread stacks were reused\n");
+		failed = true;
+	}
+	if (after.ts_poolmax > THREADPOOL_MAX) {
+		kprintf("forkbenchtest: %u threads pooled on one cpu, "
+			"limit %u\n", after.ts_poolmax, THREADPOOL_MAX);
+		failed = true;
+	}
+	kprintf("Fork test %s.\n", failed ? "FAILED" : "done");
+
+	return 0;
+}
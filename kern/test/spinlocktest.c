@@ -0,0 +1,151 @@
+/*
+ * Spinlock throughput test.
+ *
+ * A crowd of threads take turns at a shared lock for a fixed time,
+ * doing a little work inside and outside it, first with a struct
+ * spinlock (a ticket lock) and then with a struct mcslock. Each
+ * reports how many times it got the lock; the total is the lock's
+ * throughput and the spread between the most and least successful
+ * threads shows how fair it is. Run it with 2, 4, and 8 cpus
+ * configured in sys161.conf to see how each kind holds up as the
+ * contention grows.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <mcslock.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define SPT_NTHREADS  8		/* default number of threads */
+#define SPT_MAXTHREADS 32
+#define SPT_USECS     1000000	/* how long each kind runs */
+#define SPT_INSIDE    20	/* loops of work holding the lock */
+#define SPT_OUTSIDE   20	/* loops of work between acquisitions */
+
+static struct spinlock spt_spinlock;
+static struct mcslock spt_mcslock;
+static struct semaphore *spt_donesem;
+static volatile unsigned long spt_shared;
+static unsigned spt_counts[SPT_MAXTHREADS];
+static uint64_t spt_deadline;
+
+static
+void
+spt_work(unsigned loops)
+{
+	volatile unsigned i;
+
+	for (i=0; i<loops; i++) {
+		/* nothing */
+	}
+}
+
+static
+void
+spt_thread(void *usemcs, unsigned long num)
+{
+	struct mcsnode node;
+	unsigned count;
+
+	count = 0;
+	while (gettime_ns() < spt_deadline) {
+		if (usemcs != NULL) {
+			mcslock_acquire(&spt_mcslock, &node);
+		}
+		else {
+			spinlock_acquire(&spt_spinlock);
+		}
+		spt_shared++;
+		spt_work(SPT_INSIDE);
+		if (usemcs != NULL) {
+			mcslock_release(&spt_mcslock, &node);
+		}
+		else {
+			spinlock_release(&spt_spinlock);
+		}
+		count++;
+		spt_work(SPT_OUTSIDE);
+	}
+	spt_counts[num] = count;
+	V(spt_donesem);
+}
+
+static
+void
+spt_run(const char *kind, bool usemcs, unsigned nthreads)
+{
+	unsigned i, total, min, max;
+	int result;
+
+	spt_shared = 0;
+	spt_deadline = gettime_ns() + (uint64_t)SPT_USECS * 1000;
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("spinlocktest", NULL, spt_thread,
+				     usemcs ? &spt_mcslock : NULL, i);
+		if (result) {
+			panic("spinlocktest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(spt_donesem);
+	}
+
+	total = 0;
+	min = max = spt_counts[0];
+	for (i=0; i<nthreads; i++) {
+		total += spt_counts[i];
+		if (spt_counts[i] < min) {
+			min = spt_counts[i];
+		}
+		if (spt_counts[i] > max) {
+			max = spt_counts[i];
+		}
+	}
+	if (spt_shared != total) {
+		panic("spinlocktest: %s lost updates: %lu, expected %u\n",
+		      kind, spt_shared, total);
+	}
+	kprintf("spinlocktest: %-8s %8u acquisitions/s, per thread "
+		"min %u max %u\n", kind, total, min, max);
+}
+
+int
+spinlocktest(int nargs, char **args)
+{
+	unsigned nthreads;
+
+	nthreads = SPT_NTHREADS;
+	if (nargs > 1) {
+		nthreads = atoi(args[1]);
+	}
+	if (nthreads < 1 || nthreads > SPT_MAXTHREADS) {
+		kprintf("Usage: sy6 [nthreads (1-%u)]\n", SPT_MAXTHREADS);
+		return EINVAL;
+	}
+
+	spinlock_init(&spt_spinlock);
+	mcslock_init(&spt_mcslock);
+	spt_donesem = sem_create("spinlocktest", 0);
+	if (spt_donesem == NULL) {
+		panic("spinlocktest: sem_create failed\n");
+	}
+
+	kprintf("Starting spinlock test: %u threads, %u us each...\n",
+		nthreads, SPT_USECS);
+	spt_run("ticket", false, nthreads);
+	spt_run("mcs", true, nthreads);
+
+	sem_destroy(spt_donesem);
+	spt_donesem = NULL;
+	mcslock_cleanup(&spt_mcslock);
+	spinlock_cleanup(&spt_spinlock);
+	kprintf("Spinlock test done.\n");
+
+	return 0;
+}
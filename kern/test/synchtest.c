@@ -32,10 +32,13 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <clock.h>
+#include <callout.h>
 #include <thread.h>
 #include <synch.h>
+#include <epoch.h>
 #include <test.h>
 
 #define NSEMLOOPS     63
@@ -235,6 +238,7 @@ locktest(int nargs, char **args)
 
 	inititems();
 	kprintf("Starting lock test...\n");
+	lock_printstats();
 
 	for (i=0; i<NTHREADS; i++) {
 		result = thread_fork("synchtest", NULL, locktestthread,
@@ -248,6 +252,7 @@ locktest(int nargs, char **args)
 		P(donesem);
 	}
 
+	lock_printstats();
 #ifdef UW
   cleanitems();
 #endif
@@ -347,3 +352,264 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Timed wait test: sem_timedP and cv_timedwait should time out when
+ * nobody wakes them, no sooner than asked, and should return 0 when
+ * somebody does.
+ */
+
+#define TIMEDWAIT_USEC   200000
+#define TIMEDWAKE_USEC   20000
+
+static
+void
+timedwakethread(void *junk, unsigned long usecv)
+{
+	(void)junk;
+
+	clocksleep_usec(TIMEDWAKE_USEC);
+	if (usecv) {
+		lock_acquire(testlock);
+		testval1 = 1;
+		cv_signal(testcv, testlock);
+		lock_release(testlock);
+	}
+	else {
+		V(testsem);
+	}
+	V(donesem);
+}
+
+/*
+ * Do one timed wait, check what it returned and how long it took,
+ * and return true if it was right.
+ */
+static
+bool
+timedcheck(const char *what, bool usecv, bool wake)
+{
+	uint64_t start, elapsed;
+	uint32_t deadline;
+	int result;
+
+	if (wake) {
+		result = thread_fork("synchtest", NULL, timedwakethread,
+				     NULL, usecv);
+		if (result) {
+			panic("timedtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	start = gettime_ns();
+	deadline = callout_now() + callout_usec2ticks(TIMEDWAIT_USEC);
+	if (usecv) {
+		lock_acquire(testlock);
+		result = 0;
+		while (testval1 == 0 && result == 0) {
+			result = cv_timedwait(testcv, testlock, deadline);
+		}
+		if (!lock_do_i_hold(testlock)) {
+			kprintf("%s: lock not held on return\n", what);
+			return false;
+		}
+		testval1 = 0;
+		lock_release(testlock);
+	}
+	else {
+		result = sem_timedP(testsem, deadline);
+	}
+	elapsed = (gettime_ns() - start) / 1000;
+
+	if (wake) {
+		P(donesem);
+	}
+
+	kprintf("%s: %s after %llu us\n", what,
+		result == 0 ? "woken" : "timed out", elapsed);
+	if (result != (wake ? 0 : ETIMEDOUT)) {
+		kprintf("%s: wrong result %d\n", what, result);
+		return false;
+	}
+	if (!wake && elapsed < TIMEDWAIT_USEC) {
+		kprintf("%s: timed out too soon\n", what);
+		return false;
+	}
+	if (wake && elapsed >= TIMEDWAIT_USEC) {
+		kprintf("%s: wakeup was missed\n", what);
+		return false;
+	}
+	return true;
+}
+
+int
+timedtest(int nargs, char **args)
+{
+	bool ok;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting timed wait test...\n");
+
+	/* Use up testsem's initial count so P would block. */
+	while (sem_timedP(testsem, callout_now()) == 0) {
+		/* nothing */
+	}
+	testval1 = 0;
+
+	ok = timedcheck("sem_timedP", false, false);
+	ok = timedcheck("sem_timedP", false, true) && ok;
+	ok = timedcheck("cv_timedwait", true, false) && ok;
+	ok = timedcheck("cv_timedwait", true, true) && ok;
+
+	/* Put testsem back the way semtest expects it. */
+	V(testsem);
+	V(testsem);
+
+#ifdef UW
+	cleanitems();
+#endif
+	kprintf("Timed wait test %s.\n", ok ? "done" : "FAILED");
+
+	return ok ? 0 : 1;
+}
+
+/*
+ * Epoch test: reader threads keep looking at a published object in
+ * read sections while we replace it over and over, handing the old
+ * ones to epoch_defer. The free routine scribbles on the object
+ * first, so a reader that sees the scribble saw something freed out
+ * from under it.
+ */
+
+#define EPOCH_READERS  4
+#define EPOCH_UPDATES  500
+#define EPOCH_MAGIC    0x600dcafe
+#define EPOCH_DEAD     0xdeadbeef
+
+struct epochobj {
+	volatile unsigned eo_magic;
+	unsigned eo_gen;
+};
+
+static struct epochobj *volatile epoch_cur;
+static volatile bool epoch_stop;
+static volatile unsigned epoch_bad;
+static volatile unsigned epoch_freed;
+
+static
+void
+epochobj_free(void *data)
+{
+	struct epochobj *eo = data;
+
+	eo->eo_magic = EPOCH_DEAD;
+	kfree(eo);
+	epoch_freed++;
+}
+
+static
+void
+epochreader(void *junk, unsigned long num)
+{
+	struct epochobj *eo;
+	unsigned i, lastgen = 0;
+
+	(void)junk;
+	(void)num;
+
+	while (!epoch_stop) {
+		epoch_enter();
+		eo = epoch_cur;
+		for (i=0; i<100; i++) {
+			if (eo->eo_magic != EPOCH_MAGIC) {
+				epoch_bad++;
+				break;
+			}
+		}
+		if (eo->eo_gen < lastgen) {
+			epoch_bad++;
+		}
+		lastgen = eo->eo_gen;
+		epoch_exit();
+		thread_yield();
+	}
+	V(donesem);
+}
+
+static
+struct epochobj *
+epochobj_make(unsigned gen)
+{
+	struct epochobj *eo;
+
+	eo = kmalloc(sizeof(*eo));
+	if (eo == NULL) {
+		panic("epochtest: Out of memory\n");
+	}
+	eo->eo_magic = EPOCH_MAGIC;
+	eo->eo_gen = gen;
+	return eo;
+}
+
+int
+epochtest(int nargs, char **args)
+{
+	struct epochobj *old;
+	unsigned i, waits;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting epoch test...\n");
+
+	epoch_cur = epochobj_make(0);
+	epoch_stop = false;
+	epoch_bad = 0;
+	epoch_freed = 0;
+
+	for (i=0; i<EPOCH_READERS; i++) {
+		result = thread_fork("synchtest", NULL, epochreader, NULL, i);
+		if (result) {
+			panic("epochtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	for (i=1; i<=EPOCH_UPDATES; i++) {
+		old = epoch_cur;
+		epoch_cur = epochobj_make(i);
+		epoch_defer(epochobj_free, old);
+		thread_yield();
+	}
+
+	epoch_stop = true;
+	for (i=0; i<EPOCH_READERS; i++) {
+		P(donesem);
+	}
+
+	/* Everything deferred should get freed, and fairly promptly. */
+	for (waits=0; epoch_freed < EPOCH_UPDATES && waits < 500; waits++) {
+		clocksleep_usec(10000);
+	}
+	epochobj_free(epoch_cur);
+	epoch_cur = NULL;
+
+	kprintf("epochtest: %u bad reads, %u of %u freed\n",
+		epoch_bad, epoch_freed - 1, EPOCH_UPDATES);
+
+#ifdef UW
+	cleanitems();
+#endif
+	if (epoch_bad != 0 || epoch_freed != EPOCH_UPDATES + 1) {
+		kprintf("Epoch test FAILED.\n");
+		return 1;
+	}
+	kprintf("Epoch test done.\n");
+	return 0;
+}
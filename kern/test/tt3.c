@@ -245,10 +245,13 @@ runtest3(int nsleeps, int ncomputes)
 	kprintf("Starting thread test 3 (%d [sleepalots], %d {computes}, "
 		"1 waker)\n",
 		nsleeps, ncomputes);
+	lock_printstats();
 	make_sleepalots(nsleeps);
 	make_computes(ncomputes);
 	finish(nsleeps+ncomputes);
-	kprintf("\nThread test 3 done\n");
+	kprintf("\n");
+	lock_printstats();
+	kprintf("Thread test 3 done\n");
 }
 
 int
@@ -0,0 +1,255 @@
+/*
+ * Callouts.
+ *
+ * Pending callouts live in a hierarchical timing wheel. Level 0 has
+ * one slot per tick for the next WHEEL_SLOTS ticks; each level above
+ * it has slots WHEEL_SLOTS times as wide as the level below. A
+ * callout is put in the lowest level whose range covers its expiry
+ * time. Every WHEEL_SLOTS ticks, the next slot of level 1 is emptied
+ * and its callouts redistributed into level 0 (and likewise up the
+ * levels), so scheduling, cancelling, and expiring a callout are all
+ * constant time no matter how many are pending.
+ *
+ * With 4 levels of 64 slots the wheel covers 2^24 ticks, which is
+ * over 46 hours at 10 ms per tick. Deadlines further out than that
+ * are pulled in to the end of the wheel, so the callout fires early;
+ * callers sleeping that long should check the time and go back to
+ * sleep.
+ *
+ * The wheel is advanced by timerclock(), which runs on only one cpu,
+ * so there is one wheel for the whole system.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <callout.h>
+#include <lamebus/ltimer.h>
+
+#define WHEEL_LEVELS  4
+#define WHEEL_BITS    6
+#define WHEEL_SLOTS   (1 << WHEEL_BITS)
+#define WHEEL_MASK    (WHEEL_SLOTS - 1)
+#define WHEEL_RANGE   (1U << (WHEEL_BITS * WHEEL_LEVELS))
+
+/*
+ * The wheel, the tick count, and the callout being run are all
+ * protected by callout_lock. wheel_now is the next tick to be
+ * processed; that is, the number of ticks processed so far.
+ */
+static struct spinlock callout_lock = SPINLOCK_INITIALIZER;
+static struct callout *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static uint32_t wheel_now;
+static struct callout *callout_running;
+
+////////////////////////////////////////////////////////////
+//
+// Slot lists
+
+static
+void
+slot_link(struct callout **head, struct callout *co)
+{
+	co->co_next = *head;
+	if (*head != NULL) {
+		(*head)->co_prevp = &co->co_next;
+	}
+	*head = co;
+	co->co_prevp = head;
+}
+
+static
+void
+slot_unlink(struct callout *co)
+{
+	KASSERT(co->co_prevp != NULL);
+
+	*co->co_prevp = co->co_next;
+	if (co->co_next != NULL) {
+		co->co_next->co_prevp = co->co_prevp;
+	}
+	co->co_next = NULL;
+	co->co_prevp = NULL;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Wheel
+
+/*
+ * Put CO in the right slot for its expiry time.
+ */
+static
+void
+wheel_insert(struct callout *co)
+{
+	uint32_t delta;
+	unsigned level, slot;
+
+	KASSERT(spinlock_do_i_hold(&callout_lock));
+
+	delta = co->co_expire - wheel_now;
+	if ((int32_t)delta < 0) {
+		/* Already due; run it on the next tick. */
+		co->co_expire = wheel_now;
+		delta = 0;
+	}
+	else if (delta >= WHEEL_RANGE) {
+		co->co_expire = wheel_now + WHEEL_RANGE - 1;
+		delta = WHEEL_RANGE - 1;
+	}
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+		if (delta < 1U << (WHEEL_BITS * (level + 1))) {
+			break;
+		}
+	}
+	slot = (co->co_expire >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	slot_link(&wheel[level][slot], co);
+}
+
+/*
+ * Redistribute the callouts in a slot of an upper level.
+ */
+static
+void
+wheel_cascade(unsigned level, unsigned slot)
+{
+	struct callout *co, *next;
+
+	co = wheel[level][slot];
+	wheel[level][slot] = NULL;
+	for (; co != NULL; co = next) {
+		next = co->co_next;
+		co->co_next = NULL;
+		co->co_prevp = NULL;
+		wheel_insert(co);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+void
+callout_init(struct callout *co, void (*func)(void *), void *arg)
+{
+	co->co_next = NULL;
+	co->co_prevp = NULL;
+	co->co_expire = 0;
+	co->co_func = func;
+	co->co_arg = arg;
+}
+
+void
+callout_schedule_at(struct callout *co, uint32_t deadline)
+{
+	spinlock_acquire(&callout_lock);
+	if (co->co_prevp != NULL) {
+		slot_unlink(co);
+	}
+	co->co_expire = deadline;
+	wheel_insert(co);
+	spinlock_release(&callout_lock);
+}
+
+/*
+ * Fire after at least TICKS whole ticks.
+ */
+void
+callout_schedule(struct callout *co, unsigned ticks)
+{
+	callout_schedule_at(co, callout_now() + ticks);
+}
+
+bool
+callout_stop(struct callout *co)
+{
+	bool pending;
+
+	spinlock_acquire(&callout_lock);
+	while (callout_running == co) {
+		/* It's running on the timer cpu; wait for it. */
+		spinlock_release(&callout_lock);
+		spinlock_acquire(&callout_lock);
+	}
+	pending = co->co_prevp != NULL;
+	if (pending) {
+		slot_unlink(co);
+	}
+	spinlock_release(&callout_lock);
+
+	return pending;
+}
+
+uint32_t
+callout_now(void)
+{
+	/* A single aligned word; no need to lock for a snapshot. */
+	return wheel_now;
+}
+
+/*
+ * Return true once tick DEADLINE has been processed.
+ */
+bool
+callout_expired(uint32_t deadline)
+{
+	return (int32_t)(callout_now() - deadline) > 0;
+}
+
+unsigned
+callout_usec2ticks(uint64_t usec)
+{
+	uint64_t ticks;
+
+	ticks = (usec + LT_GRANULARITY - 1) / LT_GRANULARITY;
+	if (ticks > WHEEL_RANGE - 1) {
+		ticks = WHEEL_RANGE - 1;
+	}
+	return ticks;
+}
+
+/*
+ * Process one tick: cascade the upper levels if level 0 has wrapped,
+ * then run everything in the current level 0 slot.
+ *
+ * The due callouts are moved to a list on our stack, and each one is
+ * taken off it just before it runs, so callout_stop can still cancel
+ * the ones that haven't run yet while the lock is dropped.
+ */
+void
+callout_tick(void)
+{
+	struct callout *due, *co;
+	unsigned level, slot;
+
+	spinlock_acquire(&callout_lock);
+
+	slot = wheel_now & WHEEL_MASK;
+	for (level = 1; level < WHEEL_LEVELS && slot == 0; level++) {
+		slot = (wheel_now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+		wheel_cascade(level, slot);
+	}
+
+	slot = wheel_now & WHEEL_MASK;
+	due = wheel[0][slot];
+	wheel[0][slot] = NULL;
+	if (due != NULL) {
+		due->co_prevp = &due;
+	}
+	wheel_now++;
+
+	while ((co = due) != NULL) {
+		slot_unlink(co);
+		callout_running = co;
+		spinlock_release(&callout_lock);
+
+		co->co_func(co->co_arg);
+
+		spinlock_acquire(&callout_lock);
+		callout_running = NULL;
+	}
+
+	spinlock_release(&callout_lock);
+}
@@ -32,6 +32,7 @@
 #include <cpu.h>
 #include <wchan.h>
 #include <clock.h>
+#include <callout.h>
 #include <thread.h>
 #include <lamebus/ltimer.h>
 #include <current.h>
@@ -39,39 +40,25 @@
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution that one second.
+ * Callbacks at specific points in the future are handled by the
+ * callout wheel (see callout.c), which timerclock() advances. Timed
+ * sleeps are built on that: each sleeper is woken by its own
+ * callout, not by a broadcast on every tick.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
  */
 
 /*
- * Timing constants. These should be tuned along with any work done on
- * the scheduler.
+ * Threads in clocknap() sleep here. Nothing ever wakes this channel;
+ * each sleeper's deadline does.
  */
-#define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
-
-/*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
- */
-static struct wchan *lbolt;
-/*
- * Once every LT_GRANULARITY usec, everything on minibolt is awakenened by CPU 0
- */
-static struct wchan *minibolt;
+static struct wchan *napchan;
 
 /* 
- * number of minibolts per second
+ * number of timer ticks per second
  */
-#define MINI_PER_SECOND (1000000/LT_GRANULARITY);
-
-/*
- * minibolt countdown
- */
-static int minicount;
+#define MINI_PER_SECOND (1000000/LT_GRANULARITY)
 
 /*
  * Setup.
@@ -79,17 +66,12 @@ static int minicount;
 void
 hardclock_bootstrap(void)
 {
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
-	}
-	minibolt = wchan_create("minibolt");
-	if (minibolt == NULL) {
-		panic("Couldn't create minibolt\n");
+	napchan = wchan_create("clocknap");
+	if (napchan == NULL) {
+		panic("Couldn't create clocknap\n");
 	}
-	minicount = MINI_PER_SECOND;
 	/* we assume MINI_PER_SECOND > 0 */
-	KASSERT(minicount > 0);
+	KASSERT(MINI_PER_SECOND > 0);
 }
 
 /*
@@ -99,13 +81,7 @@ hardclock_bootstrap(void)
 void
 timerclock(void)
 {
-	/* Broadcast on minibolt */
-	wchan_wakeall(minibolt);
-	/* Broadcast on lbolt if a second has elapsed */
-	if (--minicount <= 0) {
-	  minicount = MINI_PER_SECOND;
-	  wchan_wakeall(lbolt);
-	}
+	callout_tick();
 }
 
 /*
@@ -120,12 +96,16 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
+	if (curcpu->c_isidle) {
+		curcpu->c_idleclocks++;
+	}
+	else {
+		/* charge the tick to the running thread, for schedule() */
+		curthread->t_ticks++;
+	}
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
-	}
 	thread_yield();
 }
 
@@ -135,23 +115,45 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-  while (num_secs > 0) {
-    wchan_lock(lbolt);
-    wchan_sleep(lbolt);
-    num_secs--;
-  }
+	if (num_secs > 0) {
+		clocknap(num_secs * MINI_PER_SECOND);
+	}
 }
 
 /*
- * Suspend execution for num_ticks timer ticks.
+ * Suspend execution for at least num_ticks timer ticks.
  *  (one tick every LT_GRANULARITY usec)
  */
 void
 clocknap(int num_ticks)
 {
-  while (num_ticks > 0) {
-    wchan_lock(minibolt);
-    wchan_sleep(minibolt);
-    num_ticks--;
-  }
+	uint32_t deadline;
+
+	if (num_ticks <= 0) {
+		return;
+	}
+	deadline = callout_now() + num_ticks;
+	while (!callout_expired(deadline)) {
+		wchan_lock(napchan);
+		wchan_sleep_deadline(napchan, deadline);
+	}
+}
+
+/*
+ * Suspend execution for at least usecs microseconds, rounded up to
+ * whole timer ticks.
+ */
+void
+clocksleep_usec(uint64_t usecs)
+{
+	unsigned ticks;
+
+	while (usecs > 0) {
+		ticks = callout_usec2ticks(usecs);
+		clocknap(ticks);
+		if ((uint64_t)ticks * LT_GRANULARITY >= usecs) {
+			break;
+		}
+		usecs -= (uint64_t)ticks * LT_GRANULARITY;
+	}
 }
@@ -0,0 +1,165 @@
+/*
+ * Epoch-based deferred reclamation. See epoch.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <epoch.h>
+
+/*
+ * Callbacks waiting for a grace period. epoch_call pushes onto
+ * epoch_pending; the reclaimer thread takes the whole list, waits for
+ * every cpu to pass through a quiescent state, and then runs them.
+ * Anything queued after it took the list waits for the next round.
+ */
+static struct spinlock epoch_lock = SPINLOCK_INITIALIZER;
+static struct epochcb *epoch_pending;
+static struct wchan *epoch_wchan;	/* reclaimer sleeps here */
+static bool epoch_running;		/* set by epoch_bootstrap */
+
+/*
+ * Read sections. Raising the spl (rather than setting it) lets them
+ * nest, and lets them be used by code that already has interrupts
+ * off.
+ */
+void
+epoch_enter(void)
+{
+	splraise(IPL_NONE, IPL_HIGH);
+}
+
+void
+epoch_exit(void)
+{
+	spllower(IPL_HIGH, IPL_NONE);
+}
+
+/*
+ * Before epoch_bootstrap the other cpus haven't been started, and the
+ * caller is in thread context and so not in a read section, so there
+ * is nothing to wait for.
+ */
+void
+epoch_synchronize(void)
+{
+	if (!epoch_running) {
+		return;
+	}
+	thread_waitquiescent();
+}
+
+void
+epoch_call(struct epochcb *ec, void (*func)(void *), void *arg)
+{
+	ec->ec_func = func;
+	ec->ec_arg = arg;
+
+	spinlock_acquire(&epoch_lock);
+	ec->ec_next = epoch_pending;
+	epoch_pending = ec;
+	if (epoch_wchan != NULL) {
+		wchan_wakeone(epoch_wchan);
+	}
+	spinlock_release(&epoch_lock);
+}
+
+/*
+ * For epoch_defer: run the caller's function and free the request.
+ */
+static
+void
+epoch_deferdone(void *data)
+{
+	struct epochcb *ec = data;
+
+	ec->ec_func(ec->ec_arg);
+	kfree(ec);
+}
+
+void
+epoch_defer(void (*func)(void *), void *arg)
+{
+	struct epochcb *ec, *req;
+
+	ec = kmalloc(2 * sizeof(*ec));
+	if (ec == NULL) {
+		epoch_synchronize();
+		func(arg);
+		return;
+	}
+
+	/*
+	 * Two requests in one block: ec carries the caller's function
+	 * and req is what goes on the queue, whose callback calls it
+	 * and then frees the block.
+	 */
+	req = &ec[1];
+	ec->ec_func = func;
+	ec->ec_arg = arg;
+	epoch_call(req, epoch_deferdone, ec);
+}
+
+/*
+ * The reclaimer thread.
+ */
+static
+void
+epoch_thread(void *data1, unsigned long data2)
+{
+	struct epochcb *list, *ec;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		spinlock_acquire(&epoch_lock);
+		while (epoch_pending == NULL) {
+			wchan_lock(epoch_wchan);
+			spinlock_release(&epoch_lock);
+			wchan_sleep(epoch_wchan);
+			spinlock_acquire(&epoch_lock);
+		}
+		list = epoch_pending;
+		epoch_pending = NULL;
+		spinlock_release(&epoch_lock);
+
+		epoch_synchronize();
+
+		while (list != NULL) {
+			ec = list;
+			list = ec->ec_next;
+			ec->ec_func(ec->ec_arg);
+		}
+	}
+}
+
+/*
+ * Start the reclaimer. Called from boot() once the other cpus are
+ * running.
+ */
+void
+epoch_bootstrap(void)
+{
+	struct wchan *wc;
+	int result;
+
+	wc = wchan_create("epoch");
+	if (wc == NULL) {
+		panic("epoch_bootstrap: Out of memory\n");
+	}
+
+	spinlock_acquire(&epoch_lock);
+	epoch_wchan = wc;
+	epoch_running = true;
+	spinlock_release(&epoch_lock);
+
+	/* It'll pick up anything queued so far on its first pass. */
+	result = thread_fork("epoch reclaimer", NULL, epoch_thread, NULL, 0);
+	if (result) {
+		panic("epoch_bootstrap: thread_fork: %s\n", strerror(result));
+	}
+}
@@ -0,0 +1,397 @@
+/*
+ * Lock statistics. See lockstat.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <lockstat.h>
+
+#if OPT_LOCKSTAT
+
+/*
+ * Locks live in a fixed open-addressed hash table keyed by address.
+ * Slots are claimed and given back under lockstat_rawlock, which is a
+ * bare lock word rather than a struct spinlock so that taking it
+ * doesn't recurse into the statistics. Lookups don't take it: a slot
+ * only changes hands when its lock is destroyed, and nobody can be
+ * looking for a lock that's being destroyed. A slot given back is
+ * marked LOCKSTAT_FREED rather than emptied, so lookups for other
+ * locks still probe past it, and can be claimed again.
+ *
+ * A lock is only looked for in the LOCKSTAT_PROBE slots after its
+ * hash, so a lookup for a lock that has no entry stays cheap even
+ * when the table is full. Locks that don't find a slot there are
+ * lumped together in one overflow entry, which is updated under the
+ * raw lock and has no hold times. Destroyed locks' numbers are added
+ * to it too, so they aren't lost.
+ *
+ * Otherwise an entry's counters are only changed by whoever holds
+ * that lock, so they need no locking of their own.
+ *
+ * The raw lock must be taken with interrupts off, which they are when
+ * called from the lock code.
+ */
+
+#define LOCKSTAT_NLOCKS    1024			/* must be a power of 2 */
+#define LOCKSTAT_OVERFLOW  LOCKSTAT_NLOCKS	/* index of overflow entry */
+#define LOCKSTAT_PROBE     16		/* slots looked at per lookup */
+#define LOCKSTAT_NAMELEN   24
+#define LOCKSTAT_SHOW      32		/* entries printed without "all" */
+
+struct lockstat {
+	const void *ls_lock;		/* lock address; NULL if unused */
+	const void *ls_caller;		/* first acquired from here */
+	bool ls_sleep;			/* sleep lock, not spinlock */
+	char ls_name[LOCKSTAT_NAMELEN];	/* name, or empty */
+	unsigned ls_acquires;		/* times acquired */
+	unsigned ls_contended;		/* ...that found it held */
+	uint64_t ls_spins;		/* spin loop iterations */
+	uint64_t ls_waitns;		/* total time waiting for it (ns) */
+	uint64_t ls_maxholdns;		/* longest time held (ns) */
+	uint64_t ls_acqtime;		/* when the holder got it */
+};
+
+/* ls_lock of a slot whose lock was destroyed */
+#define LOCKSTAT_FREED     ((const void *)1)
+
+static struct lockstat lockstats[LOCKSTAT_NLOCKS + 1];
+static volatile spinlock_data_t lockstat_rawlock = SPINLOCK_DATA_INITIALIZER;
+
+/* For lockstat_printstats; the menu runs one command at a time. */
+static struct lockstat lockstat_snap[LOCKSTAT_NLOCKS + 1];
+static unsigned lockstat_order[LOCKSTAT_NLOCKS + 1];
+
+static
+void
+lockstat_rawacquire(void)
+{
+	while (spinlock_data_testandset(&lockstat_rawlock) != 0) {
+		/* spin */
+	}
+}
+
+static
+void
+lockstat_rawrelease(void)
+{
+	spinlock_data_set(&lockstat_rawlock, 0);
+}
+
+/*
+ * Zero an entry's counters. ls_acqtime is left alone: the lock may be
+ * held right now (lockstat_clear), and its release needs to know when
+ * it was acquired.
+ */
+static
+void
+lockstat_zero(struct lockstat *ls)
+{
+	ls->ls_acquires = 0;
+	ls->ls_contended = 0;
+	ls->ls_spins = 0;
+	ls->ls_waitns = 0;
+	ls->ls_maxholdns = 0;
+}
+
+/*
+ * Look through LOCK's slots for its entry. If it isn't there, hand
+ * back the first slot that could be claimed for it in *FREESLOT, or
+ * NULL if there isn't one.
+ */
+static
+struct lockstat *
+lockstat_probe(const void *lock, struct lockstat **freeslot)
+{
+	struct lockstat *ls;
+	uint32_t hash;
+	unsigned i;
+
+	*freeslot = NULL;
+	hash = ((uint32_t)(uintptr_t)lock >> 3) * 2654435761U;
+	for (i=0; i<LOCKSTAT_PROBE; i++) {
+		ls = &lockstats[(hash + i) & (LOCKSTAT_NLOCKS - 1)];
+		if (ls->ls_lock == lock) {
+			return ls;
+		}
+		if (ls->ls_lock == LOCKSTAT_FREED && *freeslot == NULL) {
+			*freeslot = ls;
+		}
+		else if (ls->ls_lock == NULL) {
+			if (*freeslot == NULL) {
+				*freeslot = ls;
+			}
+			/* nothing was ever put past here */
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Find the entry for LOCK. If there isn't one, claim one if CREATE
+ * is set (falling back to the overflow entry), or return NULL.
+ */
+static
+struct lockstat *
+lockstat_find(const void *lock, bool create)
+{
+	struct lockstat *ls, *slot;
+
+	ls = lockstat_probe(lock, &slot);
+	if (ls != NULL || !create) {
+		return ls;
+	}
+
+	/* Look again under the lock, in case the slots changed. */
+	lockstat_rawacquire();
+	ls = lockstat_probe(lock, &slot);
+	if (ls == NULL && slot != NULL) {
+		slot->ls_caller = NULL;
+		slot->ls_sleep = false;
+		slot->ls_name[0] = 0;
+		lockstat_zero(slot);
+		slot->ls_acqtime = 0;
+		slot->ls_lock = lock;
+		ls = slot;
+	}
+	lockstat_rawrelease();
+	return ls != NULL ? ls : &lockstats[LOCKSTAT_OVERFLOW];
+}
+
+/*
+ * A lock is being initialized. Start its entry over, naming it NAME
+ * if that isn't null.
+ */
+void
+lockstat_init(const void *lock, const char *name, bool sleep)
+{
+	struct lockstat *ls;
+	int spl;
+
+	spl = splhigh();
+	ls = lockstat_find(lock, name != NULL);
+	if (ls != NULL && ls != &lockstats[LOCKSTAT_OVERFLOW]) {
+		lockstat_zero(ls);
+		ls->ls_caller = NULL;
+		ls->ls_sleep = sleep;
+		snprintf(ls->ls_name, sizeof(ls->ls_name), "%s",
+			 name != NULL ? name : "");
+	}
+	splx(spl);
+}
+
+/*
+ * A lock is being destroyed. Add its numbers to the overflow entry
+ * and give back its slot.
+ */
+void
+lockstat_fini(const void *lock)
+{
+	struct lockstat *ls, *ov;
+	int spl;
+
+	spl = splhigh();
+	ls = lockstat_find(lock, false);
+	if (ls != NULL) {
+		ov = &lockstats[LOCKSTAT_OVERFLOW];
+		lockstat_rawacquire();
+		ov->ls_acquires += ls->ls_acquires;
+		ov->ls_contended += ls->ls_contended;
+		ov->ls_spins += ls->ls_spins;
+		ov->ls_waitns += ls->ls_waitns;
+		if (ls->ls_maxholdns > ov->ls_maxholdns) {
+			ov->ls_maxholdns = ls->ls_maxholdns;
+		}
+		lockstat_zero(ls);
+		ls->ls_lock = LOCKSTAT_FREED;
+		lockstat_rawrelease();
+	}
+	splx(spl);
+}
+
+/*
+ * LOCK has just been acquired, by a call from CALLER. If CONTENDED,
+ * it went around its spin loop SPINS times, having started waiting
+ * at time WAITSTART.
+ */
+void
+lockstat_acquired(const void *lock, const void *caller, bool sleep,
+		  bool contended, unsigned spins, uint64_t waitstart)
+{
+	struct lockstat *ls;
+	uint64_t now;
+	bool overflow;
+
+	now = gettime_ns();
+	ls = lockstat_find(lock, true);
+	overflow = ls == &lockstats[LOCKSTAT_OVERFLOW];
+	if (overflow) {
+		lockstat_rawacquire();
+	}
+
+	if (ls->ls_caller == NULL) {
+		ls->ls_caller = caller;
+		ls->ls_sleep = sleep;
+	}
+	ls->ls_acquires++;
+	if (contended) {
+		ls->ls_contended++;
+		ls->ls_spins += spins;
+		ls->ls_waitns += now > waitstart ? now - waitstart : 0;
+	}
+	ls->ls_acqtime = now;
+
+	if (overflow) {
+		lockstat_rawrelease();
+	}
+}
+
+/*
+ * LOCK is about to be released.
+ */
+void
+lockstat_released(const void *lock)
+{
+	struct lockstat *ls;
+	uint64_t now, held;
+
+	ls = lockstat_find(lock, false);
+	if (ls == NULL || ls == &lockstats[LOCKSTAT_OVERFLOW] ||
+	    ls->ls_acqtime == 0) {
+		/* untracked, or we didn't see it acquired */
+		return;
+	}
+	now = gettime_ns();
+	held = now > ls->ls_acqtime ? now - ls->ls_acqtime : 0;
+	if (held > ls->ls_maxholdns) {
+		ls->ls_maxholdns = held;
+	}
+}
+
+void
+lockstat_setname(const void *lock, const char *name)
+{
+	struct lockstat *ls;
+	int spl;
+
+	spl = splhigh();
+	ls = lockstat_find(lock, true);
+	if (ls != &lockstats[LOCKSTAT_OVERFLOW]) {
+		snprintf(ls->ls_name, sizeof(ls->ls_name), "%s", name);
+	}
+	splx(spl);
+}
+
+void
+lockstat_clear(void)
+{
+	unsigned i;
+	int spl;
+
+	spl = splhigh();
+	lockstat_rawacquire();
+	for (i=0; i<=LOCKSTAT_NLOCKS; i++) {
+		lockstat_zero(&lockstats[i]);
+	}
+	lockstat_rawrelease();
+	splx(spl);
+}
+
+/*
+ * Sort order: most contended first, then most time waited.
+ */
+static
+bool
+lockstat_before(const struct lockstat *a, const struct lockstat *b)
+{
+	if (a->ls_contended != b->ls_contended) {
+		return a->ls_contended > b->ls_contended;
+	}
+	return a->ls_waitns > b->ls_waitns;
+}
+
+void
+lockstat_printstats(bool all)
+{
+	struct lockstat *ls;
+	unsigned i, j, n, shown, idx;
+	int spl;
+
+	/* Snapshot the table so the numbers are consistent-ish. */
+	spl = splhigh();
+	lockstat_rawacquire();
+	memcpy(lockstat_snap, lockstats, sizeof(lockstats));
+	lockstat_rawrelease();
+	splx(spl);
+
+	/* Insertion sort the entries that have been used. */
+	n = 0;
+	for (i=0; i<=LOCKSTAT_NLOCKS; i++) {
+		if (lockstat_snap[i].ls_acquires == 0) {
+			continue;
+		}
+		for (j=n; j>0; j--) {
+			if (!lockstat_before(&lockstat_snap[i],
+					     &lockstat_snap[lockstat_order[j-1]])) {
+				break;
+			}
+			lockstat_order[j] = lockstat_order[j-1];
+		}
+		lockstat_order[j] = i;
+		n++;
+	}
+
+	kprintf("lock                         kind   acquires  contended"
+		"       spins   wait(us) maxhold(us)\n");
+	shown = all ? n : (n < LOCKSTAT_SHOW ? n : LOCKSTAT_SHOW);
+	for (i=0; i<shown; i++) {
+		idx = lockstat_order[i];
+		ls = &lockstat_snap[idx];
+		if (idx == LOCKSTAT_OVERFLOW) {
+			kprintf("%-28s", "(others)");
+		}
+		else if (ls->ls_name[0] != 0) {
+			kprintf("%-28s", ls->ls_name);
+		}
+		else {
+			kprintf("0x%08lx from 0x%08lx  ",
+				(unsigned long)(uintptr_t)ls->ls_lock,
+				(unsigned long)(uintptr_t)ls->ls_caller);
+		}
+		kprintf(" %-5s %9u %10u %11llu %10llu %11llu\n",
+			ls->ls_sleep ? "sleep" : "spin",
+			ls->ls_acquires, ls->ls_contended,
+			ls->ls_spins, ls->ls_waitns / 1000,
+			ls->ls_maxholdns / 1000);
+	}
+	if (shown < n) {
+		kprintf("(%u more; \"lockstat all\" shows them)\n", n - shown);
+	}
+}
+
+#else /* !OPT_LOCKSTAT */
+
+void
+lockstat_setname(const void *lock, const char *name)
+{
+	(void)lock;
+	(void)name;
+}
+
+void
+lockstat_clear(void)
+{
+}
+
+void
+lockstat_printstats(bool all)
+{
+	(void)all;
+	kprintf("Lock statistics are not compiled in "
+		"(enable options lockstat in the kernel config)\n");
+}
+
+#endif /* OPT_LOCKSTAT */
@@ -0,0 +1,135 @@
+/*
+ * MCS queue spinlocks. See mcslock.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spl.h>
+#include <clock.h>
+#include <mcslock.h>
+#include <lockstat.h>
+#include <current.h>	/* for curcpu */
+
+void
+mcslock_init(struct mcslock *lk)
+{
+	spinlock_data_set(&lk->ml_tail, 0);
+	lk->ml_holder = NULL;
+#if OPT_LOCKSTAT
+	lockstat_init(lk, NULL, false);
+#endif
+}
+
+void
+mcslock_cleanup(struct mcslock *lk)
+{
+	KASSERT(lk->ml_holder == NULL);
+	KASSERT(spinlock_data_get(&lk->ml_tail) == 0);
+#if OPT_LOCKSTAT
+	lockstat_fini(lk);
+#endif
+}
+
+/*
+ * Get in line: make our node the tail, and if there was somebody in
+ * front of us, link in behind them and wait for them to let us go.
+ */
+void
+mcslock_acquire(struct mcslock *lk, struct mcsnode *node)
+{
+	struct mcsnode *prev;
+	struct cpu *mycpu;
+#if OPT_LOCKSTAT
+	unsigned spins = 0;
+	uint64_t waitstart = 0;
+#endif
+
+	splraise(IPL_NONE, IPL_HIGH);
+
+	/* this must work before curcpu initialization */
+	if (CURCPU_EXISTS()) {
+		mycpu = curcpu->c_self;
+		if (lk->ml_holder == mycpu) {
+			panic("Deadlock on MCS lock %p\n", lk);
+		}
+	}
+	else {
+		mycpu = NULL;
+	}
+
+	spinlock_data_set(&node->mn_next, 0);
+	spinlock_data_set(&node->mn_wait, 1);
+
+	prev = (struct mcsnode *)
+		spinlock_data_swap(&lk->ml_tail, (spinlock_data_t)node);
+	if (prev != NULL) {
+		spinlock_data_set(&prev->mn_next, (spinlock_data_t)node);
+		while (spinlock_data_get(&node->mn_wait) != 0) {
+#if OPT_LOCKSTAT
+			if (spins++ == 0) {
+				waitstart = gettime_ns();
+			}
+#endif
+		}
+	}
+
+	lk->ml_holder = mycpu;
+#if OPT_LOCKSTAT
+	lockstat_acquired(lk, __builtin_return_address(0), false,
+			  prev != NULL, spins, waitstart);
+#endif
+}
+
+/*
+ * Let the next in line go. If there's nobody behind us, try to swing
+ * the tail back to empty; if that fails, someone is just linking in,
+ * so wait for them to finish.
+ */
+void
+mcslock_release(struct mcslock *lk, struct mcsnode *node)
+{
+	struct mcsnode *next;
+
+	/* this must work before curcpu initialization */
+	if (CURCPU_EXISTS()) {
+		KASSERT(lk->ml_holder == curcpu->c_self);
+	}
+
+#if OPT_LOCKSTAT
+	lockstat_released(lk);
+#endif
+	lk->ml_holder = NULL;
+
+	next = (struct mcsnode *)spinlock_data_get(&node->mn_next);
+	if (next == NULL) {
+		if (spinlock_data_cas(&lk->ml_tail, (spinlock_data_t)node, 0)
+		    == (spinlock_data_t)node) {
+			spllower(IPL_HIGH, IPL_NONE);
+			return;
+		}
+		while ((next = (struct mcsnode *)
+			spinlock_data_get(&node->mn_next)) == NULL) {
+			/* spin */
+		}
+	}
+	spinlock_data_set(&next->mn_wait, 0);
+
+	spllower(IPL_HIGH, IPL_NONE);
+}
+
+bool
+mcslock_do_i_hold(struct mcslock *lk)
+{
+	if (!CURCPU_EXISTS()) {
+		return true;
+	}
+
+	return (lk->ml_holder == curcpu->c_self);
+}
+
+bool
+mcslock_is_busy(struct mcslock *lk)
+{
+	return spinlock_data_get(&lk->ml_tail) != 0;
+}
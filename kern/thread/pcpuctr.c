@@ -0,0 +1,67 @@
+/*
+ * Per-cpu statistics counters. See pcpuctr.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spl.h>
+#include <current.h>
+#include <pcpuctr.h>
+
+/*
+ * Interrupts are turned off so that we can't be moved to another cpu
+ * between finding our row and updating it, or interrupted by a
+ * handler counting the same thing. (This also works before curcpu
+ * is set up; everything is counted as cpu 0 then.)
+ */
+void
+pcpuctr_add(struct pcpuctr *pc, unsigned which, unsigned delta)
+{
+	unsigned cpunum;
+	int spl;
+
+	KASSERT(which < pc->pc_num);
+
+	spl = splhigh();
+	cpunum = CURCPU_EXISTS() ? curcpu->c_number : 0;
+	KASSERT(cpunum < MAXCPUS);
+	pc->pc_slots[cpunum * pc->pc_stride + which] += delta;
+	splx(spl);
+}
+
+/*
+ * Cpus that don't exist have all-zero rows, so just add up every row.
+ */
+unsigned
+pcpuctr_read(struct pcpuctr *pc, unsigned which)
+{
+	unsigned sum, i;
+
+	KASSERT(which < pc->pc_num);
+
+	sum = 0;
+	for (i=0; i<MAXCPUS; i++) {
+		sum += pc->pc_slots[i * pc->pc_stride + which];
+	}
+	return sum;
+}
+
+unsigned
+pcpuctr_readcpu(struct pcpuctr *pc, unsigned which, unsigned cpunum)
+{
+	KASSERT(which < pc->pc_num);
+	KASSERT(cpunum < MAXCPUS);
+
+	return pc->pc_slots[cpunum * pc->pc_stride + which];
+}
+
+void
+pcpuctr_zero(struct pcpuctr *pc)
+{
+	unsigned i;
+
+	for (i=0; i<MAXCPUS * pc->pc_stride; i++) {
+		pc->pc_slots[i] = 0;
+	}
+}
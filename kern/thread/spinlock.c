@@ -36,6 +36,8 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <current.h>	/* for curcpu */
+#include <clock.h>
+#include <lockstat.h>
 
 /*
  * Spinlocks.
@@ -48,8 +50,12 @@
 void
 spinlock_init(struct spinlock *lk)
 {
-	spinlock_data_set(&lk->lk_lock, 0);
+	spinlock_data_set(&lk->lk_next, 0);
+	spinlock_data_set(&lk->lk_serving, 0);
 	lk->lk_holder = NULL;
+#if OPT_LOCKSTAT
+	lockstat_init(lk, NULL, false);
+#endif
 }
 
 /*
@@ -59,20 +65,29 @@ void
 spinlock_cleanup(struct spinlock *lk)
 {
 	KASSERT(lk->lk_holder == NULL);
-	KASSERT(spinlock_data_get(&lk->lk_lock) == 0);
+	KASSERT(spinlock_data_get(&lk->lk_next) ==
+		spinlock_data_get(&lk->lk_serving));
+#if OPT_LOCKSTAT
+	lockstat_fini(lk);
+#endif
 }
 
 /*
  * Get the lock.
  *
  * First disable interrupts (otherwise, if we get a timer interrupt we
- * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * might come back to this lock and deadlock), then take a ticket with
+ * a machine-level atomic add and wait for our number to come up.
  */
 void
 spinlock_acquire(struct spinlock *lk)
 {
 	struct cpu *mycpu;
+	spinlock_data_t ticket;
+#if OPT_LOCKSTAT
+	unsigned spins = 0;
+	uint64_t waitstart = 0;
+#endif
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -87,27 +102,20 @@ spinlock_acquire(struct spinlock *lk)
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&lk->lk_lock) != 0) {
-			continue;
+	ticket = spinlock_data_fetchadd(&lk->lk_next, 1);
+	while (spinlock_data_get(&lk->lk_serving) != ticket) {
+#if OPT_LOCKSTAT
+		if (spins++ == 0) {
+			waitstart = gettime_ns();
 		}
-		if (spinlock_data_testandset(&lk->lk_lock) != 0) {
-			continue;
-		}
-		break;
+#endif
 	}
 
 	lk->lk_holder = mycpu;
+#if OPT_LOCKSTAT
+	lockstat_acquired(lk, __builtin_return_address(0), false,
+			  spins > 0, spins, waitstart);
+#endif
 }
 
 /*
@@ -121,8 +129,13 @@ spinlock_release(struct spinlock *lk)
 		KASSERT(lk->lk_holder == curcpu->c_self);
 	}
 
+#if OPT_LOCKSTAT
+	lockstat_released(lk);
+#endif
 	lk->lk_holder = NULL;
-	spinlock_data_set(&lk->lk_lock, 0);
+	/* only the holder writes lk_serving, so no atomic op is needed */
+	spinlock_data_set(&lk->lk_serving,
+			  spinlock_data_get(&lk->lk_serving) + 1);
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -139,3 +152,13 @@ spinlock_do_i_hold(struct spinlock *lk)
 	/* Assume we can read lk_holder atomically enough for this to work */
 	return (lk->lk_holder == curcpu->c_self);
 }
+
+/*
+ * Check if anyone holds the lock.
+ */
+bool
+spinlock_is_busy(struct spinlock *lk)
+{
+	return spinlock_data_get(&lk->lk_next) !=
+		spinlock_data_get(&lk->lk_serving);
+}
@@ -38,7 +38,106 @@
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
+#include <cpu.h>
 #include <synch.h>
+#include <objcache.h>
+#include <clock.h>
+#include <lockstat.h>
+
+static struct objcache *sem_cache;
+static struct objcache *lock_cache;
+static struct objcache *cv_cache;
+static struct objcache *rwlock_cache;
+
+////////////////////////////////////////////////////////////
+//
+// Object caches.
+//
+// The embedded spinlocks are initialized once by the constructors
+// and cleaned up by the destructors; every other field is set up by
+// the create functions below.
+
+static
+int
+sem_ctor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	spinlock_init(&sem->sem_lock);
+	return 0;
+}
+
+static
+void
+sem_dtor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	spinlock_cleanup(&sem->sem_lock);
+}
+
+static
+int
+lock_ctor(void *obj)
+{
+	struct lock *lock = obj;
+
+	spinlock_init(&lock->lk_spinlock);
+	return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+	struct lock *lock = obj;
+
+	spinlock_cleanup(&lock->lk_spinlock);
+}
+
+static
+int
+rwlock_ctor(void *obj)
+{
+	struct rwlock *rwlock = obj;
+	unsigned i;
+
+	for (i=0; i<RWLOCK_NSLOTS; i++) {
+		spinlock_init(&rwlock->rwl_slots[i].rs_u.rs.rs_lock);
+	}
+	spinlock_init(&rwlock->rwl_lock);
+	return 0;
+}
+
+static
+void
+rwlock_dtor(void *obj)
+{
+	struct rwlock *rwlock = obj;
+	unsigned i;
+
+	for (i=0; i<RWLOCK_NSLOTS; i++) {
+		spinlock_cleanup(&rwlock->rwl_slots[i].rs_u.rs.rs_lock);
+	}
+	spinlock_cleanup(&rwlock->rwl_lock);
+}
+
+void
+synch_bootstrap(void)
+{
+	sem_cache = objcache_create("semaphore", sizeof(struct semaphore),
+				    sem_ctor, sem_dtor);
+	lock_cache = objcache_create("lock", sizeof(struct lock),
+				     lock_ctor, lock_dtor);
+	cv_cache = objcache_create("cv", sizeof(struct cv), NULL, NULL);
+	rwlock_cache = objcache_create_aligned("rwlock", sizeof(struct rwlock),
+					       RWLOCK_SLOTSIZE,
+					       rwlock_ctor, rwlock_dtor);
+	if (sem_cache == NULL || lock_cache == NULL || cv_cache == NULL ||
+	    rwlock_cache == NULL) {
+		panic("synch_bootstrap: Out of memory\n");
+	}
+}
 
 ////////////////////////////////////////////////////////////
 //
@@ -51,25 +150,24 @@ sem_create(const char *name, int initial_count)
 
         KASSERT(initial_count >= 0);
 
-        sem = kmalloc(sizeof(struct semaphore));
+        sem = objcache_alloc(sem_cache);
         if (sem == NULL) {
                 return NULL;
         }
 
         sem->sem_name = kstrdup(name);
         if (sem->sem_name == NULL) {
-                kfree(sem);
+                objcache_free(sem_cache, sem);
                 return NULL;
         }
 
 	sem->sem_wchan = wchan_create(sem->sem_name);
 	if (sem->sem_wchan == NULL) {
 		kfree(sem->sem_name);
-		kfree(sem);
+		objcache_free(sem_cache, sem);
 		return NULL;
 	}
 
-	spinlock_init(&sem->sem_lock);
         sem->sem_count = initial_count;
 
         return sem;
@@ -80,11 +178,10 @@ sem_destroy(struct semaphore *sem)
 {
         KASSERT(sem != NULL);
 
-	/* wchan_cleanup will assert if anyone's waiting on it */
-	spinlock_cleanup(&sem->sem_lock);
+	/* wchan_destroy will assert if anyone's waiting on it */
 	wchan_destroy(sem->sem_wchan);
         kfree(sem->sem_name);
-        kfree(sem);
+        objcache_free(sem_cache, sem);
 }
 
 void
@@ -129,6 +226,38 @@ P(struct semaphore *sem)
 	spinlock_release(&sem->sem_lock);
 }
 
+/*
+ * Like P, but give up once callout tick DEADLINE has passed. If the
+ * count is nonzero it's decremented whether or not the deadline has
+ * passed, so this can also be used to try P without waiting.
+ */
+int
+sem_timedP(struct semaphore *sem, uint32_t deadline)
+{
+	int result;
+
+        KASSERT(sem != NULL);
+        KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&sem->sem_lock);
+        while (sem->sem_count == 0) {
+		/* See P for why we bridge to the wchan lock. */
+		wchan_lock(sem->sem_wchan);
+		spinlock_release(&sem->sem_lock);
+		result = wchan_sleep_deadline(sem->sem_wchan, deadline);
+
+		spinlock_acquire(&sem->sem_lock);
+		if (result && sem->sem_count == 0) {
+			spinlock_release(&sem->sem_lock);
+			return result;
+		}
+        }
+        KASSERT(sem->sem_count > 0);
+        sem->sem_count--;
+	spinlock_release(&sem->sem_lock);
+	return 0;
+}
+
 void
 V(struct semaphore *sem)
 {
@@ -152,23 +281,29 @@ lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(struct lock));
+        lock = objcache_alloc(lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
 
         lock->lk_name = kstrdup(name);
         if (lock->lk_name == NULL) {
-                kfree(lock);
+                objcache_free(lock_cache, lock);
                 return NULL;
         }
 
         lock->wc = wchan_create(lock->lk_name);
-
-        spinlock_init(&lock->lk_spinlock);
+        if (lock->wc == NULL) {
+                kfree(lock->lk_name);
+                objcache_free(lock_cache, lock);
+                return NULL;
+        }
 
         lock->hold = false;
         lock->owner = NULL;
+#if OPT_LOCKSTAT
+        lockstat_init(lock, lock->lk_name, true);
+#endif
 
         return lock;
 }
@@ -177,41 +312,112 @@ void
 lock_destroy(struct lock *lock)
 {
         KASSERT(lock != NULL);
-        spinlock_cleanup(&(lock->lk_spinlock));
+        KASSERT(!lock->hold);
         wchan_destroy(lock->wc);
+#if OPT_LOCKSTAT
+        lockstat_fini(lock);
+#endif
 
         kfree(lock->lk_name);
-        kfree(lock);
+        objcache_free(lock_cache, lock);
 }
 
+/*
+ * The lock is adaptive: a thread that finds it held spins rather than
+ * sleeping as long as the holder is running on another cpu, since it
+ * is then likely to let go soon and sleeping would cost two context
+ * switches. It sleeps if the holder isn't running (so won't let go
+ * until someone else runs), or if it has spun for LOCK_SPINMAX loops
+ * in all. The holder's state is rechecked under lk_spinlock every
+ * LOCK_SPINCHECK loops; in between, only lock->hold is looked at.
+ *
+ * Sleepers are served in FIFO order by direct handoff: lock_release
+ * makes the first sleeper the owner before waking it, rather than
+ * letting it go and making the sleeper race for it again, so a woken
+ * thread never has to go back to sleep. The lock stays held through
+ * the handoff, so spinners don't barge in ahead of it either.
+ */
+#define LOCK_SPINMAX    4000
+#define LOCK_SPINCHECK  100
+
 void
 lock_acquire(struct lock *lock)
 {
+      unsigned spins, i;
+      bool spun = false, slept = false;
+#if OPT_LOCKSTAT
+      uint64_t waitstart = 0;
+#endif
+
       KASSERT(lock != NULL);
       KASSERT(!lock_do_i_hold(lock));
 
+      spins = 0;
       spinlock_acquire(&(lock->lk_spinlock));
-      while(lock->hold) {
+#if OPT_LOCKSTAT
+      if (lock->hold) {
+        waitstart = gettime_ns();
+      }
+#endif
+      while(lock->hold && lock->owner != curthread) {
+        if (spins < LOCK_SPINMAX && lock->owner->t_state == S_RUN) {
+          spinlock_release(&(lock->lk_spinlock));
+          for (i=0; i<LOCK_SPINCHECK && lock->hold; i++) {
+            /* spin */
+          }
+          spins += LOCK_SPINCHECK;
+          spun = true;
+          spinlock_acquire(&(lock->lk_spinlock));
+          continue;
+        }
         wchan_lock(lock->wc);
         spinlock_release(&(lock->lk_spinlock));
         wchan_sleep(lock->wc);
+        slept = true;
         spinlock_acquire(&(lock->lk_spinlock));
       }
       lock->hold = true;
       lock->owner = curthread;
+
+      /* interrupts are off while we hold the spinlock */
+      if (slept) {
+        curcpu->c_lockblocks++;
+      }
+      else if (spun) {
+        curcpu->c_lockspins++;
+      }
+      else {
+        curcpu->c_lockfree++;
+      }
+#if OPT_LOCKSTAT
+      lockstat_acquired(lock, __builtin_return_address(0), true,
+                        spun || slept, spins, waitstart);
+#endif
       spinlock_release(&(lock->lk_spinlock));
 }
 
 void
 lock_release(struct lock *lock)
 {
+      struct thread *target;
+
       KASSERT(lock_do_i_hold(lock));
       KASSERT(lock != NULL);
 
       spinlock_acquire(&(lock->lk_spinlock));
-      lock->hold = false;
-      lock->owner = NULL;
-      wchan_wakeone(lock->wc);
+#if OPT_LOCKSTAT
+      lockstat_released(lock);
+#endif
+      target = wchan_takeone(lock->wc);
+      if (target != NULL) {
+        /* hand it straight over; hold stays set */
+        lock->owner = target;
+        wchan_wakethread(target);
+      }
+      else {
+        lock->hold = false;
+        lock->owner = NULL;
+      }
       spinlock_release(&(lock->lk_spinlock));
 }
 
@@ -233,18 +439,23 @@ cv_create(const char *name)
 {
         struct cv *cv;
 
-        cv = kmalloc(sizeof(struct cv));
+        cv = objcache_alloc(cv_cache);
         if (cv == NULL) {
                 return NULL;
         }
 
         cv->cv_name = kstrdup(name);
         if (cv->cv_name==NULL) {
-                kfree(cv);
+                objcache_free(cv_cache, cv);
                 return NULL;
         }
 
         cv->cv_wc = wchan_create(cv->cv_name);
+        if (cv->cv_wc == NULL) {
+                kfree(cv->cv_name);
+                objcache_free(cv_cache, cv);
+                return NULL;
+        }
 
         return cv;
 }
@@ -257,7 +468,34 @@ cv_destroy(struct cv *cv)
         wchan_destroy(cv->cv_wc);
 
         kfree(cv->cv_name);
-        kfree(cv);
+        objcache_free(cv_cache, cv);
+}
+
+/*
+ * Signalled threads aren't woken up, only to find the lock held by
+ * the signaller and go straight back to sleep; instead they're moved
+ * onto the lock's wait channel ("wait morphing"), so lock_release
+ * hands them the lock one at a time. This is why the caller must
+ * hold the lock: it keeps lock_release from running in between.
+ */
+/*
+ * Get LOCK back after sleeping on a CV: usually lock_release has
+ * already handed it to us.
+ */
+static
+void
+cv_reacquire(struct lock *lock)
+{
+        if (lock_do_i_hold(lock)) {
+#if OPT_LOCKSTAT
+                spinlock_acquire(&(lock->lk_spinlock));
+                lockstat_acquired(lock, __builtin_return_address(0), true,
+                                  false, 0, 0);
+                spinlock_release(&(lock->lk_spinlock));
+#endif
+                return;
+        }
+        lock_acquire(lock);
 }
 
 void
@@ -270,7 +508,28 @@ cv_wait(struct cv *cv, struct lock *lock)
         wchan_lock(cv->cv_wc);
         lock_release(lock);
         wchan_sleep(cv->cv_wc);
-        lock_acquire(lock);
+        cv_reacquire(lock);
+}
+
+/*
+ * A timeout can only take us off the CV's channel; once a signal has
+ * moved us to the lock's channel we're committed to waiting for the
+ * lock, and that counts as having been signalled.
+ */
+int
+cv_timedwait(struct cv *cv, struct lock *lock, uint32_t deadline)
+{
+        int result;
+
+        KASSERT(cv != NULL);
+        KASSERT(lock != NULL);
+        KASSERT(lock->owner == curthread);
+
+        wchan_lock(cv->cv_wc);
+        lock_release(lock);
+        result = wchan_sleep_deadline(cv->cv_wc, deadline);
+        cv_reacquire(lock);
+        return result;
 }
 
 void
@@ -280,8 +539,7 @@ cv_signal(struct cv *cv, struct lock *lock)
         KASSERT(cv != NULL);
         KASSERT(lock != NULL);
 
-        wchan_wakeone(cv->cv_wc);
-
+        wchan_move(cv->cv_wc, lock->wc, false);
 }
 
 void
@@ -290,5 +548,245 @@ cv_broadcast(struct cv *cv, struct lock *lock)
         KASSERT(lock->owner == curthread);
         KASSERT(cv != NULL);
         KASSERT(lock != NULL);
-        wchan_wakeall(cv->cv_wc);
+
+        wchan_move(cv->cv_wc, lock->wc, true);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+//
+// Lock order: rwl_lock, then a slot lock. Readers that find no writer
+// about touch only their own slot.
+
+struct rwlock *
+rwlock_create(const char *name, bool writerpref)
+{
+	struct rwlock *rwlock;
+	unsigned i;
+
+	rwlock = objcache_alloc(rwlock_cache);
+	if (rwlock == NULL) {
+		return NULL;
+	}
+
+	rwlock->rwl_name = kstrdup(name);
+	if (rwlock->rwl_name == NULL) {
+		goto fail_obj;
+	}
+	rwlock->rwl_readwc = wchan_create(rwlock->rwl_name);
+	if (rwlock->rwl_readwc == NULL) {
+		goto fail_name;
+	}
+	rwlock->rwl_writewc = wchan_create(rwlock->rwl_name);
+	if (rwlock->rwl_writewc == NULL) {
+		goto fail_readwc;
+	}
+	rwlock->rwl_drainwc = wchan_create(rwlock->rwl_name);
+	if (rwlock->rwl_drainwc == NULL) {
+		goto fail_writewc;
+	}
+
+	for (i=0; i<RWLOCK_NSLOTS; i++) {
+		rwlock->rwl_slots[i].rs_u.rs.rs_readers = 0;
+	}
+	rwlock->rwl_writer = false;
+	rwlock->rwl_owner = NULL;
+	rwlock->rwl_writers_waiting = 0;
+	rwlock->rwl_writerpref = writerpref;
+
+	return rwlock;
+
+ fail_writewc:
+	wchan_destroy(rwlock->rwl_writewc);
+ fail_readwc:
+	wchan_destroy(rwlock->rwl_readwc);
+ fail_name:
+	kfree(rwlock->rwl_name);
+ fail_obj:
+	objcache_free(rwlock_cache, rwlock);
+	return NULL;
+}
+
+/*
+ * Total number of readers. Called with rwl_lock held.
+ */
+static
+int
+rwlock_readers(struct rwlock *rwlock)
+{
+	struct rwlock_slot *slot;
+	unsigned i;
+	int total;
+
+	KASSERT(spinlock_do_i_hold(&rwlock->rwl_lock));
+
+	total = 0;
+	for (i=0; i<RWLOCK_NSLOTS; i++) {
+		slot = &rwlock->rwl_slots[i];
+		spinlock_acquire(&slot->rs_u.rs.rs_lock);
+		total += slot->rs_u.rs.rs_readers;
+		spinlock_release(&slot->rs_u.rs.rs_lock);
+	}
+	KASSERT(total >= 0);
+	return total;
+}
+
+void
+rwlock_destroy(struct rwlock *rwlock)
+{
+	KASSERT(rwlock != NULL);
+	KASSERT(!rwlock->rwl_writer);
+
+	spinlock_acquire(&rwlock->rwl_lock);
+	KASSERT(rwlock_readers(rwlock) == 0);
+	spinlock_release(&rwlock->rwl_lock);
+
+	wchan_destroy(rwlock->rwl_drainwc);
+	wchan_destroy(rwlock->rwl_writewc);
+	wchan_destroy(rwlock->rwl_readwc);
+	kfree(rwlock->rwl_name);
+	objcache_free(rwlock_cache, rwlock);
+}
+
+/*
+ * The slot for the current cpu. If we move cpus before using it, no
+ * harm done.
+ */
+static
+struct rwlock_slot *
+rwlock_myslot(struct rwlock *rwlock)
+{
+	return &rwlock->rwl_slots[curcpu->c_number % RWLOCK_NSLOTS];
+}
+
+/*
+ * True if a new reader should wait.
+ */
+static
+bool
+rwlock_readers_blocked(struct rwlock *rwlock)
+{
+	return rwlock->rwl_writer ||
+		(rwlock->rwl_writerpref && rwlock->rwl_writers_waiting > 0);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rwlock)
+{
+	struct rwlock_slot *slot;
+
+	KASSERT(rwlock != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(!rwlock_do_i_hold_write(rwlock));
+
+	/*
+	 * Fast path: no writer about, so count ourselves in. A writer
+	 * sets rwl_writer before it sums the slots, taking each slot's
+	 * lock, so either it sees us or we see it.
+	 */
+	slot = rwlock_myslot(rwlock);
+	spinlock_acquire(&slot->rs_u.rs.rs_lock);
+	if (!rwlock_readers_blocked(rwlock)) {
+		slot->rs_u.rs.rs_readers++;
+		spinlock_release(&slot->rs_u.rs.rs_lock);
+		return;
+	}
+	spinlock_release(&slot->rs_u.rs.rs_lock);
+
+	/* Slow path: wait for the writers to go away. */
+	spinlock_acquire(&rwlock->rwl_lock);
+	while (rwlock_readers_blocked(rwlock)) {
+		wchan_lock(rwlock->rwl_readwc);
+		spinlock_release(&rwlock->rwl_lock);
+		wchan_sleep(rwlock->rwl_readwc);
+		spinlock_acquire(&rwlock->rwl_lock);
+	}
+	slot = rwlock_myslot(rwlock);
+	spinlock_acquire(&slot->rs_u.rs.rs_lock);
+	slot->rs_u.rs.rs_readers++;
+	spinlock_release(&slot->rs_u.rs.rs_lock);
+	spinlock_release(&rwlock->rwl_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rwlock)
+{
+	KASSERT(rwlock != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(!rwlock_do_i_hold_write(rwlock));
+
+	spinlock_acquire(&rwlock->rwl_lock);
+
+	/* Wait our turn behind other writers. */
+	while (rwlock->rwl_writer) {
+		rwlock->rwl_writers_waiting++;
+		wchan_lock(rwlock->rwl_writewc);
+		spinlock_release(&rwlock->rwl_lock);
+		wchan_sleep(rwlock->rwl_writewc);
+		spinlock_acquire(&rwlock->rwl_lock);
+		rwlock->rwl_writers_waiting--;
+	}
+
+	/* Turn new readers away and wait for the current ones to leave. */
+	rwlock->rwl_writer = true;
+	rwlock->rwl_owner = curthread;
+	while (rwlock_readers(rwlock) > 0) {
+		wchan_lock(rwlock->rwl_drainwc);
+		spinlock_release(&rwlock->rwl_lock);
+		wchan_sleep(rwlock->rwl_drainwc);
+		spinlock_acquire(&rwlock->rwl_lock);
+	}
+
+	spinlock_release(&rwlock->rwl_lock);
+}
+
+void
+rwlock_release(struct rwlock *rwlock)
+{
+	struct rwlock_slot *slot;
+	bool writer;
+
+	KASSERT(rwlock != NULL);
+
+	if (rwlock_do_i_hold_write(rwlock)) {
+		spinlock_acquire(&rwlock->rwl_lock);
+		rwlock->rwl_writer = false;
+		rwlock->rwl_owner = NULL;
+		if (rwlock->rwl_writerpref &&
+		    rwlock->rwl_writers_waiting > 0) {
+			wchan_wakeone(rwlock->rwl_writewc);
+		}
+		else {
+			wchan_wakeall(rwlock->rwl_readwc);
+			wchan_wakeone(rwlock->rwl_writewc);
+		}
+		spinlock_release(&rwlock->rwl_lock);
+		return;
+	}
+
+	slot = rwlock_myslot(rwlock);
+	spinlock_acquire(&slot->rs_u.rs.rs_lock);
+	slot->rs_u.rs.rs_readers--;
+	writer = rwlock->rwl_writer;
+	spinlock_release(&slot->rs_u.rs.rs_lock);
+
+	if (writer) {
+		/*
+		 * A writer may be draining; poke it to recount. It
+		 * holds rwl_lock from its count until it's asleep, so
+		 * this can't get in between.
+		 */
+		spinlock_acquire(&rwlock->rwl_lock);
+		wchan_wakeone(rwlock->rwl_drainwc);
+		spinlock_release(&rwlock->rwl_lock);
+	}
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rwlock)
+{
+	KASSERT(rwlock != NULL);
+
+	return rwlock->rwl_writer && rwlock->rwl_owner == curthread;
 }
@@ -38,6 +38,7 @@
 #include <lib.h>
 #include <array.h>
 #include <cpu.h>
+#include <clock.h>
 #include <spl.h>
 #include <spinlock.h>
 #include <wchan.h>
@@ -47,9 +48,13 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <lockstat.h>
 #include <addrspace.h>
 #include <mainbus.h>
+#include <platform/maxcpus.h>
 #include <vnode.h>
+#include <objcache.h>
+#include <callout.h>
 
 #include "opt-synchprobs.h"
 
@@ -72,6 +77,10 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Object caches for thread structures and wait channels. */
+static struct objcache *thread_cache;
+static struct objcache *wchan_cache;
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -111,9 +120,80 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Constructor and destructor for thread_cache. The list node points
+ * back at its own thread, so it only needs to be set up once; it is
+ * always unlinked again by the time the thread is destroyed.
+ */
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_init(&thread->t_listnode, thread);
+	return 0;
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_cleanup(&thread->t_listnode);
+}
+
+/* In the thread pool section below */
+static struct thread *thread_pool_get(void);
+
+/*
+ * List of all live threads, for thread_printtimes. Pooled threads
+ * are not on it.
+ */
+static struct spinlock allthreads_lock = SPINLOCK_INITIALIZER;
+static struct thread *allthreads;
+
+static
+void
+allthreads_add(struct thread *thread)
+{
+	spinlock_acquire(&allthreads_lock);
+	thread->t_allprev = NULL;
+	thread->t_allnext = allthreads;
+	if (allthreads != NULL) {
+		allthreads->t_allprev = thread;
+	}
+	allthreads = thread;
+	spinlock_release(&allthreads_lock);
+}
+
+static
+void
+allthreads_remove(struct thread *thread)
+{
+	spinlock_acquire(&allthreads_lock);
+	if (thread->t_allprev != NULL) {
+		thread->t_allprev->t_allnext = thread->t_allnext;
+	}
+	else {
+		KASSERT(allthreads == thread);
+		allthreads = thread->t_allnext;
+	}
+	if (thread->t_allnext != NULL) {
+		thread->t_allnext->t_allprev = thread->t_allprev;
+	}
+	thread->t_allprev = thread->t_allnext = NULL;
+	spinlock_release(&allthreads_lock);
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
+ *
+ * If the current cpu's thread pool has a recycled thread, that is
+ * used, and it comes with a stack already attached; otherwise
+ * t_stack is NULL and the caller must supply one.
  */
 static
 struct thread *
@@ -123,14 +203,19 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = thread_pool_get();
 	if (thread == NULL) {
-		return NULL;
+		thread = objcache_alloc(thread_cache);
+		if (thread == NULL) {
+			return NULL;
+		}
+		thread->t_stack = NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kfree(thread->t_stack);
+		objcache_free(thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -138,11 +223,23 @@ thread_create(const char *name)
 
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
+	KASSERT(thread->t_listnode.tln_self == thread);
+	/* t_stack was set above */
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_lastrun = 0;
+	thread->t_waketime = 0;
+	thread->t_statetime = 0;
+	thread->t_runtime = 0;
+	thread->t_readytime = 0;
+	thread->t_sleeptime = 0;
+	thread->t_wchan = NULL;
+	thread->t_migrations = 0;
+	thread->t_wakeups = 0;
+	thread->t_wakelat = 0;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -151,6 +248,8 @@ thread_create(const char *name)
 
 	/* If you add to struct thread, be sure to initialize here */
 
+	allthreads_add(thread);
+
 	return thread;
 }
 
@@ -167,6 +266,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -180,9 +280,32 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_idleclocks = 0;
+	c->c_steals = 0;
+	c->c_stealmisses = 0;
+	c->c_wakemoves = 0;
+	c->c_wakeups = 0;
+	c->c_wakelat = 0;
+	c->c_wakelatmax = 0;
+	for (i=0; i<RQWAIT_BUCKETS; i++) {
+		c->c_rqwait[i] = 0;
+	}
+	threadlist_init(&c->c_threadpool);
+	c->c_poolhits = 0;
+	c->c_poolmisses = 0;
+	c->c_forks = 0;
+	c->c_forktime = 0;
+	c->c_lockfree = 0;
+	c->c_lockspins = 0;
+	c->c_lockblocks = 0;
+
+	c->c_epochgen = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<NPRIORITIES; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runcount = 0;
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
@@ -213,7 +336,7 @@ cpu_create(unsigned hardware_number)
 		 */
 		/*c->c_curthread->t_stack = ... */
 	}
-	else {
+	else if (c->c_curthread->t_stack == NULL) {
 		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
 		if (c->c_curthread->t_stack == NULL) {
 			panic("cpu_create: couldn't allocate stack");
@@ -252,19 +375,97 @@ thread_destroy(struct thread *thread)
 	if (thread->t_stack != NULL) {
 		kfree(thread->t_stack);
 	}
-	threadlistnode_cleanup(&thread->t_listnode);
+	KASSERT(thread->t_listnode.tln_next == NULL);
+	KASSERT(thread->t_listnode.tln_prev == NULL);
 	thread_machdep_cleanup(&thread->t_machdep);
 
+	allthreads_remove(thread);
+
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	objcache_free(thread_cache, thread);
+}
+
+/*
+ * Thread pool.
+ *
+ * Rather than freeing every dead thread and allocating a new struct
+ * thread and stack for every fork, each cpu keeps up to
+ * THREADPOOL_MAX dead threads with their stacks still attached.
+ * exorcise puts them in and thread_create takes them out. The stack
+ * guard band is checked on the way in, so it is still valid on the
+ * way out and does not need to be rewritten.
+ *
+ * The pool is only touched by its own cpu, with interrupts off so we
+ * can't be migrated partway through.
+ */
+
+/*
+ * Get a recycled thread from the current cpu's pool, or NULL.
+ */
+static
+struct thread *
+thread_pool_get(void)
+{
+	struct thread *thread;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		/* Too early in boot. */
+		return NULL;
+	}
+
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_threadpool);
+	if (thread != NULL) {
+		curcpu->c_poolhits++;
+	}
+	else {
+		curcpu->c_poolmisses++;
+	}
+	splx(spl);
+
+	if (thread != NULL) {
+		KASSERT(thread->t_stack != NULL);
+		thread_checkstack(thread);
+	}
+	return thread;
+}
+
+/*
+ * Put a dead thread in the current cpu's pool, if there's room and it
+ * has a stack we can reuse. Otherwise destroy it.
+ */
+static
+void
+thread_pool_put(struct thread *thread)
+{
+	struct threadlist *pool;
+
+	KASSERT(curthread->t_curspl > 0);
+	KASSERT(thread->t_proc == NULL);
+
+	pool = &curcpu->c_threadpool;
+	if (thread->t_stack == NULL || pool->tl_count >= THREADPOOL_MAX) {
+		thread_destroy(thread);
+		return;
+	}
+
+	thread_checkstack(thread);
+	allthreads_remove(thread);
+	thread_machdep_cleanup(&thread->t_machdep);
+	kfree(thread->t_name);
+	thread->t_name = NULL;
+	thread->t_wchan_name = "POOLED";
+	threadlist_addhead(pool, thread);
 }
 
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
- * need to have thread_destroy called on them.)
+ * need to have thread_destroy called on them.) Their structures go
+ * back into the thread pool when possible.
  *
  * The list of zombies is per-cpu.
  */
@@ -277,7 +478,7 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		thread_pool_put(z);
 	}
 }
 
@@ -289,6 +490,8 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -303,9 +506,12 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = NULL;
-	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	for (i=0; i<NPRIORITIES; i++) {
+		curcpu->c_runqueue[i].tl_count = 0;
+		curcpu->c_runqueue[i].tl_head.tln_next = NULL;
+		curcpu->c_runqueue[i].tl_tail.tln_prev = NULL;
+	}
+	curcpu->c_runcount = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -351,6 +557,12 @@ thread_bootstrap(void)
 
 	cpuarray_init(&allcpus);
 
+	thread_cache = objcache_create("thread", sizeof(struct thread),
+				       thread_ctor, thread_dtor);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -412,10 +624,18 @@ cpu_hatch(unsigned software_number)
 void
 thread_start_cpus(void)
 {
+	char name[16];
 	unsigned i;
 
 	kprintf("cpu0: %s\n", cpu_identify());
 
+	/* Label the run queue locks in the lock statistics. */
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		snprintf(name, sizeof(name), "runqueue %u", i);
+		lockstat_setname(&cpuarray_get(&allcpus, i)->c_runqueue_lock,
+				 name);
+	}
+
 	cpu_startup_sem = sem_create("cpu_hatch", 0);
 	mainbus_start_cpus();
 	
@@ -426,16 +646,203 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/* At bottom of scheduler section */
+static struct thread *thread_steal(void);
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Run queues. Each cpu has a run queue per priority level, and
+ * threads are queued according to their t_priority. The caller must
+ * hold the cpu's run queue lock.
+ */
+
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(t->t_priority < NPRIORITIES);
+	threadlist_addtail(&c->c_runqueue[t->t_priority], t);
+	c->c_runcount++;
+}
+
+/*
+ * Return the highest priority level that has a thread waiting, or
+ * NPRIORITIES if the run queues are empty.
+ */
+static
+unsigned
+runqueue_toplevel(struct cpu *c)
+{
+	unsigned i;
+
+	for (i=0; i<NPRIORITIES; i++) {
+		if (!threadlist_isempty(&c->c_runqueue[i])) {
+			break;
+		}
+	}
+	return i;
+}
+
+/*
+ * Take the next thread to run: the first one at the highest level.
+ */
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	unsigned i;
+
+	i = runqueue_toplevel(c);
+	if (i == NPRIORITIES) {
+		return NULL;
+	}
+	c->c_runcount--;
+	return threadlist_remhead(&c->c_runqueue[i]);
+}
+
+/*
+ * Time accounting.
+ *
+ * t_statetime is when the thread last changed between running, being
+ * on a run queue, and sleeping (or exiting); whoever changes it
+ * charges the time since then to the right total. A thread is
+ * charged run time when it switches out, sleep time when it is woken
+ * (thread_make_runnable), and run queue time when it switches in.
+ * A t_statetime of 0 means no timestamp yet: either the clock wasn't
+ * up, or it's a new thread that hasn't been queued.
+ *
+ * Run queue waits also go in a per-cpu histogram with power-of-two
+ * buckets in microseconds: bucket 0 is under 2us, bucket b is
+ * [2^b, 2^(b+1)) us, and the last bucket is everything longer.
+ */
+
+static
+uint64_t
+thread_elapsed(uint64_t now, uint64_t then)
+{
+	/* different cpus may read the clock in a different order */
+	return now > then ? now - then : 0;
+}
+
+static
+unsigned
+rqwait_bucket(uint64_t ns)
+{
+	uint64_t us;
+	unsigned b;
+
+	us = ns / 1000;
+	for (b = 0; us > 1 && b < RQWAIT_BUCKETS - 1; b++) {
+		us >>= 1;
+	}
+	return b;
+}
+
+/*
+ * NEXT has been taken off a run queue to run at time NOW. Charge its
+ * wait and, if it was woken up rather than preempted, its wakeup
+ * latency. Called from thread_switch with the run queue locked.
+ */
+static
+void
+thread_switchin(struct thread *next, uint64_t now)
+{
+	uint64_t wait, lat;
+
+	if (next->t_statetime != 0) {
+		wait = thread_elapsed(now, next->t_statetime);
+		next->t_readytime += wait;
+		curcpu->c_rqwait[rqwait_bucket(wait)]++;
+	}
+	next->t_statetime = now;
+
+	if (next->t_waketime != 0) {
+		lat = thread_elapsed(now, next->t_waketime);
+		next->t_waketime = 0;
+		next->t_wakeups++;
+		next->t_wakelat += lat;
+
+		curcpu->c_wakeups++;
+		curcpu->c_wakelat += lat;
+		if (lat > curcpu->c_wakelatmax) {
+			curcpu->c_wakelatmax = lat;
+		}
+	}
+}
+
+/*
+ * TARGET is being made runnable at time NOW. Charge the time it was
+ * asleep, unless it's a new thread, and start its wakeup latency.
+ */
+static
+void
+thread_wakecharge(struct thread *target, uint64_t now)
+{
+	if (target->t_statetime != 0) {
+		target->t_sleeptime += thread_elapsed(now, target->t_statetime);
+		target->t_waketime = now;
+	}
+	target->t_statetime = now;
+}
+
+/*
+ * Wakeup placement.
+ *
+ * A thread being woken up (or newly forked) is queued on the cpu it
+ * last ran on if that cpu is idle or has at most WAKEUP_LIGHTLOAD
+ * threads waiting, since that is where its cache footprint is.
+ * Otherwise we would rather run it somewhere right away than wait
+ * behind the others, so if some other cpu is idle we send it there.
+ * If every cpu is busy it stays put and work stealing sorts it out.
+ *
+ * The other cpus' c_isidle flags are read without locking; if the
+ * guess is stale the thread just waits in that cpu's queue a bit.
+ *
+ * The caller holds LAST's run queue lock. If LAST is still idling on
+ * the thread's stack (see thread_steal), the thread must stay there.
+ */
+
+#define WAKEUP_LIGHTLOAD  1
+
+static
+struct cpu *
+thread_wakeup_cpu(struct thread *target, struct cpu *last)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+
+	KASSERT(spinlock_do_i_hold(&last->c_runqueue_lock));
+
+	if (last->c_curthread == target || last->c_isidle ||
+	    last->c_runcount <= WAKEUP_LIGHTLOAD) {
+		return last;
+	}
+
+	/* Start after LAST so wakeups spread out over the idle cpus. */
+	numcpus = cpuarray_num(&allcpus);
+	for (i=1; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, (last->c_number + i) % numcpus);
+		if (c->c_isidle) {
+			return c;
+		}
+	}
+	return last;
+}
+
 /*
  * Make a thread runnable.
  *
- * targetcpu might be curcpu; it might not be, too. 
+ * targetcpu might be curcpu; it might not be, too. If we are not
+ * already holding its run queue lock (that is, we are waking the
+ * thread up or starting it, not requeueing curthread), the thread
+ * may be moved to another cpu first; see above.
  */
 static
 void
 thread_make_runnable(struct thread *target, bool already_have_lock)
 {
-	struct cpu *targetcpu;
+	struct cpu *targetcpu, *newcpu;
 	bool isidle;
 
 	/* Lock the run queue of the target thread's cpu. */
@@ -447,10 +854,22 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 	else {
 		spinlock_acquire(&targetcpu->c_runqueue_lock);
+
+		thread_wakecharge(target, gettime_ns());
+
+		newcpu = thread_wakeup_cpu(target, targetcpu);
+		if (newcpu != targetcpu) {
+			spinlock_release(&targetcpu->c_runqueue_lock);
+			target->t_cpu = newcpu;
+			target->t_migrations++;
+			curcpu->c_wakemoves++;
+			targetcpu = newcpu;
+			spinlock_acquire(&targetcpu->c_runqueue_lock);
+		}
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -464,6 +883,112 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 }
 
+/*
+ * Make a list of woken threads runnable, taking each cpu's run queue
+ * lock once rather than once per thread.
+ *
+ * Threads are taken in groups by t_cpu. If MOVED is not null, each group
+ * goes through thread_wakeup_cpu under its cpu's lock; the ones it
+ * sends elsewhere are moved to MOVED with their new t_cpu, for
+ * the caller to pass back in (with MOVED null) once the first pass
+ * is done. The caller has already charged the threads' sleep time.
+ *
+ * Idle cpus that were given threads aren't sent IPI_UNIDLE here;
+ * their bits (by c_number) are set in *UNIDLE, so that the caller can
+ * send each of them one IPI after both passes with thread_unidle.
+ */
+static
+void
+thread_make_runnable_batch(struct threadlist *list, struct threadlist *moved,
+			   uint32_t *unidle)
+{
+	struct threadlist rest;
+	struct thread *target;
+	struct cpu *targetcpu, *newcpu;
+	unsigned added;
+	bool isidle;
+
+	threadlist_init(&rest);
+
+	while ((target = threadlist_remhead(list)) != NULL) {
+		targetcpu = target->t_cpu;
+		threadlist_addhead(list, target);
+
+		spinlock_acquire(&targetcpu->c_runqueue_lock);
+		isidle = targetcpu->c_isidle;
+		added = 0;
+		while ((target = threadlist_remhead(list)) != NULL) {
+			if (target->t_cpu != targetcpu) {
+				threadlist_addtail(&rest, target);
+				continue;
+			}
+			if (moved != NULL) {
+				newcpu = thread_wakeup_cpu(target, targetcpu);
+				if (newcpu != targetcpu) {
+					target->t_cpu = newcpu;
+					target->t_migrations++;
+					curcpu->c_wakemoves++;
+					threadlist_addtail(moved, target);
+					continue;
+				}
+			}
+			runqueue_add(targetcpu, target);
+			added++;
+		}
+		if (isidle && added > 0) {
+			*unidle |= 1U << targetcpu->c_number;
+		}
+		spinlock_release(&targetcpu->c_runqueue_lock);
+
+		/* Go around again with what's left. */
+		while ((target = threadlist_remhead(&rest)) != NULL) {
+			threadlist_addtail(list, target);
+		}
+	}
+
+	threadlist_cleanup(&rest);
+}
+
+/*
+ * Send IPI_UNIDLE to each cpu in the mask from
+ * thread_make_runnable_batch. If one has already woken up by now, the
+ * IPI is harmless.
+ */
+static
+void
+thread_unidle(uint32_t unidle)
+{
+	struct cpu *c;
+	unsigned i;
+
+	COMPILE_ASSERT(MAXCPUS <= 32);
+
+	for (i=0; unidle != 0; i++, unidle >>= 1) {
+		if (unidle & 1) {
+			c = cpuarray_get(&allcpus, i);
+			KASSERT(c->c_number == i);
+			ipi_send(c, IPI_UNIDLE);
+		}
+	}
+}
+
+/*
+ * Account for a thread_fork that started at time START.
+ */
+static
+void
+thread_forkstats(uint64_t start)
+{
+	uint64_t now;
+	int spl;
+
+	now = gettime_ns();
+	spl = splhigh();
+	curcpu->c_forks++;
+	curcpu->c_forktime += now > start ? now - start : 0;
+	splx(spl);
+}
+
 /*
  * Create a new thread based on an existing one.
  *
@@ -472,7 +997,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
  *
  * The new thread is created in the process P. If P is null, the
  * process is inherited from the caller. It will start on the same CPU
- * as the caller, unless the scheduler intervenes first.
+ * as the caller if that cpu isn't too busy; see thread_wakeup_cpu.
  */
 int
 thread_fork(const char *name,
@@ -481,24 +1006,29 @@ thread_fork(const char *name,
 	    void *data1, unsigned long data2)
 {
 	struct thread *newthread;
+	uint64_t start;
 	int result;
 
 #ifdef UW
 	DEBUG(DB_THREADS,"Forking thread: %s\n",name);
 #endif // UW
 
+	start = gettime_ns();
+
 	newthread = thread_create(name);
 	if (newthread == NULL) {
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
+	/* Allocate a stack, unless we got a recycled one */
 	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
@@ -528,6 +1058,12 @@ thread_fork(const char *name,
 	/* Set up the switchframe so entrypoint() gets called */
 	switchframe_init(newthread, entrypoint, data1, data2);
 
+	/*
+	 * Charge the time taken to the cpu we're on now (which may not
+	 * be the one we started on; it doesn't much matter).
+	 */
+	thread_forkstats(start);
+
 	/* Lock the current cpu's run queue and make the new thread runnable */
 	thread_make_runnable(newthread, false);
 
@@ -548,6 +1084,8 @@ void
 thread_switch(threadstate_t newstate, struct wchan *wc)
 {
 	struct thread *cur, *next;
+	uint64_t now;
+	bool idled;
 	int spl;
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
@@ -556,6 +1094,13 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Explicitly disable interrupts on this processor */
 	spl = splhigh();
 
+	/*
+	 * Whoever called us isn't in an epoch read section (see
+	 * epoch.h), so this is a quiescent point for this cpu whether
+	 * or not we actually switch.
+	 */
+	curcpu->c_epochgen++;
+
 	cur = curthread;
 
 	/*
@@ -573,13 +1118,29 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
-	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	/*
+	 * Micro-optimization: if nothing to do, just return. When
+	 * yielding, only threads at our own level or above count;
+	 * lower-priority threads wait until we sleep or are demoted.
+	 */
+	if (newstate == S_READY &&
+	    runqueue_toplevel(curcpu) > cur->t_priority) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
 	}
 
+	/*
+	 * Charge the time we've been running. This has to be done
+	 * before we go on a list where we can be woken up.
+	 */
+	now = gettime_ns();
+	if (cur->t_statetime != 0) {
+		cur->t_runtime += thread_elapsed(now, cur->t_statetime);
+	}
+	cur->t_statetime = now;
+	idled = false;
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
@@ -588,6 +1149,15 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		thread_make_runnable(cur, true /*have lock*/);
 		break;
 	    case S_SLEEP:
+		/*
+		 * Giving up the cpu before the slice is used up earns
+		 * a boost, so interactive threads float back up.
+		 */
+		if (cur->t_priority > 0) {
+			cur->t_priority--;
+		}
+		cur->t_ticks = 0;
+
 		cur->t_wchan_name = wc->wc_name;
 		/*
 		 * Add the thread to the list in the wait channel, and
@@ -603,6 +1173,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		 * without racing. Exercise: what's the other?)
 		 */
 		threadlist_addtail(&wc->wc_threads, cur);
+		cur->t_wchan = wc;
 		wchan_unlock(wc);
 		break;
 	    case S_ZOMBIE:
@@ -629,18 +1200,38 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	 * lock to look at it, this should not be visible or matter.
 	 */
 
-	/* The current cpu is now idle. */
+	/*
+	 * Remember when this thread last ran, so thread_steal can tell
+	 * whether it's still cache-warm. This is global time, not this
+	 * cpu's hardclock count, since it's compared on other cpus.
+	 */
+	cur->t_lastrun = now;
+
+	/*
+	 * The current cpu is now idle. If our own run queue is empty,
+	 * try to steal work from another cpu before idling.
+	 */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu);
 		if (next == NULL) {
+			idled = true;
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			next = thread_steal();
+			if (next == NULL) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
 
+	/* Charge next's time on the run queue. */
+	if (idled) {
+		now = gettime_ns();
+	}
+	thread_switchin(next, now);
+
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
 	 * curthread and it may not be, depending on how curthread and
@@ -802,6 +1393,13 @@ thread_exit(void)
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
+	DEBUG(DB_THREADS, "Thread %s: %u migrations, %u wakeups, "
+	      "%llu us total wakeup latency\n", cur->t_name,
+	      cur->t_migrations, cur->t_wakeups, cur->t_wakelat / 1000);
+	DEBUG(DB_THREADS, "Thread %s: ran %llu us, waited %llu us, "
+	      "slept %llu us\n", cur->t_name, cur->t_runtime / 1000,
+	      cur->t_readytime / 1000, cur->t_sleeptime / 1000);
+
 	/* Interrupts off on this processor */
         splhigh();
 	thread_switch(S_ZOMBIE, NULL);
@@ -822,139 +1420,396 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multi-level feedback queue. Each cpu has NPRIORITIES run
+ * queues and always runs the first thread at the highest nonempty
+ * level; within a level, threads go round-robin because hardclock
+ * yields on every tick. Priorities move as follows:
+ *
+ *    - New threads start at level 0, the top.
+ *    - A thread that runs for SCHEDULE_HARDCLOCKS ticks at one level
+ *      without sleeping is a cpu hog and is demoted one level. This
+ *      is checked here, which hardclock() calls every
+ *      SCHEDULE_HARDCLOCKS ticks; hardclock charges the ticks.
+ *    - A thread that goes to sleep moves up one level (see
+ *      thread_switch), so threads that mostly wait for I/O, like the
+ *      shell, stay near the top.
+ *    - Every PRIORITY_RESET_HARDCLOCKS ticks everything runnable on
+ *      this cpu goes back to level 0, so hogs at the bottom can't be
+ *      starved forever by a stream of interactive threads.
  */
 
+#define PRIORITY_RESET_HARDCLOCKS  (SCHEDULE_HARDCLOCKS * 25)
+
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct thread *cur, *t;
+	unsigned i;
+
+	cur = curthread;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+
+	if (!curcpu->c_isidle && cur->t_ticks >= SCHEDULE_HARDCLOCKS) {
+		if (cur->t_priority < NPRIORITIES - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+	}
+
+	if ((curcpu->c_hardclocks % PRIORITY_RESET_HARDCLOCKS) == 0) {
+		for (i=1; i<NPRIORITIES; i++) {
+			while ((t = threadlist_remhead(&curcpu->c_runqueue[i]))
+			       != NULL) {
+				t->t_priority = 0;
+				t->t_ticks = 0;
+				threadlist_addtail(&curcpu->c_runqueue[0], t);
+			}
+		}
+		cur->t_priority = 0;
+		cur->t_ticks = 0;
+	}
+
+	spinlock_release(&curcpu->c_runqueue_lock);
 }
 
 /*
- * Thread migration.
+ * Work stealing.
+ *
+ * Rather than having busy cpus periodically push threads elsewhere,
+ * a cpu that runs out of work pulls some from whichever cpu has the
+ * most queued, just before going idle (see thread_switch). That way
+ * an idle cpu picks up work right away instead of waiting for the
+ * next migration tick, and nobody has to lock every run queue just
+ * to count threads.
  *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * The victim is chosen by peeking at the c_runcount of each cpu
+ * without locking; if the guess is stale we just find nothing. We
+ * take the thread that would run last on the victim (lowest level,
+ * end of the queue) but pass over any that ran within the last
+ * STEAL_COLD_NS, since their cache footprint is probably still
+ * there. That's a few hardclock ticks: less, and nearly everything
+ * would count as cold, since a queued thread has usually waited at
+ * least a tick.
  *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
+ * We also never take the victim's c_curthread. Ordinarily it isn't
+ * on the run queue, but it can be: if it went to sleep, the cpu went
+ * idle (so it remained curthread and the idle loop is still running
+ * on its stack), and then it was woken up before the cpu has fully
+ * unidled. Running it here at the same time would be fatal.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * Called with interrupts off and without holding any run queue lock,
+ * so two cpus stealing from each other can't deadlock.
  */
-void
-thread_consider_migration(void)
+
+#define STEAL_COLD_NS  (3 * (1000000000ULL / HZ))
+
+static
+struct thread *
+thread_steal(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
+	struct cpu *c, *victim;
 	struct thread *t;
+	struct threadlistnode *tln;
+	unsigned i, numcpus, most, level;
+	uint64_t now;
+
+	KASSERT(curthread->t_curspl > 0);
 
-	my_count = total_count = 0;
+	victim = NULL;
+	most = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			continue;
+		}
+		if (c->c_runcount > most) {
+			most = c->c_runcount;
+			victim = c;
 		}
-		spinlock_release(&c->c_runqueue_lock);
+	}
+	if (victim == NULL) {
+		return NULL;
 	}
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
+	t = NULL;
+	now = gettime_ns();
+	spinlock_acquire(&victim->c_runqueue_lock);
+	for (level = NPRIORITIES; level-- > 0 && t == NULL; ) {
+		for (tln = victim->c_runqueue[level].tl_tail.tln_prev;
+		     tln->tln_prev != NULL;
+		     tln = tln->tln_prev) {
+			t = tln->tln_self;
+			if (t != victim->c_curthread &&
+			    now >= t->t_lastrun + STEAL_COLD_NS) {
+				threadlist_remove(&victim->c_runqueue[level],
+						  t);
+				victim->c_runcount--;
+				break;
+			}
+			t = NULL;
+		}
 	}
+	spinlock_release(&victim->c_runqueue_lock);
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	if (t == NULL) {
+		curcpu->c_stealmisses++;
+		return NULL;
 	}
-	spinlock_release(&curcpu->c_runqueue_lock);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+	      t->t_name, victim->c_number, curcpu->c_number);
+	t->t_cpu = curcpu->c_self;
+	t->t_migrations++;
+	curcpu->c_steals++;
+	return t;
+}
+
+/*
+ * Wait until every cpu has passed through a quiescent state (see
+ * epoch.h) since we were called: that is, has been through
+ * thread_switch, or is idle. Our own cpu counts as soon as we check
+ * it, since we're running on it and not in a read section ourselves.
+ *
+ * The other cpus' counters and idle flags are read without locking.
+ * Each cpu's counter is sampled when we get to it, which can only be
+ * later than when we were called, so waiting for the cpus one at a
+ * time is good enough. Busy cpus get there at their next hardclock,
+ * which yields, at the latest; so we nap a tick at a time.
+ */
+void
+thread_waitquiescent(void)
+{
+	struct cpu *c;
+	unsigned i, gen;
+
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
 		c = cpuarray_get(&allcpus, i);
 		if (c == curcpu->c_self) {
 			continue;
 		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
+		gen = c->c_epochgen;
+		while (c->c_epochgen == gen && !c->c_isidle) {
+			clocknap(1);
+		}
+	}
+}
 
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+/*
+ * Print scheduler statistics for each cpu. Wakeup latencies are in
+ * microseconds and are charged to the cpu the thread ran on. The
+ * second table covers thread_fork and the thread pool.
+ */
+void
+thread_printstats(void)
+{
+	struct cpu *c;
+	unsigned i, numcpus, clocks, idle, wakeups;
+	unsigned forks, hits, lookups;
+
+	kprintf("cpu   hardclocks      idle  idle%%     steals  misses"
+		"   moves  wakeups  avglat  maxlat\n");
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		/* read without locking; only approximate for other cpus */
+		clocks = c->c_hardclocks;
+		idle = c->c_idleclocks;
+		wakeups = c->c_wakeups;
+		kprintf("%3u %12u %9u  %4u%% %10u %7u %7u %8u %7llu %7llu\n",
+			c->c_number, clocks, idle,
+			clocks ? (100 * idle) / clocks : 0,
+			c->c_steals, c->c_stealmisses, c->c_wakemoves,
+			wakeups,
+			wakeups ? c->c_wakelat / wakeups / 1000 : 0ULL,
+			c->c_wakelatmax / 1000);
+	}
+
+	kprintf("cpu      forks  avgfork  poolhits  poolmisses  hit%%  pooled\n");
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		forks = c->c_forks;
+		hits = c->c_poolhits;
+		lookups = hits + c->c_poolmisses;
+		kprintf("%3u %10u %6llu us %9u %11u  %3u%% %7u\n",
+			c->c_number, forks,
+			forks ? c->c_forktime / forks / 1000 : 0ULL,
+			hits, c->c_poolmisses,
+			lookups ? (100 * hits) / lookups : 0,
+			c->c_threadpool.tl_count);
+	}
+}
+
+/*
+ * Add up the per-cpu statistics. Like thread_printstats, this reads
+ * the other cpus' counters without locking.
+ */
+void
+thread_getstats(struct threadstats *ts)
+{
+	struct cpu *c;
+	unsigned i;
+
+	ts->ts_ncpus = cpuarray_num(&allcpus);
+	ts->ts_steals = 0;
+	ts->ts_poolhits = 0;
+	ts->ts_poolmax = 0;
+	for (i=0; i<ts->ts_ncpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		ts->ts_steals += c->c_steals;
+		ts->ts_poolhits += c->c_poolhits;
+		if (c->c_threadpool.tl_count > ts->ts_poolmax) {
+			ts->ts_poolmax = c->c_threadpool.tl_count;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
+}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+/*
+ * Per-thread times for thread_printtimes, copied out so that we don't
+ * print with allthreads_lock held.
+ */
+struct threadtimes {
+	char tt_name[16];
+	threadstate_t tt_state;
+	unsigned tt_cpu;
+	unsigned tt_priority;
+	unsigned tt_wakeups;
+	unsigned tt_migrations;
+	uint64_t tt_run;
+	uint64_t tt_ready;
+	uint64_t tt_sleep;
+};
+
+static
+unsigned
+thread_gettimes(struct threadtimes *tts, unsigned max, uint64_t now)
+{
+	struct thread *t;
+	struct threadtimes *tt;
+	uint64_t cur;
+	unsigned n;
+
+	n = 0;
+	spinlock_acquire(&allthreads_lock);
+	for (t = allthreads; t != NULL && n < max; t = t->t_allnext) {
+		tt = &tts[n++];
+		/* read without locking; only approximate */
+		snprintf(tt->tt_name, sizeof(tt->tt_name), "%s", t->t_name);
+		tt->tt_state = t->t_state;
+		tt->tt_cpu = t->t_cpu != NULL ? t->t_cpu->c_number : 0;
+		tt->tt_priority = t->t_priority;
+		tt->tt_wakeups = t->t_wakeups;
+		tt->tt_migrations = t->t_migrations;
+		tt->tt_run = t->t_runtime;
+		tt->tt_ready = t->t_readytime;
+		tt->tt_sleep = t->t_sleeptime;
+
+		/* Include the time in the current state. */
+		cur = t->t_statetime ? thread_elapsed(now, t->t_statetime) : 0;
+		switch (t->t_state) {
+		    case S_RUN: tt->tt_run += cur; break;
+		    case S_READY: tt->tt_ready += cur; break;
+		    case S_SLEEP: tt->tt_sleep += cur; break;
+		    case S_ZOMBIE: break;
 		}
-		spinlock_release(&curcpu->c_runqueue_lock);
 	}
+	spinlock_release(&allthreads_lock);
+	return n;
+}
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+/*
+ * Print the run, run queue, and sleep times of every thread, and the
+ * system-wide run queue wait histogram. Times are in milliseconds,
+ * except the histogram, which is in microseconds.
+ */
+void
+thread_printtimes(void)
+{
+	static const char *statenames[] = {
+		"run", "ready", "sleep", "zombie"
+	};
+	struct threadtimes *tts;
+	struct thread *t;
+	struct cpu *c;
+	unsigned i, j, n, max, numcpus, total, count;
+	unsigned hist[RQWAIT_BUCKETS];
+
+	/* Size the buffer with some room for threads forked meanwhile. */
+	spinlock_acquire(&allthreads_lock);
+	max = 16;
+	for (t = allthreads; t != NULL; t = t->t_allnext) {
+		max++;
+	}
+	spinlock_release(&allthreads_lock);
+
+	tts = kmalloc(max * sizeof(*tts));
+	if (tts == NULL) {
+		kprintf("thread_printtimes: Out of memory\n");
+		return;
+	}
+	n = thread_gettimes(tts, max, gettime_ns());
+
+	kprintf("%-15s %-6s cpu pri %10s %10s %10s %7s %5s\n",
+		"thread", "state", "run ms", "wait ms", "sleep ms",
+		"wakeups", "migr");
+	for (i=0; i<n; i++) {
+		kprintf("%-15s %-6s %3u %3u %10llu %10llu %10llu %7u %5u\n",
+			tts[i].tt_name, statenames[tts[i].tt_state],
+			tts[i].tt_cpu, tts[i].tt_priority,
+			tts[i].tt_run / 1000000, tts[i].tt_ready / 1000000,
+			tts[i].tt_sleep / 1000000,
+			tts[i].tt_wakeups, tts[i].tt_migrations);
+	}
+	kfree(tts);
+
+	total = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (j=0; j<RQWAIT_BUCKETS; j++) {
+		hist[j] = 0;
+		for (i=0; i<numcpus; i++) {
+			c = cpuarray_get(&allcpus, i);
+			hist[j] += c->c_rqwait[j];
+		}
+		total += hist[j];
+	}
+
+	kprintf("\nrun queue wait   count      %%\n");
+	for (j=0; j<RQWAIT_BUCKETS; j++) {
+		count = hist[j];
+		if (j < RQWAIT_BUCKETS - 1) {
+			kprintf("  < %8u us", 2U << j);
+		}
+		else {
+			kprintf("  >=%8u us", 1U << j);
+		}
+		kprintf(" %9u %5u%%\n", count,
+			total ? (100 * count) / total : 0);
+	}
+}
+
+/*
+ * Print how lock_acquire calls got the lock, summed over all cpus:
+ * right away, after spinning, or after sleeping (possibly having spun
+ * first).
+ */
+void
+lock_printstats(void)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+	unsigned long long nfree, nspin, nblock;
+
+	nfree = nspin = nblock = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		nfree += c->c_lockfree;
+		nspin += c->c_lockspins;
+		nblock += c->c_lockblocks;
+	}
+	kprintf("lock_acquire: %llu free, %llu after spinning, "
+		"%llu after sleeping\n", nfree, nspin, nblock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -963,6 +1818,44 @@ thread_consider_migration(void)
  * Wait channel functions
  */
 
+/*
+ * Constructor and destructor for wchan_cache.
+ */
+static
+int
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_init(&wc->wc_lock);
+	threadlist_init(&wc->wc_threads);
+	return 0;
+}
+
+static
+void
+wchan_dtor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_cleanup(&wc->wc_lock);
+	threadlist_cleanup(&wc->wc_threads);
+}
+
+/*
+ * Set up the wait channel cache. This needs to happen before anything
+ * creates a wait channel, including proc_bootstrap.
+ */
+void
+wchan_bootstrap(void)
+{
+	wchan_cache = objcache_create("wchan", sizeof(struct wchan),
+				      wchan_ctor, wchan_dtor);
+	if (wchan_cache == NULL) {
+		panic("wchan_bootstrap: Out of memory\n");
+	}
+}
+
 /*
  * Create a wait channel. NAME is a symbolic string name for it.
  * This is what's displayed by ps -alx in Unix.
@@ -976,12 +1869,10 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = objcache_alloc(wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	spinlock_init(&wc->wc_lock);
-	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
 	return wc;
 }
@@ -993,9 +1884,9 @@ wchan_create(const char *name)
 void
 wchan_destroy(struct wchan *wc)
 {
-	spinlock_cleanup(&wc->wc_lock);
-	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	KASSERT(threadlist_isempty(&wc->wc_threads));
+	KASSERT(!spinlock_do_i_hold(&wc->wc_lock));
+	objcache_free(wchan_cache, wc);
 }
 
 /*
@@ -1029,22 +1920,126 @@ wchan_sleep(struct wchan *wc)
 }
 
 /*
- * Wake up one thread sleeping on a wait channel.
+ * State shared between wchan_sleep_deadline and its callout.
  */
+struct wchan_timeout {
+	struct thread *wt_thread;
+	struct wchan *wt_wchan;
+	bool wt_fired;
+};
+
+/*
+ * Callout function for wchan_sleep_deadline: if the thread is still
+ * asleep on the channel, take it off and wake it up. Whoever removes
+ * the thread from the channel's list (here or in wchan_wake*) does
+ * so with the channel locked, so exactly one of us wakes it.
+ */
+static
 void
-wchan_wakeone(struct wchan *wc)
+wchan_timeout(void *data)
 {
-	struct thread *target;
+	struct wchan_timeout *wt = data;
+	struct thread *target = wt->wt_thread;
+	struct wchan *wc = wt->wt_wchan;
 
-	/* Lock the channel and grab a thread from it */
 	spinlock_acquire(&wc->wc_lock);
-	target = threadlist_remhead(&wc->wc_threads);
+	if (target->t_wchan != wc) {
+		/* Already woken up. */
+		spinlock_release(&wc->wc_lock);
+		return;
+	}
+	threadlist_remove(&wc->wc_threads, target);
+	target->t_wchan = NULL;
+	wt->wt_fired = true;
+	spinlock_release(&wc->wc_lock);
+
+	thread_make_runnable(target, false);
+}
+
+/*
+ * Like wchan_sleep, but give up once callout tick DEADLINE has
+ * passed. Returns 0 if woken up by wchan_wake*, or ETIMEDOUT if the
+ * deadline came first (including if it had already passed when we
+ * were called). Either way the channel is unlocked on return.
+ *
+ * The callout and the state it uses are on our stack; this is safe
+ * because callout_stop waits for the callout if it's running.
+ */
+int
+wchan_sleep_deadline(struct wchan *wc, uint32_t deadline)
+{
+	struct wchan_timeout wt;
+	struct callout co;
+
+	/* may not sleep in an interrupt handler */
+	KASSERT(!curthread->t_in_interrupt);
+	KASSERT(spinlock_do_i_hold(&wc->wc_lock));
+
+	if (callout_expired(deadline)) {
+		wchan_unlock(wc);
+		return ETIMEDOUT;
+	}
+
+	wt.wt_thread = curthread;
+	wt.wt_wchan = wc;
+	wt.wt_fired = false;
+	callout_init(&co, wchan_timeout, &wt);
+
 	/*
-	 * Nobody else can wake up this thread now, so we don't need
-	 * to hang onto the lock.
+	 * The callout can't take the thread off the channel before it
+	 * gets on, because we hold the channel lock until thread_switch
+	 * has put it there.
 	 */
+	callout_schedule_at(&co, deadline);
+	thread_switch(S_SLEEP, wc);
+	callout_stop(&co);
+
+	return wt.wt_fired ? ETIMEDOUT : 0;
+}
+
+/*
+ * Take the first thread off a wait channel without waking it up.
+ */
+struct thread *
+wchan_takeone(struct wchan *wc)
+{
+	struct thread *target;
+
+	spinlock_acquire(&wc->wc_lock);
+	target = threadlist_remhead(&wc->wc_threads);
+	if (target != NULL) {
+		target->t_wchan = NULL;
+	}
 	spinlock_release(&wc->wc_lock);
 
+	return target;
+}
+
+/*
+ * Wake up a thread taken off its channel with wchan_takeone.
+ */
+void
+wchan_wakethread(struct thread *target)
+{
+	KASSERT(target->t_state == S_SLEEP);
+	KASSERT(target->t_wchan == NULL);
+
+	thread_make_runnable(target, false);
+}
+
+/*
+ * Wake up one thread sleeping on a wait channel.
+ */
+void
+wchan_wakeone(struct wchan *wc)
+{
+	struct thread *target;
+
+	/*
+	 * Once it's off the channel nobody else can wake up this
+	 * thread, so the channel needn't stay locked.
+	 */
+	target = wchan_takeone(wc);
 	if (target == NULL) {
 		/* Nobody was sleeping. */
 		return;
@@ -1053,6 +2048,37 @@ wchan_wakeone(struct wchan *wc)
 	thread_make_runnable(target, false);
 }
 
+/*
+ * Move the first thread, or all threads, sleeping on FROM to the end
+ * of TO, leaving them asleep. Locks FROM before TO, so nothing may
+ * lock them the other way around.
+ */
+void
+wchan_move(struct wchan *from, struct wchan *to, bool all)
+{
+	struct thread *target;
+
+	KASSERT(from != to);
+
+	spinlock_acquire(&from->wc_lock);
+	if (threadlist_isempty(&from->wc_threads)) {
+		spinlock_release(&from->wc_lock);
+		return;
+	}
+	spinlock_acquire(&to->wc_lock);
+	do {
+		target = threadlist_remhead(&from->wc_threads);
+		if (target == NULL) {
+			break;
+		}
+		target->t_wchan = to;
+		target->t_wchan_name = to->wc_name;
+		threadlist_addtail(&to->wc_threads, target);
+	} while (all);
+	spinlock_release(&to->wc_lock);
+	spinlock_release(&from->wc_lock);
+}
+
 /*
  * Wake up all threads sleeping on a wait channel.
  */
@@ -1060,16 +2086,23 @@ void
 wchan_wakeall(struct wchan *wc)
 {
 	struct thread *target;
-	struct threadlist list;
+	struct threadlist list, moved;
+	uint32_t unidle;
+	uint64_t now;
 
 	threadlist_init(&list);
+	threadlist_init(&moved);
 
 	/*
 	 * Lock the channel and grab all the threads, moving them to a
-	 * private list.
+	 * private list. Their sleep time is charged against a single
+	 * clock reading.
 	 */
+	now = gettime_ns();
 	spinlock_acquire(&wc->wc_lock);
 	while ((target = threadlist_remhead(&wc->wc_threads)) != NULL) {
+		target->t_wchan = NULL;
+		thread_wakecharge(target, now);
 		threadlist_addtail(&list, target);
 	}
 	/*
@@ -1079,14 +2112,16 @@ wchan_wakeall(struct wchan *wc)
 	spinlock_release(&wc->wc_lock);
 
 	/*
-	 * We could conceivably sort by cpu first to cause fewer lock
-	 * ops and fewer IPIs, but for now at least don't bother. Just
-	 * make each thread runnable.
+	 * Queue the threads a cpu at a time, placing them in the first
+	 * pass and queueing the ones that moved in a second. Then kick
+	 * the idle cpus that got any, once each.
 	 */
-	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
-	}
+	unidle = 0;
+	thread_make_runnable_batch(&list, &moved, &unidle);
+	thread_make_runnable_batch(&moved, NULL, &unidle);
+	thread_unidle(unidle);
 
+	threadlist_cleanup(&moved);
 	threadlist_cleanup(&list);
 }
 
@@ -43,6 +43,7 @@
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <epoch.h>
 
 /*
  * Structure for a single named device.
@@ -85,7 +86,17 @@ struct knowndev {
 DECLARRAY(knowndev);
 DEFARRAY(knowndev, /*no inline*/);
 
-static struct knowndevarray *knowndevs;
+/*
+ * The device table. Changes are made under the big lock, by building
+ * a new array and switching knowndevs to it; the old array is freed
+ * through the epoch code (see epoch.h), so code that only needs to
+ * look things up can do so in an epoch read section instead of taking
+ * the big lock. Entries are never removed, so a struct knowndev found
+ * that way stays valid after the read section ends; but fields that
+ * mount and unmount change, namely kd_fs, are only stable under the
+ * big lock.
+ */
+static struct knowndevarray *volatile knowndevs;
 
 /* The big lock for all FS ops. Remove for filesystem assignment. */
 static struct lock *vfs_biglock;
@@ -259,13 +270,20 @@ vfs_getdevname(struct fs *fs)
 	struct knowndev *kd;
 	unsigned i, num;
 
-	KASSERT(fs != NULL);
+	struct knowndevarray *kds;
+	const char *name = NULL;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(fs != NULL);
 
-	num = knowndevarray_num(knowndevs);
+	/*
+	 * This only compares kd_fs, without using it, so it doesn't
+	 * need the big lock.
+	 */
+	epoch_enter();
+	kds = knowndevs;
+	num = knowndevarray_num(kds);
 	for (i=0; i<num; i++) {
-		kd = knowndevarray_get(knowndevs, i);
+		kd = knowndevarray_get(kds, i);
 
 		if (kd->kd_fs == fs) {
 			/*
@@ -274,11 +292,13 @@ vfs_getdevname(struct fs *fs)
 			 * the fs cannot go away, and the device can't
 			 * go away until the fs goes away.
 			 */
-			return kd->kd_name;
+			name = kd->kd_name;
+			break;
 		}
 	}
+	epoch_exit();
 
-	return NULL;
+	return name;
 }
 
 /*
@@ -360,6 +380,20 @@ badnames(const char *n1, const char *n2, const char *n3)
 	return 0;
 }
 
+/*
+ * Free a replaced device table, once nobody can be looking at it.
+ * The entries themselves live on in the new one.
+ */
+static
+void
+knowndevs_free(void *data)
+{
+	struct knowndevarray *kds = data;
+
+	knowndevarray_setsize(kds, 0);
+	knowndevarray_destroy(kds);
+}
+
 /*
  * Add a new device to the VFS layer's device table.
  *
@@ -374,9 +408,9 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	char *name=NULL, *rawname=NULL;
 	struct knowndev *kd=NULL;
 	struct vnode *vnode=NULL;
+	struct knowndevarray *oldkds, *newkds=NULL;
 	const char *volname=NULL;
-	unsigned index;
-	int result;
+	unsigned i, index;
 
 	vfs_biglock_acquire();
 
@@ -416,15 +450,30 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		return EEXIST;
 	}
 
-	result = knowndevarray_add(knowndevs, kd, &index);
+	/* Publish a copy of the table with the new entry on the end. */
+	oldkds = knowndevs;
+	index = knowndevarray_num(oldkds);
+	newkds = knowndevarray_create();
+	if (newkds==NULL) {
+		goto nomem;
+	}
+	if (knowndevarray_setsize(newkds, index+1)) {
+		goto nomem;
+	}
+	for (i=0; i<index; i++) {
+		knowndevarray_set(newkds, i, knowndevarray_get(oldkds, i));
+	}
+	knowndevarray_set(newkds, index, kd);
+	knowndevs = newkds;
+	epoch_defer(knowndevs_free, oldkds);
 
-	if (result == 0 && dev != NULL) {
+	if (dev != NULL) {
 		/* use index+1 as the device number, so 0 is reserved */
 		dev->d_devnumber = index+1;
 	}
 
 	vfs_biglock_release();
-	return result;
+	return 0;
 
  nomem:
 
@@ -440,6 +489,10 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	if (kd) {
 		kfree(kd);
 	}
+	if (newkds) {
+		knowndevarray_setsize(newkds, 0);
+		knowndevarray_destroy(newkds);
+	}
 	
 	vfs_biglock_release();
 	return ENOMEM;
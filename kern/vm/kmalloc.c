@@ -29,8 +29,15 @@
 
 #include <types.h>
 #include <lib.h>
+#include <cpu.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <mcslock.h>
+#include <pcpuctr.h>
+#include <current.h>
 #include <vm.h>
+#include <platform/maxcpus.h>
+#include "opt-kmprof.h"
 
 /*
  * Kernel malloc.
@@ -75,6 +82,10 @@ fill_deadbeef(void *vptr, size_t len)
 //    cannot recursively use the subpage allocator. (We could probably
 //    make that work, but it would be painful.)
 //
+//    In front of the page lists sits a per-cpu cache of free blocks
+//    for each size (see "Per-cpu magazines" below), so that most
+//    kmalloc and kfree calls never touch kmalloc_spinlock at all.
+//
 
 #undef  SLOW	/* consistency checks */
 #undef SLOWER	/* lots of consistency checks */
@@ -118,67 +129,180 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
+ * Pagerefs are kept in chunks of one page each, gotten from
+ * alloc_kpages as the heap grows. A chunk starts with a small header
+ * holding a bitmap of which of its pagerefs are in use; since the
+ * chunk is a whole page, the chunk a pageref belongs to is found by
+ * masking its address.
  *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
+ * Chunks with at least one free pageref are kept on prchunks_avail,
+ * so allocpageref only ever looks at the first chunk on that list
+ * and the cost of getting a pageref doesn't depend on how many
+ * chunks there are. A chunk that becomes entirely unused is handed
+ * back to the caller of freepageref to release, unless it's the only
+ * chunk with room in it.
  *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * Both functions are called with kmalloc_spinlock held. Because
+ * alloc_kpages can't be called with the lock held, allocpageref
+ * doesn't grow the chunk list itself; subpage_getblocks gets a page
+ * ahead of time and passes it to prchunk_add.
  */
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+#define PRCHUNK_WORDS ((PAGE_SIZE / sizeof(struct pageref) + 31) / 32)
+
+struct prchunk {
+	struct prchunk *pc_prev;	/* on prchunks_avail */
+	struct prchunk *pc_next;
+	unsigned pc_nfree;		/* number of free pagerefs */
+	uint32_t pc_inuse[PRCHUNK_WORDS];
+	/* the pagerefs themselves follow */
+};
+
+#define PRCHUNK_NREFS \
+	((PAGE_SIZE - sizeof(struct prchunk)) / sizeof(struct pageref))
+#define PRCHUNK_REFS(pc) ((struct pageref *)((pc) + 1))
+
+static struct prchunk *prchunks_avail;
+static unsigned prchunks_total;		/* chunks allocated */
+static unsigned npagerefs;		/* pagerefs in use */
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+static
+void
+prchunk_link(struct prchunk *pc)
+{
+	pc->pc_prev = NULL;
+	pc->pc_next = prchunks_avail;
+	if (prchunks_avail != NULL) {
+		prchunks_avail->pc_prev = pc;
+	}
+	prchunks_avail = pc;
+}
+
+static
+void
+prchunk_unlink(struct prchunk *pc)
+{
+	if (pc->pc_prev != NULL) {
+		pc->pc_prev->pc_next = pc->pc_next;
+	}
+	else {
+		KASSERT(prchunks_avail == pc);
+		prchunks_avail = pc->pc_next;
+	}
+	if (pc->pc_next != NULL) {
+		pc->pc_next->pc_prev = pc->pc_prev;
+	}
+	pc->pc_prev = pc->pc_next = NULL;
+}
+
+/*
+ * Add a fresh page to the pageref pool.
+ */
+static
+void
+prchunk_add(vaddr_t page)
+{
+	struct prchunk *pc;
+	unsigned i;
+
+	KASSERT(page % PAGE_SIZE == 0);
+	COMPILE_ASSERT(PRCHUNK_NREFS > 0);
+	COMPILE_ASSERT(PRCHUNK_NREFS <= PRCHUNK_WORDS * 32);
+
+	pc = (struct prchunk *)page;
+	pc->pc_nfree = PRCHUNK_NREFS;
+
+	/* Mark the bits past the end of the chunk as permanently in use. */
+	for (i=0; i<PRCHUNK_WORDS; i++) {
+		if ((i+1)*32 <= PRCHUNK_NREFS) {
+			pc->pc_inuse[i] = 0;
+		}
+		else if (i*32 >= PRCHUNK_NREFS) {
+			pc->pc_inuse[i] = 0xffffffff;
+		}
+		else {
+			pc->pc_inuse[i] =
+				~(((uint32_t)1 << (PRCHUNK_NREFS % 32)) - 1);
+		}
+	}
+
+	prchunk_link(pc);
+	prchunks_total++;
+}
 
 static
 struct pageref *
 allocpageref(void)
 {
+	struct prchunk *pc;
 	unsigned i,j;
 	uint32_t k;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
+	pc = prchunks_avail;
+	if (pc == NULL) {
+		/* need another chunk */
+		return NULL;
+	}
+	KASSERT(pc->pc_nfree > 0);
+
+	for (i=0; i<PRCHUNK_WORDS; i++) {
+		if (pc->pc_inuse[i]==0xffffffff) {
 			/* full */
 			continue;
 		}
 		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
+			if ((pc->pc_inuse[i] & k)==0) {
+				pc->pc_inuse[i] |= k;
+				pc->pc_nfree--;
+				if (pc->pc_nfree == 0) {
+					prchunk_unlink(pc);
+				}
+				npagerefs++;
+				return &PRCHUNK_REFS(pc)[i*32 + j];
 			}
 		}
 		KASSERT(0);
 	}
 
-	/* ran out */
+	/* pc_nfree was wrong */
+	panic("kmalloc: pageref chunk %p has no free entries\n", pc);
 	return NULL;
 }
 
+/*
+ * Release a pageref. If this leaves its chunk unused and there's
+ * another chunk with room, return the chunk so the caller can give
+ * the page back once it has dropped the lock; otherwise return NULL.
+ */
 static
-void
+struct prchunk *
 freepageref(struct pageref *p)
 {
+	struct prchunk *pc;
 	size_t i, j;
 	uint32_t k;
 
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
+	pc = (struct prchunk *)((vaddr_t)p & PAGE_FRAME);
+	j = p - PRCHUNK_REFS(pc);
+	KASSERT(j < PRCHUNK_NREFS);  /* note: j is unsigned, don't test < 0 */
 	i = j/32;
 	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	KASSERT((pc->pc_inuse[i] & k) != 0);
+	pc->pc_inuse[i] &= ~k;
+	npagerefs--;
+
+	pc->pc_nfree++;
+	if (pc->pc_nfree == 1) {
+		/* was full */
+		prchunk_link(pc);
+	}
+	if (pc->pc_nfree == PRCHUNK_NREFS &&
+	    (pc->pc_prev != NULL || pc->pc_next != NULL)) {
+		prchunk_unlink(pc);
+		prchunks_total--;
+		return pc;
+	}
+	return NULL;
 }
 
 ////////////////////////////////////////
@@ -189,13 +313,116 @@ static struct pageref *allbase;
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * One spinlock protects the page lists and the pagerefs. The common
+ * case of kmalloc and kfree is handled by the per-cpu magazines below
+ * and does not take it; it is only needed to move blocks between the
+ * magazines and the pages, and that is done a magazine at a time.
+ * When every cpu is refilling at once it's still the most contended
+ * spinlock in the system, so it's an MCS lock.
  */
 
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+static struct mcslock kmalloc_spinlock = MCSLOCK_INITIALIZER;
+
+/*
+ * Counters for the shared locks, reported by kheap_printstats. A lock
+ * counts as contended if its lock word was already set when we went
+ * to get it. These are only updated while holding the lock in
+ * question.
+ */
+struct kmlockstats {
+	unsigned ls_acquires;
+	unsigned ls_contended;
+};
+
+static struct kmlockstats kmalloc_lockstats;
+
+static
+void
+kmalloc_lock(struct spinlock *lk, struct kmlockstats *ls)
+{
+	bool busy;
+
+	busy = spinlock_is_busy(lk);
+	spinlock_acquire(lk);
+	ls->ls_acquires++;
+	if (busy) {
+		ls->ls_contended++;
+	}
+}
+
+/*
+ * The same for kmalloc_spinlock, which is an MCS lock (see mcslock.h)
+ * since it's the one lock every cpu's magazines go back to. NODE is
+ * the caller's queue node, to be passed to mcslock_release as well.
+ */
+static
+void
+kmalloc_biglock(struct mcsnode *node)
+{
+	bool busy;
+
+	busy = mcslock_is_busy(&kmalloc_spinlock);
+	mcslock_acquire(&kmalloc_spinlock, node);
+	kmalloc_lockstats.ls_acquires++;
+	if (busy) {
+		kmalloc_lockstats.ls_contended++;
+	}
+}
+
+////////////////////////////////////////
+//
+// Page directory.
+//
+//    kfree needs to find the pageref (and thus the block size) for an
+//    arbitrary pointer. Walking allbase under kmalloc_spinlock on
+//    every free would put the global lock right back on the fast
+//    path, so instead we keep a two-level table indexed by the
+//    physical page number of each subpage page. The leaves are whole
+//    pages gotten from alloc_kpages and are never released; each one
+//    covers PD_LEAFPAGES pages (4M) of physical memory.
+//
+//    Entries are written under kmalloc_spinlock but read without it.
+//    This is safe because a block being freed belongs to the caller,
+//    so its page, and therefore its pageref, cannot go away
+//    underneath us.
+//
+
+#define PD_LEAFPAGES (PAGE_SIZE / sizeof(struct pageref *))
+#define PD_NLEAVES   ((MIPS_KSEG1 - MIPS_KSEG0) / (PD_LEAFPAGES * PAGE_SIZE))
+
+static struct pageref **pagedir[PD_NLEAVES];
+
+static
+struct pageref *
+pagedir_lookup(vaddr_t addr)
+{
+	struct pageref **leaf;
+	unsigned pn;
+
+	if (addr < MIPS_KSEG0 || addr >= MIPS_KSEG1) {
+		return NULL;
+	}
+	pn = (addr - MIPS_KSEG0) / PAGE_SIZE;
+	leaf = pagedir[pn / PD_LEAFPAGES];
+	if (leaf == NULL) {
+		return NULL;
+	}
+	return leaf[pn % PD_LEAFPAGES];
+}
+
+static
+void
+pagedir_set(vaddr_t pageaddr, struct pageref *pr)
+{
+	unsigned pn;
+
+	KASSERT(mcslock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pageaddr >= MIPS_KSEG0 && pageaddr < MIPS_KSEG1);
+
+	pn = (pageaddr - MIPS_KSEG0) / PAGE_SIZE;
+	KASSERT(pagedir[pn / PD_LEAFPAGES] != NULL);
+	pagedir[pn / PD_LEAFPAGES][pn % PD_LEAFPAGES] = pr;
+}
 
 ////////////////////////////////////////
 
@@ -216,7 +443,7 @@ checksubpage(struct pageref *pr)
 	int blktype;
 	int nfree=0;
 
-	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(mcslock_do_i_hold(&kmalloc_spinlock));
 
 	if (pr->freelist_offset == INVALID_OFFSET) {
 		KASSERT(pr->nfree==0);
@@ -255,23 +482,24 @@ checksubpages(void)
 	int i;
 	unsigned sc=0, ac=0;
 
-	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(mcslock_do_i_hold(&kmalloc_spinlock));
 
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(sc < npagerefs);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(ac < npagerefs);
 		ac++;
 	}
 
 	KASSERT(sc==ac);
+	KASSERT(ac==npagerefs);
 }
 #else
 #define checksubpages() 
@@ -290,7 +518,7 @@ dumpsubpage(struct pageref *pr)
 	uint32_t freemap[PAGE_SIZE / (SMALLEST_SUBPAGE_SIZE*32)];
 
 	checksubpage(pr);
-	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(mcslock_do_i_hold(&kmalloc_spinlock));
 
 	/* clear freemap[] */
 	for (i=0; i<sizeof(freemap)/sizeof(freemap[0]); i++) {
@@ -330,23 +558,6 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
-void
-kheap_printstats(void)
-{
-	struct pageref *pr;
-
-	/* print the whole thing with interrupts off */
-	spinlock_acquire(&kmalloc_spinlock);
-
-	kprintf("Subpage allocator status:\n");
-
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		dumpsubpage(pr);
-	}
-
-	spinlock_release(&kmalloc_spinlock);
-}
-
 ////////////////////////////////////////
 
 static
@@ -392,49 +603,63 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Take up to MAX free blocks of type BLKTYPE off the page freelists in
+ * a single trip through kmalloc_spinlock, and push them onto *CHAIN.
+ * If no page of that size has anything free, get a fresh page.
+ *
+ * Returns the number of blocks taken. This is 0 only if we're out of
+ * memory.
+ */
 static
-void *
-subpage_kmalloc(size_t sz)
+unsigned
+subpage_getblocks(unsigned blktype, struct freelist **chain, unsigned max)
 {
-	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
 	struct freelist *volatile fl;	// free list entry
-	void *retptr;		// our result
+	struct freelist *next;	// next free list entry on the page
+	struct pageref **newleaf;	// page directory leaf, if needed
+	vaddr_t newchunk;	// pageref chunk, if needed
+	unsigned pdindex;	// index of the leaf in pagedir[]
+	unsigned n;		// number of blocks taken so far
+	struct mcsnode node;	// our place in line for kmalloc_spinlock
 
 	volatile int i;
 
+	KASSERT(blktype < NSIZES);
+	KASSERT(max > 0);
 
-	blktype = blocktype(sz);
-	sz = sizes[blktype];
+	n = 0;
 
-	spinlock_acquire(&kmalloc_spinlock);
+	kmalloc_biglock(&node);
 
 	checksubpages();
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+ again:
+	for (pr = sizebases[blktype]; pr != NULL && n < max;
+	     pr = pr->next_samesize) {
 
 		/* check for corruption */
 		KASSERT(PR_BLOCKTYPE(pr) == blktype);
 		checksubpage(pr);
 
-		if (pr->nfree > 0) {
-
-		doalloc: /* comes here after getting a whole fresh page */
-
+		prpage = PR_PAGEADDR(pr);
+		while (pr->nfree > 0 && n < max) {
 			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
 			fla = prpage + pr->freelist_offset;
 			fl = (struct freelist *)fla;
 
-			retptr = fl;
-			fl = fl->next;
+			next = fl->next;
+			fl->next = *chain;
+			*chain = fl;
+			n++;
 			pr->nfree--;
 
-			if (fl != NULL) {
+			if (next != NULL) {
 				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
+				fla = (vaddr_t)next;
 				KASSERT(fla - prpage < PAGE_SIZE);
 				pr->freelist_offset = fla - prpage;
 			}
@@ -442,14 +667,15 @@ subpage_kmalloc(size_t sz)
 				KASSERT(pr->nfree == 0);
 				pr->freelist_offset = INVALID_OFFSET;
 			}
-
-			checksubpages();
-
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
 		}
 	}
 
+	if (n > 0) {
+		checksubpages();
+		mcslock_release(&kmalloc_spinlock, &node);
+		return n;
+	}
+
 	/*
 	 * No page of the right size available.
 	 * Make a new one.
@@ -459,22 +685,74 @@ subpage_kmalloc(size_t sz)
 	 * Note that this means things can change behind our back...
 	 */
 
-	spinlock_release(&kmalloc_spinlock);
+	mcslock_release(&kmalloc_spinlock, &node);
 	prpage = alloc_kpages(1);
 	if (prpage==0) {
 		/* Out of memory. */
-		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
-		return NULL;
+		kprintf("kmalloc: Subpage allocator couldn't get a page\n");
+		return 0;
+	}
+
+	/*
+	 * Make sure there's a page directory leaf covering the new
+	 * page, and a pageref to describe it. Peeking at pagedir[] and
+	 * prchunks_avail without the lock is fine; if we lose a race
+	 * to install the leaf or chunk we just give ours back.
+	 */
+	KASSERT(prpage >= MIPS_KSEG0 && prpage < MIPS_KSEG1);
+	pdindex = (prpage - MIPS_KSEG0) / PAGE_SIZE / PD_LEAFPAGES;
+	newleaf = NULL;
+	if (pagedir[pdindex] == NULL) {
+		newleaf = (struct pageref **)alloc_kpages(1);
+		if (newleaf == NULL) {
+			free_kpages(prpage);
+			kprintf("kmalloc: Subpage allocator couldn't get "
+				"a page directory leaf\n");
+			return 0;
+		}
+		bzero(newleaf, PAGE_SIZE);
+	}
+	newchunk = 0;
+	if (prchunks_avail == NULL) {
+		newchunk = alloc_kpages(1);
+		if (newchunk == 0) {
+			free_kpages(prpage);
+			if (newleaf != NULL) {
+				free_kpages((vaddr_t)newleaf);
+			}
+			kprintf("kmalloc: Subpage allocator couldn't get "
+				"a pageref chunk\n");
+			return 0;
+		}
+	}
+
+	kmalloc_biglock(&node);
+
+	if (newleaf != NULL && pagedir[pdindex] == NULL) {
+		pagedir[pdindex] = newleaf;
+		newleaf = NULL;
+	}
+	if (newchunk != 0 && prchunks_avail == NULL) {
+		prchunk_add(newchunk);
+		newchunk = 0;
 	}
-	spinlock_acquire(&kmalloc_spinlock);
 
 	pr = allocpageref();
 	if (pr==NULL) {
-		/* Couldn't allocate accounting space for the new page. */
-		spinlock_release(&kmalloc_spinlock);
+		/*
+		 * Other cpus used up every pageref between our
+		 * check and now. Give everything back and try again.
+		 */
+		mcslock_release(&kmalloc_spinlock, &node);
 		free_kpages(prpage);
-		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
-		return NULL;
+		if (newleaf != NULL) {
+			free_kpages((vaddr_t)newleaf);
+		}
+		if (newchunk != 0) {
+			free_kpages(newchunk);
+		}
+		kmalloc_biglock(&node);
+		goto again;
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
@@ -504,29 +782,58 @@ subpage_kmalloc(size_t sz)
 	pr->next_all = allbase;
 	allbase = pr;
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	pagedir_set(prpage, pr);
+
+	if (newleaf != NULL || newchunk != 0) {
+		/* Somebody else beat us to it while we were out. */
+		mcslock_release(&kmalloc_spinlock, &node);
+		if (newleaf != NULL) {
+			free_kpages((vaddr_t)newleaf);
+		}
+		if (newchunk != 0) {
+			free_kpages(newchunk);
+		}
+		kmalloc_biglock(&node);
+	}
+
+	/* Now go back and take blocks from whatever is free. */
+	goto again;
 }
 
+/*
+ * Give a chain of free blocks back to their pages in a single trip
+ * through kmalloc_spinlock. The blocks may be of mixed sizes and from
+ * any pages. Pages that become entirely free are handed back to the
+ * VM system once the lock has been dropped.
+ */
 static
-int
-subpage_kfree(void *ptr)
+void
+subpage_putblocks(struct freelist *chain)
 {
 	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
+	vaddr_t ptraddr;	// address of the block being freed
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
 	struct freelist *fl;	// free list entry
+	struct freelist *next;	// next block in the chain
+	struct freelist *emptypages;	// pages to give back
+	struct prchunk *pc;	// pageref chunk to give back
 	vaddr_t offset;		// offset into page
+	struct mcsnode node;	// our place in line for kmalloc_spinlock
 
-	ptraddr = (vaddr_t)ptr;
+	emptypages = NULL;
 
-	spinlock_acquire(&kmalloc_spinlock);
+	kmalloc_biglock(&node);
 
 	checksubpages();
 
-	for (pr = allbase; pr; pr = pr->next_all) {
+	for (fl = chain; fl != NULL; fl = next) {
+		next = fl->next;
+
+		ptraddr = (vaddr_t)fl;
+		pr = pagedir_lookup(ptraddr);
+		KASSERT(pr != NULL);
+
 		prpage = PR_PAGEADDR(pr);
 		blktype = PR_BLOCKTYPE(pr);
 
@@ -534,72 +841,473 @@ subpage_kfree(void *ptr)
 		KASSERT(blktype>=0 && blktype<NSIZES);
 		checksubpage(pr);
 
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
+		offset = ptraddr - prpage;
+		KASSERT(offset < PAGE_SIZE && offset % sizes[blktype] == 0);
+
+		if (pr->freelist_offset == INVALID_OFFSET) {
+			fl->next = NULL;
+		} else {
+			fl->next = (struct freelist *)
+				(prpage + pr->freelist_offset);
+		}
+		pr->freelist_offset = offset;
+		pr->nfree++;
+
+		KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+		if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+			/* Whole page is free. */
+			remove_lists(pr, blktype);
+			pagedir_set(prpage, NULL);
+			pc = freepageref(pr);
+
+			/*
+			 * Thread it onto a private list, using its
+			 * first word, to free after unlocking. Same
+			 * for the pageref chunk if that's now unused.
+			 */
+			((struct freelist *)prpage)->next = emptypages;
+			emptypages = (struct freelist *)prpage;
+			if (pc != NULL) {
+				((struct freelist *)pc)->next = emptypages;
+				emptypages = (struct freelist *)pc;
+			}
 		}
 	}
 
-	if (pr==NULL) {
+	checksubpages();
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	mcslock_release(&kmalloc_spinlock, &node);
+
+	while (emptypages != NULL) {
+		next = emptypages->next;
+		free_kpages((vaddr_t)emptypages);
+		emptypages = next;
+	}
+}
+
+static
+void *
+subpage_kmalloc(size_t sz)
+{
+	struct freelist *fl = NULL;
+
+	if (subpage_getblocks(blocktype(sz), &fl, 1) == 0) {
+		return NULL;
+	}
+	KASSERT(fl != NULL);
+	return fl;
+}
+
+/*
+ * Check that PTR is a subpage block and return its type. Returns -1
+ * if it isn't on any of our pages, which means it must be a
+ * whole-page allocation.
+ */
+static
+int
+subpage_blocktype(void *ptr)
+{
+	struct pageref *pr;
+	vaddr_t offset;
+	int blktype;
+
+	pr = pagedir_lookup((vaddr_t)ptr);
+	if (pr == NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
-	offset = ptraddr - prpage;
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype>=0 && blktype<NSIZES);
+
+	offset = (vaddr_t)ptr - PR_PAGEADDR(pr);
 
 	/* Check for proper positioning and alignment */
 	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
 		panic("kfree: subpage free of invalid addr %p\n", ptr);
 	}
 
+	return blktype;
+}
+
+////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+//    Each cpu keeps, for each block size, two "magazines" of free
+//    blocks: the loaded one that kmalloc and kfree work on, and the
+//    previous one. A magazine is just a chain of blocks linked through
+//    their first word, plus a count. With interrupts off, the current
+//    cpu owns its magazines outright, so the common case takes no
+//    lock at all.
+//
+//    When both magazines are empty (in kmalloc) or both full (in
+//    kfree), a full magazine is exchanged with the depot, a per-size
+//    stack of full magazines with its own spinlock. Only when the
+//    depot has nothing to give, or already holds DEPOT_MAX
+//    magazines, do we go to the page lists, and then we move a whole
+//    magazine's worth of blocks under one acquisition of
+//    kmalloc_spinlock.
+//
+//    Blocks sitting in a magazine or in the depot count as allocated
+//    as far as the page lists (and kheap_printstats) are concerned.
+//
+
+/*
+ * Blocks per magazine for each size. These are capped at half a page
+ * worth, so a cpu never parks more than a page of each size.
+ */
+static const unsigned magsizes[NSIZES] = { 8, 8, 8, 8, 8, 4, 2, 1 };
+
+/* Full magazines the depot holds per size before giving blocks back. */
+#define DEPOT_MAX 4
+
+struct magazine {
+	struct freelist *mg_blocks;	/* chain of free blocks */
+	unsigned mg_count;		/* number of blocks in chain */
+};
+
+/*
+ * A full magazine in the depot. The first block of the chain does
+ * double duty as the depot's list link, so the depot needs no memory
+ * of its own. (Hence blocks must hold at least two pointers.)
+ */
+struct depotmag {
+	struct freelist dm_head;	/* first block; links the rest */
+	struct depotmag *dm_next;	/* next full magazine */
+};
+
+struct depot {
+	struct spinlock d_lock;
+	struct depotmag *d_mags;
+	unsigned d_count;
+	struct kmlockstats d_lockstats;
+};
+
+#define DEPOT_INITIALIZER { SPINLOCK_INITIALIZER, NULL, 0, { 0, 0 } }
+
+static struct depot depots[NSIZES] = {
+	DEPOT_INITIALIZER, DEPOT_INITIALIZER,
+	DEPOT_INITIALIZER, DEPOT_INITIALIZER,
+	DEPOT_INITIALIZER, DEPOT_INITIALIZER,
+	DEPOT_INITIALIZER, DEPOT_INITIALIZER,
+};
+
+/* Per-cpu, per-size cache. Only touched by its own cpu, at splhigh. */
+struct kmcache {
+	struct magazine kc_loaded;
+	struct magazine kc_prev;
+};
+
+static struct kmcache kmcaches[MAXCPUS][NSIZES];
+
+/*
+ * Cache statistics, in per-cpu counters (see pcpuctr.h): for each
+ * size, how many kmallocs and kfrees there were, and how many of
+ * those had to leave the cpu.
+ */
+#define KMSTAT_ALLOCS       0
+#define KMSTAT_ALLOCMISSES  1
+#define KMSTAT_FREES        2
+#define KMSTAT_FREEMISSES   3
+#define KMSTAT_NUM          (4 * NSIZES)
+#define KMSTAT(stat, blktype)  ((stat) * NSIZES + (blktype))
+
+static PCPUCTR_STORAGE(kmstat_slots, KMSTAT_NUM);
+static struct pcpuctr kmstats = PCPUCTR_INITIALIZER(kmstat_slots, KMSTAT_NUM);
+
+static
+void
+mag_push(struct magazine *mg, struct freelist *fl)
+{
+	fl->next = mg->mg_blocks;
+	mg->mg_blocks = fl;
+	mg->mg_count++;
+}
+
+static
+struct freelist *
+mag_pop(struct magazine *mg)
+{
+	struct freelist *fl;
+
+	KASSERT(mg->mg_count > 0);
+	fl = mg->mg_blocks;
+	mg->mg_blocks = fl->next;
+	mg->mg_count--;
+	return fl;
+}
+
+static
+void
+mag_swap(struct kmcache *kc)
+{
+	struct magazine tmp;
+
+	tmp = kc->kc_loaded;
+	kc->kc_loaded = kc->kc_prev;
+	kc->kc_prev = tmp;
+}
+
+/*
+ * Get a full magazine from the depot. Returns false if it's empty.
+ */
+static
+bool
+depot_get(unsigned blktype, struct magazine *mg)
+{
+	struct depot *d = &depots[blktype];
+	struct depotmag *dm;
+
+	kmalloc_lock(&d->d_lock, &d->d_lockstats);
+	dm = d->d_mags;
+	if (dm != NULL) {
+		d->d_mags = dm->dm_next;
+		d->d_count--;
+	}
+	spinlock_release(&d->d_lock);
+
+	if (dm == NULL) {
+		return false;
+	}
+	mg->mg_blocks = &dm->dm_head;
+	mg->mg_count = magsizes[blktype];
+	return true;
+}
+
+/*
+ * Hand a magazine we have no room for to the depot. If the depot is
+ * already holding enough, or the magazine isn't full, send the blocks
+ * back to their pages instead so the memory can be reclaimed.
+ */
+static
+void
+depot_put(unsigned blktype, struct magazine *mg)
+{
+	struct depot *d = &depots[blktype];
+	struct depotmag *dm;
+
+	COMPILE_ASSERT(sizeof(struct depotmag) <= SMALLEST_SUBPAGE_SIZE);
+
+	if (mg->mg_count == 0) {
+		return;
+	}
+
+	if (mg->mg_count == magsizes[blktype]) {
+		kmalloc_lock(&d->d_lock, &d->d_lockstats);
+		if (d->d_count < DEPOT_MAX) {
+			dm = (struct depotmag *)mg->mg_blocks;
+			dm->dm_next = d->d_mags;
+			d->d_mags = dm;
+			d->d_count++;
+			spinlock_release(&d->d_lock);
+			return;
+		}
+		spinlock_release(&d->d_lock);
+	}
+
+	subpage_putblocks(mg->mg_blocks);
+}
+
+static
+void *
+magazine_kmalloc(unsigned blktype)
+{
+	struct kmcache *kc;
+	struct magazine full;
+	struct freelist *fl;
+	int spl;
+
+	spl = splhigh();
+	kc = &kmcaches[curcpu->c_number][blktype];
+	pcpuctr_inc(&kmstats, KMSTAT(KMSTAT_ALLOCS, blktype));
+
+	if (kc->kc_loaded.mg_count == 0 && kc->kc_prev.mg_count > 0) {
+		mag_swap(kc);
+	}
+	if (kc->kc_loaded.mg_count > 0) {
+		fl = mag_pop(&kc->kc_loaded);
+		splx(spl);
+		return fl;
+	}
+
+	pcpuctr_inc(&kmstats, KMSTAT(KMSTAT_ALLOCMISSES, blktype));
+	splx(spl);
+
+	/*
+	 * Both magazines are empty. Get a full one from the depot,
+	 * or failing that, a magazine's worth of blocks from the
+	 * pages. Do this with interrupts on; it may take a while.
+	 */
+	if (!depot_get(blktype, &full)) {
+		full.mg_blocks = NULL;
+		full.mg_count = subpage_getblocks(blktype, &full.mg_blocks,
+						  magsizes[blktype]);
+		if (full.mg_count == 0) {
+			return NULL;
+		}
+	}
+
+	/*
+	 * We may be on a different cpu by now, and an interrupt
+	 * handler may have freed something into our magazines, so
+	 * look again before loading.
+	 */
+	spl = splhigh();
+	kc = &kmcaches[curcpu->c_number][blktype];
+	if (kc->kc_loaded.mg_count == 0) {
+		kc->kc_loaded = full;
+		full.mg_blocks = NULL;
+		full.mg_count = 0;
+	}
+	else if (kc->kc_prev.mg_count == 0) {
+		kc->kc_prev = kc->kc_loaded;
+		kc->kc_loaded = full;
+		full.mg_blocks = NULL;
+		full.mg_count = 0;
+	}
+	fl = mag_pop(&kc->kc_loaded);
+	splx(spl);
+
+	/* If there was nowhere to put it, give it back. */
+	depot_put(blktype, &full);
+
+	return fl;
+}
+
+static
+void
+magazine_kfree(unsigned blktype, void *ptr)
+{
+	struct kmcache *kc;
+	struct magazine full;
+	int spl;
+
 	/*
 	 * Clear the block to 0xdeadbeef to make it easier to detect
 	 * uses of dangling pointers.
 	 */
 	fill_deadbeef(ptr, sizes[blktype]);
 
+	spl = splhigh();
+	kc = &kmcaches[curcpu->c_number][blktype];
+	pcpuctr_inc(&kmstats, KMSTAT(KMSTAT_FREES, blktype));
+
+	if (kc->kc_loaded.mg_count == magsizes[blktype] &&
+	    kc->kc_prev.mg_count == 0) {
+		mag_swap(kc);
+	}
+	if (kc->kc_loaded.mg_count < magsizes[blktype]) {
+		mag_push(&kc->kc_loaded, ptr);
+		splx(spl);
+		return;
+	}
+
 	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
+	 * Both magazines are full. Retire the previous one to the
+	 * depot and start a fresh one.
 	 */
+	pcpuctr_inc(&kmstats, KMSTAT(KMSTAT_FREEMISSES, blktype));
+	full = kc->kc_prev;
+	kc->kc_prev = kc->kc_loaded;
+	kc->kc_loaded.mg_blocks = NULL;
+	kc->kc_loaded.mg_count = 0;
+	mag_push(&kc->kc_loaded, ptr);
+	splx(spl);
+
+	depot_put(blktype, &full);
+}
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
-
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+////////////////////////////////////////
+
+void
+kheap_printstats(void)
+{
+	struct pageref *pr;
+	unsigned c, i;
+	unsigned allocs, allocmisses, frees, freemisses;
+	struct mcsnode node;
+
+	/* print the whole thing with interrupts off */
+	mcslock_acquire(&kmalloc_spinlock, &node);
+
+	kprintf("Subpage allocator status:\n");
+	kprintf("(blocks cached in per-cpu magazines show as in use)\n");
+
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		dumpsubpage(pr);
 	}
+	kprintf("%u pagerefs in use, %u chunks of %u\n",
+		npagerefs, prchunks_total, (unsigned)PRCHUNK_NREFS);
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
-	spinlock_acquire(&kmalloc_spinlock);
-	checksubpages();
-	spinlock_release(&kmalloc_spinlock);
-#endif
+	mcslock_release(&kmalloc_spinlock, &node);
 
-	return 0;
+	/*
+	 * The cache counters belong to other cpus and are read
+	 * without any locking, so they are only approximate.
+	 * Cpu "all" is the sum over the cpus.
+	 */
+	kprintf("Per-cpu magazine caches:\n");
+	kprintf("  cpu  size     allocs   misses      frees   misses  hit%%\n");
+	for (c=0; c<=MAXCPUS; c++) {
+		for (i=0; i<NSIZES; i++) {
+			if (c == MAXCPUS) {
+				allocs = pcpuctr_read(&kmstats,
+					KMSTAT(KMSTAT_ALLOCS, i));
+				allocmisses = pcpuctr_read(&kmstats,
+					KMSTAT(KMSTAT_ALLOCMISSES, i));
+				frees = pcpuctr_read(&kmstats,
+					KMSTAT(KMSTAT_FREES, i));
+				freemisses = pcpuctr_read(&kmstats,
+					KMSTAT(KMSTAT_FREEMISSES, i));
+			}
+			else {
+				allocs = pcpuctr_readcpu(&kmstats,
+					KMSTAT(KMSTAT_ALLOCS, i), c);
+				allocmisses = pcpuctr_readcpu(&kmstats,
+					KMSTAT(KMSTAT_ALLOCMISSES, i), c);
+				frees = pcpuctr_readcpu(&kmstats,
+					KMSTAT(KMSTAT_FREES, i), c);
+				freemisses = pcpuctr_readcpu(&kmstats,
+					KMSTAT(KMSTAT_FREEMISSES, i), c);
+			}
+			if (allocs + frees == 0) {
+				continue;
+			}
+			if (c == MAXCPUS) {
+				kprintf("  all");
+			}
+			else {
+				kprintf("  %3u", c);
+			}
+			kprintf("  %4lu %10u %8u %10u %8u  %3u\n",
+				(unsigned long)sizes[i],
+				allocs, allocmisses, frees, freemisses,
+				100 - (100 * (allocmisses + freemisses)) /
+				(allocs + frees));
+		}
+	}
+
+	kprintf("Shared locks:         acquires  contended\n");
+	kprintf("  kmalloc_spinlock  %10u %10u\n",
+		kmalloc_lockstats.ls_acquires,
+		kmalloc_lockstats.ls_contended);
+	for (i=0; i<NSIZES; i++) {
+		kprintf("  depot %-4lu (%u/%u) %10u %10u\n",
+			(unsigned long)sizes[i],
+			depots[i].d_count, DEPOT_MAX,
+			depots[i].d_lockstats.ls_acquires,
+			depots[i].d_lockstats.ls_contended);
+	}
 }
 
 //
 ////////////////////////////////////////////////////////////
 
+static
 void *
-kmalloc(size_t sz)
+kmalloc_internal(size_t sz)
 {
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
@@ -615,20 +1323,375 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
-	return subpage_kmalloc(sz);
+	/* Until the boot cpu is set up there are no magazines. */
+	if (!CURCPU_EXISTS()) {
+		return subpage_kmalloc(sz);
+	}
+
+	return magazine_kmalloc(blocktype(sz));
 }
 
+static
 void
-kfree(void *ptr)
+kfree_internal(void *ptr)
 {
+	int blktype;
+
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+
+	blktype = subpage_blocktype(ptr);
+	if (blktype < 0) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
+	else if (!CURCPU_EXISTS()) {
+		fill_deadbeef(ptr, sizes[blktype]);
+		((struct freelist *)ptr)->next = NULL;
+		subpage_putblocks(ptr);
+	}
+	else {
+		magazine_kfree(blktype, ptr);
+	}
+}
+
+#if OPT_KMPROF
+
+////////////////////////////////////////////////////////////
+//
+// Call-site profiler.
+//
+//    Every allocation is charged to the address kmalloc was called
+//    from (or, for wrappers like kstrdup, the address the wrapper
+//    was called from; see kmalloc_from). Sites live in a fixed
+//    open-addressed hash table; if it fills up, further sites are
+//    lumped together in one overflow entry. A site's slot is claimed
+//    under kmprof_claimlock and never changes hands after that, so
+//    finding it takes no lock; its counters are protected by one of
+//    KMPROF_NLOCKS spinlocks picked by slot number, so allocations
+//    from different sites on different cpus don't all serialize on
+//    one lock.
+//
+//    To find the site again at kfree time, subpage blocks are
+//    prefixed with a small header recording the site and the
+//    requested size. This bumps some allocations into the next size
+//    class. Whole-page allocations get no header, so they stay
+//    page-aligned and the same size; instead they're recorded by
+//    address in a small directory, kmprof_bigs. If that's full, the
+//    allocation falls back to having a header (and so an extra page).
+//    A header puts the block at 8 past a 16-byte boundary, so kfree
+//    can tell the two kinds apart: only directory entries are
+//    page-aligned.
+//
+
+#define KMPROF_NSITES  512		/* must be a power of 2 */
+#define KMPROF_OVERFLOW KMPROF_NSITES	/* index of the overflow entry */
+#define KMPROF_NLOCKS  16		/* must be a power of 2 */
+#define KMPROF_NBIGS   256		/* whole-page allocations tracked */
+
+struct kmsite {
+	volatile vaddr_t ks_caller;	/* 0 if unused */
+	unsigned ks_allocs;
+	unsigned ks_frees;
+	size_t ks_live;			/* bytes currently allocated */
+	size_t ks_peak;			/* high-water mark of ks_live */
+};
+
+struct kmprofhdr {
+	uint32_t kph_site;
+	uint32_t kph_size;
+};
+
+/* Keep the block after the header as aligned as kmalloc's own blocks. */
+#define KMPROF_HDRSIZE 8
+
+/* A whole-page allocation, in kmprof_bigs. */
+struct kmbig {
+	vaddr_t kb_addr;		/* 0 if unused */
+	uint32_t kb_site;
+	uint32_t kb_size;
+};
+
+static struct spinlock kmprof_claimlock = SPINLOCK_INITIALIZER;
+static struct spinlock kmprof_locks[KMPROF_NLOCKS] = {
+	[0 ... KMPROF_NLOCKS - 1] = SPINLOCK_INITIALIZER
+};
+static struct kmsite kmsites[KMPROF_NSITES + 1];
+
+/*
+ * Whole-page allocations are few and each one already costs a
+ * coremap search, so the directory is just searched from the start.
+ */
+static struct spinlock kmprof_biglock = SPINLOCK_INITIALIZER;
+static struct kmbig kmprof_bigs[KMPROF_NBIGS];
+
+/*
+ * Find CALLER's slot, claiming one if it doesn't have one yet.
+ */
+static
+unsigned
+kmprof_site(vaddr_t caller)
+{
+	unsigned i, n;
+
+	i = (caller >> 2) & (KMPROF_NSITES - 1);
+	for (n=0; n<KMPROF_NSITES; n++) {
+		if (kmsites[i].ks_caller == caller) {
+			return i;
+		}
+		if (kmsites[i].ks_caller == 0) {
+			spinlock_acquire(&kmprof_claimlock);
+			if (kmsites[i].ks_caller == 0) {
+				kmsites[i].ks_caller = caller;
+			}
+			spinlock_release(&kmprof_claimlock);
+			if (kmsites[i].ks_caller == caller) {
+				return i;
+			}
+			/* somebody else got it; keep looking */
+		}
+		i = (i + 1) & (KMPROF_NSITES - 1);
+	}
+	kmsites[KMPROF_OVERFLOW].ks_caller = 1;
+	return KMPROF_OVERFLOW;
+}
+
+static
+unsigned
+kmprof_charge(vaddr_t caller, size_t sz)
+{
+	struct kmsite *ks;
+	struct spinlock *lk;
+	unsigned i;
+
+	KASSERT(caller != 0);
+
+	i = kmprof_site(caller);
+	ks = &kmsites[i];
+	lk = &kmprof_locks[i & (KMPROF_NLOCKS - 1)];
+
+	spinlock_acquire(lk);
+	ks->ks_allocs++;
+	ks->ks_live += sz;
+	if (ks->ks_live > ks->ks_peak) {
+		ks->ks_peak = ks->ks_live;
+	}
+	spinlock_release(lk);
+	return i;
+}
+
+static
+void
+kmprof_uncharge(unsigned site, size_t sz)
+{
+	struct kmsite *ks;
+	struct spinlock *lk;
+
+	KASSERT(site <= KMPROF_OVERFLOW);
+	ks = &kmsites[site];
+	lk = &kmprof_locks[site & (KMPROF_NLOCKS - 1)];
+
+	spinlock_acquire(lk);
+	KASSERT(ks->ks_live >= sz);
+	ks->ks_frees++;
+	ks->ks_live -= sz;
+	spinlock_release(lk);
+}
+
+/*
+ * Record a whole-page allocation. Returns false if the directory is
+ * full.
+ */
+static
+bool
+kmprof_bigadd(vaddr_t addr, unsigned site, size_t sz)
+{
+	unsigned i;
+
+	spinlock_acquire(&kmprof_biglock);
+	for (i=0; i<KMPROF_NBIGS; i++) {
+		if (kmprof_bigs[i].kb_addr == 0) {
+			kmprof_bigs[i].kb_addr = addr;
+			kmprof_bigs[i].kb_site = site;
+			kmprof_bigs[i].kb_size = sz;
+			break;
+		}
+	}
+	spinlock_release(&kmprof_biglock);
+	return i < KMPROF_NBIGS;
+}
+
+/*
+ * Forget a whole-page allocation, handing back its site and size.
+ */
+static
+void
+kmprof_bigremove(vaddr_t addr, unsigned *site, size_t *sz)
+{
+	unsigned i;
+
+	spinlock_acquire(&kmprof_biglock);
+	for (i=0; i<KMPROF_NBIGS; i++) {
+		if (kmprof_bigs[i].kb_addr == addr) {
+			*site = kmprof_bigs[i].kb_site;
+			*sz = kmprof_bigs[i].kb_size;
+			kmprof_bigs[i].kb_addr = 0;
+			break;
+		}
+	}
+	spinlock_release(&kmprof_biglock);
+	if (i == KMPROF_NBIGS) {
+		panic("kfree: page-aligned block %p was not from kmalloc\n",
+		      (void *)addr);
+	}
+}
+
+/*
+ * Print the sites, biggest live total first. The counters are read
+ * without the locks, so they may be slightly inconsistent with each
+ * other if allocation is going on.
+ */
+void
+kmprof_printstats(void)
+{
+	uint32_t done[(KMPROF_NSITES + 1 + 31) / 32];
+	struct kmsite *ks;
+	unsigned i, best, nsites;
+	size_t live, peak;
+
+	bzero(done, sizeof(done));
+	nsites = 0;
+	live = peak = 0;
+
+	kprintf("kmalloc call sites, by live bytes:\n");
+	kprintf("  caller          live      peak     allocs      frees\n");
+	while (1) {
+		best = KMPROF_OVERFLOW + 1;
+		for (i=0; i<=KMPROF_OVERFLOW; i++) {
+			if (kmsites[i].ks_caller == 0 ||
+			    (done[i/32] & (1U << (i%32))) != 0) {
+				continue;
+			}
+			if (best > KMPROF_OVERFLOW ||
+			    kmsites[i].ks_live > kmsites[best].ks_live) {
+				best = i;
+			}
+		}
+		if (best > KMPROF_OVERFLOW) {
+			break;
+		}
+		done[best/32] |= 1U << (best%32);
+
+		ks = &kmsites[best];
+		if (best == KMPROF_OVERFLOW) {
+			kprintf("  (other)   ");
+		}
+		else {
+			kprintf("  0x%08lx", (unsigned long)ks->ks_caller);
+		}
+		kprintf(" %9lu %9lu %10u %10u\n",
+			(unsigned long)ks->ks_live,
+			(unsigned long)ks->ks_peak,
+			ks->ks_allocs, ks->ks_frees);
+		nsites++;
+		live += ks->ks_live;
+		peak += ks->ks_peak;
+	}
+	kprintf("%u sites, %lu bytes live (sum of peaks %lu)\n",
+		nsites, (unsigned long)live, (unsigned long)peak);
+}
+
+void *
+kmalloc_from(size_t sz, const void *caller)
+{
+	struct kmprofhdr *hdr;
+	unsigned site;
+	void *ptr;
+
+	COMPILE_ASSERT(sizeof(struct kmprofhdr) <= KMPROF_HDRSIZE);
+
+	if (sz >= LARGEST_SUBPAGE_SIZE) {
+		ptr = kmalloc_internal(sz);
+		if (ptr == NULL) {
+			return NULL;
+		}
+		site = kmprof_charge((vaddr_t)caller, sz);
+		if (kmprof_bigadd((vaddr_t)ptr, site, sz)) {
+			return ptr;
+		}
+		/* No room to record it; use a header after all. */
+		kmprof_uncharge(site, sz);
+		kfree_internal(ptr);
+	}
+
+	hdr = kmalloc_internal(sz + KMPROF_HDRSIZE);
+	if (hdr == NULL) {
+		return NULL;
+	}
+	hdr->kph_size = sz;
+	hdr->kph_site = kmprof_charge((vaddr_t)caller, sz);
+	return (char *)hdr + KMPROF_HDRSIZE;
+}
+
+void *
+kmalloc(size_t sz)
+{
+	return kmalloc_from(sz, __builtin_return_address(0));
+}
+
+void
+kfree(void *ptr)
+{
+	struct kmprofhdr *hdr;
+	unsigned site;
+	size_t sz;
+
+	if (ptr == NULL) {
+		return;
+	}
+
+	if ((vaddr_t)ptr % PAGE_SIZE == 0) {
+		kmprof_bigremove((vaddr_t)ptr, &site, &sz);
+		kmprof_uncharge(site, sz);
+		kfree_internal(ptr);
+		return;
+	}
+
+	hdr = (struct kmprofhdr *)((char *)ptr - KMPROF_HDRSIZE);
+	kmprof_uncharge(hdr->kph_site, hdr->kph_size);
+	kfree_internal(hdr);
+}
+
+#else /* !OPT_KMPROF */
+
+void
+kmprof_printstats(void)
+{
+	kprintf("kmalloc profiling is not compiled in "
+		"(enable options kmprof in the kernel config)\n");
+}
+
+void *
+kmalloc_from(size_t sz, const void *caller)
+{
+	(void)caller;
+	return kmalloc_internal(sz);
+}
+
+void *
+kmalloc(size_t sz)
+{
+	return kmalloc_internal(sz);
+}
+
+void
+kfree(void *ptr)
+{
+	kfree_internal(ptr);
 }
 
+#endif /* OPT_KMPROF */
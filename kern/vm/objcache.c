@@ -0,0 +1,389 @@
+/*
+ * Object caches.
+ *
+ * Each cache owns a set of slabs. A slab is one page gotten from
+ * alloc_kpages; it starts with a struct slab, followed by a stack of
+ * the indexes of its free objects, followed by the objects
+ * themselves. Because the slab header is at the start of the page,
+ * objcache_free finds it by masking the object's address.
+ *
+ * The free stack lives outside the objects (rather than threading a
+ * freelist through them the way kmalloc does) so that a free object
+ * keeps its constructed state.
+ *
+ * Slabs that have free objects are kept on one of two lists: the
+ * partial list (some objects in use) and the empty list (none in
+ * use). Full slabs are not on any list. We allocate from partial
+ * slabs first so that the empty ones stay empty and can be given
+ * back. Up to OBJCACHE_MAXEMPTY empty slabs are kept around to
+ * absorb alloc/free churn; beyond that they are destructed and
+ * freed.
+ *
+ * Constructors and destructors are always called without the cache's
+ * spinlock held, so they may themselves allocate memory (including
+ * from other object caches).
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <objcache.h>
+
+#define OBJCACHE_ALIGN     8
+#define OBJCACHE_MAXEMPTY  2
+
+struct slab {
+	struct objcache *sl_cache;	/* cache we belong to */
+	struct slab *sl_prev;		/* partial or empty list */
+	struct slab *sl_next;
+	char *sl_objs;			/* first object */
+	uint16_t *sl_freestack;		/* indexes of free objects */
+	unsigned sl_nfree;		/* number of free objects */
+};
+
+struct objcache {
+	const char *oc_name;
+	size_t oc_size;			/* object size, rounded */
+	unsigned oc_perslab;		/* objects per slab */
+	size_t oc_objoffset;		/* offset of first object in slab */
+	objcache_ctor_t oc_ctor;
+	objcache_dtor_t oc_dtor;
+
+	struct spinlock oc_lock;
+	struct slab *oc_partial;
+	struct slab *oc_empty;
+	unsigned oc_nempty;
+
+	/* statistics, protected by oc_lock */
+	unsigned oc_nslabs;
+	unsigned oc_allocs;
+	unsigned oc_frees;
+	unsigned oc_grows;
+	unsigned oc_reaps;
+
+	struct objcache *oc_next;	/* on allcaches */
+};
+
+/* All caches, for objcache_printstats. */
+static struct spinlock allcaches_lock = SPINLOCK_INITIALIZER;
+static struct objcache *allcaches;
+
+////////////////////////////////////////////////////////////
+//
+// Slab lists
+
+static
+void
+slab_link(struct slab **head, struct slab *sl)
+{
+	sl->sl_prev = NULL;
+	sl->sl_next = *head;
+	if (*head != NULL) {
+		(*head)->sl_prev = sl;
+	}
+	*head = sl;
+}
+
+static
+void
+slab_unlink(struct slab **head, struct slab *sl)
+{
+	if (sl->sl_prev != NULL) {
+		sl->sl_prev->sl_next = sl->sl_next;
+	}
+	else {
+		KASSERT(*head == sl);
+		*head = sl->sl_next;
+	}
+	if (sl->sl_next != NULL) {
+		sl->sl_next->sl_prev = sl->sl_prev;
+	}
+	sl->sl_prev = sl->sl_next = NULL;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Slab creation and destruction
+
+/*
+ * Run the destructor on the first N objects of SL and release the
+ * page.
+ */
+static
+void
+slab_destroy(struct objcache *oc, struct slab *sl, unsigned n)
+{
+	unsigned i;
+
+	if (oc->oc_dtor != NULL) {
+		for (i=0; i<n; i++) {
+			oc->oc_dtor(sl->sl_objs + i*oc->oc_size);
+		}
+	}
+	sl->sl_cache = NULL;
+	free_kpages((vaddr_t)sl);
+}
+
+/*
+ * Get a page and construct a full slab's worth of objects in it.
+ */
+static
+struct slab *
+slab_create(struct objcache *oc)
+{
+	struct slab *sl;
+	vaddr_t page;
+	unsigned i;
+	int result;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+	KASSERT(page % PAGE_SIZE == 0);
+
+	sl = (struct slab *)page;
+	sl->sl_cache = oc;
+	sl->sl_prev = sl->sl_next = NULL;
+	sl->sl_freestack = (uint16_t *)(sl + 1);
+	sl->sl_objs = (char *)page + oc->oc_objoffset;
+	sl->sl_nfree = oc->oc_perslab;
+
+	for (i=0; i<oc->oc_perslab; i++) {
+		if (oc->oc_ctor != NULL) {
+			result = oc->oc_ctor(sl->sl_objs + i*oc->oc_size);
+			if (result) {
+				slab_destroy(oc, sl, i);
+				return NULL;
+			}
+		}
+		/* hand out low addresses first */
+		sl->sl_freestack[oc->oc_perslab - 1 - i] = i;
+	}
+	return sl;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+struct objcache *
+objcache_create(const char *name, size_t size,
+		objcache_ctor_t ctor, objcache_dtor_t dtor)
+{
+	return objcache_create_aligned(name, size, OBJCACHE_ALIGN, ctor, dtor);
+}
+
+/*
+ * Slabs are page-aligned, so rounding both the object size and the
+ * start of the object area up to ALIGN aligns every object.
+ */
+struct objcache *
+objcache_create_aligned(const char *name, size_t size, size_t align,
+			objcache_ctor_t ctor, objcache_dtor_t dtor)
+{
+	struct objcache *oc;
+	size_t hdr;
+	unsigned n;
+
+	KASSERT(size > 0 && size <= OBJCACHE_MAXSIZE);
+	KASSERT(align >= OBJCACHE_ALIGN && align <= OBJCACHE_MAXSIZE);
+	KASSERT((align & (align - 1)) == 0);
+
+	oc = kmalloc(sizeof(*oc));
+	if (oc == NULL) {
+		return NULL;
+	}
+
+	oc->oc_name = name;
+	oc->oc_size = (size + align - 1) & ~(size_t)(align - 1);
+	oc->oc_ctor = ctor;
+	oc->oc_dtor = dtor;
+
+	/*
+	 * Fit as many objects as we can after the header and free
+	 * stack. Start from the upper bound and back off until the
+	 * aligned object area fits.
+	 */
+	n = (PAGE_SIZE - sizeof(struct slab)) / (oc->oc_size + sizeof(uint16_t));
+	while (1) {
+		KASSERT(n > 0);
+		hdr = sizeof(struct slab) + n * sizeof(uint16_t);
+		hdr = (hdr + align - 1) & ~(size_t)(align - 1);
+		if (hdr + n * oc->oc_size <= PAGE_SIZE) {
+			break;
+		}
+		n--;
+	}
+	oc->oc_perslab = n;
+	oc->oc_objoffset = hdr;
+
+	spinlock_init(&oc->oc_lock);
+	oc->oc_partial = NULL;
+	oc->oc_empty = NULL;
+	oc->oc_nempty = 0;
+
+	oc->oc_nslabs = 0;
+	oc->oc_allocs = 0;
+	oc->oc_frees = 0;
+	oc->oc_grows = 0;
+	oc->oc_reaps = 0;
+
+	spinlock_acquire(&allcaches_lock);
+	oc->oc_next = allcaches;
+	allcaches = oc;
+	spinlock_release(&allcaches_lock);
+
+	return oc;
+}
+
+void
+objcache_destroy(struct objcache *oc)
+{
+	struct objcache **p;
+	struct slab *sl;
+
+	KASSERT(oc->oc_partial == NULL);
+	KASSERT(oc->oc_allocs == oc->oc_frees);
+
+	spinlock_acquire(&allcaches_lock);
+	for (p = &allcaches; *p != oc; p = &(*p)->oc_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = oc->oc_next;
+	spinlock_release(&allcaches_lock);
+
+	while ((sl = oc->oc_empty) != NULL) {
+		slab_unlink(&oc->oc_empty, sl);
+		slab_destroy(oc, sl, oc->oc_perslab);
+	}
+
+	spinlock_cleanup(&oc->oc_lock);
+	kfree(oc);
+}
+
+void *
+objcache_alloc(struct objcache *oc)
+{
+	struct slab *sl, *newslab;
+	unsigned ix;
+
+	spinlock_acquire(&oc->oc_lock);
+	while (oc->oc_partial == NULL && oc->oc_empty == NULL) {
+		/* Constructors may block or allocate; drop the lock. */
+		spinlock_release(&oc->oc_lock);
+		newslab = slab_create(oc);
+		if (newslab == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&oc->oc_lock);
+		slab_link(&oc->oc_empty, newslab);
+		oc->oc_nempty++;
+		oc->oc_nslabs++;
+		oc->oc_grows++;
+	}
+
+	if (oc->oc_partial != NULL) {
+		sl = oc->oc_partial;
+		if (sl->sl_nfree == 1) {
+			slab_unlink(&oc->oc_partial, sl);
+		}
+	}
+	else {
+		sl = oc->oc_empty;
+		slab_unlink(&oc->oc_empty, sl);
+		oc->oc_nempty--;
+		if (sl->sl_nfree > 1) {
+			slab_link(&oc->oc_partial, sl);
+		}
+	}
+
+	KASSERT(sl->sl_nfree > 0);
+	ix = sl->sl_freestack[--sl->sl_nfree];
+	KASSERT(ix < oc->oc_perslab);
+	oc->oc_allocs++;
+	spinlock_release(&oc->oc_lock);
+
+	return sl->sl_objs + ix * oc->oc_size;
+}
+
+void
+objcache_free(struct objcache *oc, void *obj)
+{
+	struct slab *sl, *reap;
+	size_t offset;
+
+	if (obj == NULL) {
+		return;
+	}
+
+	sl = (struct slab *)((vaddr_t)obj & PAGE_FRAME);
+	if (sl->sl_cache != oc) {
+		panic("objcache_free: %p does not belong to cache %s\n",
+		      obj, oc->oc_name);
+	}
+	offset = (char *)obj - sl->sl_objs;
+	if (offset % oc->oc_size != 0) {
+		panic("objcache_free: %s: misaligned pointer %p\n",
+		      oc->oc_name, obj);
+	}
+
+	reap = NULL;
+
+	spinlock_acquire(&oc->oc_lock);
+	KASSERT(sl->sl_nfree < oc->oc_perslab);
+	sl->sl_freestack[sl->sl_nfree++] = offset / oc->oc_size;
+	oc->oc_frees++;
+
+	if (sl->sl_nfree == oc->oc_perslab) {
+		/* Now empty. It was partial unless it only holds one. */
+		if (oc->oc_perslab > 1) {
+			slab_unlink(&oc->oc_partial, sl);
+		}
+		slab_link(&oc->oc_empty, sl);
+		oc->oc_nempty++;
+		if (oc->oc_nempty > OBJCACHE_MAXEMPTY) {
+			/* Give back the one that's been empty longest. */
+			reap = oc->oc_empty;
+			while (reap->sl_next != NULL) {
+				reap = reap->sl_next;
+			}
+			slab_unlink(&oc->oc_empty, reap);
+			oc->oc_nempty--;
+			oc->oc_nslabs--;
+			oc->oc_reaps++;
+		}
+	}
+	else if (sl->sl_nfree == 1) {
+		/* Was full. */
+		slab_link(&oc->oc_partial, sl);
+	}
+	spinlock_release(&oc->oc_lock);
+
+	if (reap != NULL) {
+		slab_destroy(oc, reap, oc->oc_perslab);
+	}
+}
+
+void
+objcache_printstats(void)
+{
+	struct objcache *oc;
+
+	kprintf("%-12s %5s %5s %6s %6s %9s %9s %6s %6s\n",
+		"cache", "size", "/slab", "slabs", "inuse",
+		"allocs", "frees", "grows", "reaps");
+
+	spinlock_acquire(&allcaches_lock);
+	for (oc = allcaches; oc != NULL; oc = oc->oc_next) {
+		spinlock_acquire(&oc->oc_lock);
+		kprintf("%-12s %5u %5u %6u %6u %9u %9u %6u %6u\n",
+			oc->oc_name, (unsigned)oc->oc_size, oc->oc_perslab,
+			oc->oc_nslabs, oc->oc_allocs - oc->oc_frees,
+			oc->oc_allocs, oc->oc_frees,
+			oc->oc_grows, oc->oc_reaps);
+		spinlock_release(&oc->oc_lock);
+	}
+	spinlock_release(&allcaches_lock);
+}
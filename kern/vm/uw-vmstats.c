@@ -14,10 +14,18 @@
 #include <lib.h>
 #include <synch.h>
 #include <spl.h>
+#include <pcpuctr.h>
 #include <uw-vmstats.h>
 
-/* Counters for tracking statistics */
-static unsigned int stats_counts[VMSTAT_COUNT];
+/*
+ * Counters for tracking statistics. These are per-cpu counters (see
+ * pcpuctr.h), so counting a TLB fault takes no lock and doesn't
+ * bounce a cache line between cpus; stats_lock is now only used to
+ * keep vmstats_init from racing with itself.
+ */
+static PCPUCTR_STORAGE(stats_slots, VMSTAT_COUNT);
+static struct pcpuctr stats_counts =
+	PCPUCTR_INITIALIZER(stats_slots, VMSTAT_COUNT);
 
 struct spinlock stats_lock = SPINLOCK_INITIALIZER;
 
@@ -41,9 +49,7 @@ static const char *stats_names[] = {
 void
 vmstats_inc(unsigned int index)
 {
-    spinlock_acquire(&stats_lock);
-      _vmstats_inc(index);
-    spinlock_release(&stats_lock);
+  _vmstats_inc(index);
 }
 
 /* ---------------------------------------------------------------------- */
@@ -65,24 +71,20 @@ void
 _vmstats_inc(unsigned int index)
 {
   KASSERT(index < VMSTAT_COUNT);
-  stats_counts[index]++;
+  pcpuctr_inc(&stats_counts, index);
 }
 
 /* ---------------------------------------------------------------------- */
 void
 _vmstats_init(void)
 {
-  int i = 0;
-
   if (sizeof(stats_names) / sizeof(char *) != VMSTAT_COUNT) {
     kprintf("vmstats_init: number of stats_names = %d != VMSTAT_COUNT = %d\n",
       (sizeof(stats_names) / sizeof(char *)), VMSTAT_COUNT);
     panic("Should really fix this before proceeding\n");
   }
 
-  for (i=0; i<VMSTAT_COUNT; i++) {
-    stats_counts[i] = 0;
-  }
+  pcpuctr_zero(&stats_counts);
 
 }
 
@@ -102,18 +104,24 @@ vmstats_print(void)
   int tlb_faults = 0;
   int elf_plus_swap_reads = 0;
   int disk_reads = 0;
+  unsigned int stats[VMSTAT_COUNT];
+
+  /* Add up each counter once, so the checks below see one snapshot. */
+  for (i=0; i<VMSTAT_COUNT; i++) {
+    stats[i] = pcpuctr_read(&stats_counts, i);
+  }
 
   kprintf("VMSTATS:\n");
   for (i=0; i<VMSTAT_COUNT; i++) {
-    kprintf("VMSTAT %25s = %10d\n", stats_names[i], stats_counts[i]);
+    kprintf("VMSTAT %25s = %10d\n", stats_names[i], stats[i]);
   }
 
-  tlb_faults = stats_counts[VMSTAT_TLB_FAULT];
-  free_plus_replace = stats_counts[VMSTAT_TLB_FAULT_FREE] + stats_counts[VMSTAT_TLB_FAULT_REPLACE];
-  disk_plus_zeroed_plus_reload = stats_counts[VMSTAT_PAGE_FAULT_DISK] +
-    stats_counts[VMSTAT_PAGE_FAULT_ZERO] + stats_counts[VMSTAT_TLB_RELOAD];
-  elf_plus_swap_reads = stats_counts[VMSTAT_ELF_FILE_READ] + stats_counts[VMSTAT_SWAP_FILE_READ];
-  disk_reads = stats_counts[VMSTAT_PAGE_FAULT_DISK];
+  tlb_faults = stats[VMSTAT_TLB_FAULT];
+  free_plus_replace = stats[VMSTAT_TLB_FAULT_FREE] + stats[VMSTAT_TLB_FAULT_REPLACE];
+  disk_plus_zeroed_plus_reload = stats[VMSTAT_PAGE_FAULT_DISK] +
+    stats[VMSTAT_PAGE_FAULT_ZERO] + stats[VMSTAT_TLB_RELOAD];
+  elf_plus_swap_reads = stats[VMSTAT_ELF_FILE_READ] + stats[VMSTAT_SWAP_FILE_READ];
+  disk_reads = stats[VMSTAT_PAGE_FAULT_DISK];
 
   kprintf("VMSTAT TLB Faults with Free + TLB Faults with Replace = %d\n", free_plus_replace);
   if (tlb_faults != free_plus_replace) {
@@ -0,0 +1,39 @@
+#ifndef _MUTEX_H_
+#define _MUTEX_H_
+
+/*
+ * Mutexes and condition variables for user threads (see
+ * thread_create in <unistd.h>), in libc's unix/mutex.c.
+ *
+ * Both live entirely in user memory. Locking a free mutex and
+ * unlocking one nobody is waiting for are done with atomic operations
+ * and never enter the kernel; __futex is only called to sleep when a
+ * thread has to wait and to wake up threads that are waiting.
+ *
+ * Neither needs to be destroyed. Like the kernel's, condition
+ * variables should always be used with the same mutex, which must be
+ * held when calling cond_wait, cond_signal, or cond_broadcast.
+ */
+
+struct mutex {
+	volatile int m_state;	/* 0 free, 1 held, 2 held with waiters */
+};
+
+struct cond {
+	volatile int c_seq;	/* bumped by every signal and broadcast */
+};
+
+#define MUTEX_INITIALIZER	{ 0 }
+#define COND_INITIALIZER	{ 0 }
+
+void mutex_init(struct mutex *m);
+void mutex_lock(struct mutex *m);
+int mutex_trylock(struct mutex *m);	/* returns 0 if locked, else -1 */
+void mutex_unlock(struct mutex *m);
+
+void cond_init(struct cond *c);
+void cond_wait(struct cond *c, struct mutex *m);
+void cond_signal(struct cond *c, struct mutex *m);
+void cond_broadcast(struct cond *c, struct mutex *m);
+
+#endif /* _MUTEX_H_ */
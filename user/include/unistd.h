@@ -38,6 +38,7 @@
  * about the kern/ headers.
  */
 #include <kern/fcntl.h>
+#include <kern/futex.h>
 #include <kern/ioctl.h>
 #include <kern/reboot.h>
 #include <kern/seek.h>
@@ -146,6 +147,9 @@ int link(const char *oldfile, const char *newfile);
 int chdir(const char *path);
 
 /* Optional. */
+pid_t vfork(void);
+/* Run PROG in a new process without forking; CONSOLE may be NULL. */
+pid_t spawn(const char *prog, char *const *args, const char *console);
 void *sbrk(int change);
 int getdirentry(int filehandle, char *buf, size_t buflen);
 int symlink(const char *target, const char *linkname);
@@ -153,7 +157,14 @@ int readlink(const char *path, char *buf, size_t buflen);
 int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 time_t __time(time_t *seconds, unsigned long *nanoseconds);
+int nanosleep(const struct timespec *req, struct timespec *rem);
 int __getcwd(char *buf, size_t buflen);
+int __thread_create(void (*entry)(void *, void *), void *arg1, void *arg2,
+		    void *stack);
+__DEAD void __thread_exit(int value);
+int __thread_join(int tid, int *value);
+int __futex(volatile int *uaddr, int op, int val,
+	    const struct timespec *timeout);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
 
@@ -164,4 +175,10 @@ int __getcwd(char *buf, size_t buflen);
 char *getcwd(char *buf, size_t buflen);		/* calls __getcwd */
 time_t time(time_t *seconds);			/* calls __time */
 
+/* User threads; see unix/thread.c. */
+int thread_create(int (*func)(void *), void *arg,
+		  void *stack, size_t stacksize);	/* calls __thread_create */
+__DEAD void thread_exit(int value);		/* calls __thread_exit */
+int thread_join(int tid, int *value);		/* calls __thread_join */
+
 #endif /* _UNISTD_H_ */
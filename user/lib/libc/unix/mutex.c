@@ -0,0 +1,174 @@
+#include <unistd.h>
+#include <mutex.h>
+
+/*
+ * Futex-based mutexes and condition variables. See <mutex.h>.
+ *
+ * The mutex is the one from Drepper's "Futexes Are Tricky": the state
+ * is 0 when free, 1 when held, and 2 when held and somebody may be
+ * asleep on it. Lock tries to move it from 0 to 1; if that fails it
+ * sets it to 2 and sleeps until it finds it 0. Unlock only has to
+ * call the kernel if it finds a 2.
+ *
+ * The condition variable is a sequence number. A waiter reads it,
+ * unlocks the mutex, and sleeps as long as it hasn't changed; signal
+ * and broadcast bump it and wake one or all sleepers. Woken waiters
+ * relock the mutex in the contended state, since others may well be
+ * waiting behind them.
+ */
+
+/* FUTEX_WAKE count that wakes everybody. */
+#define WAKE_ALL  0x7fffffff
+
+/*
+ * Atomic operations, using LL/SC like the kernel's spinlocks.
+ */
+
+/* If *P is OLDVAL, store NEWVAL in it. Return the value found. */
+static
+int
+atomic_cas(volatile int *p, int oldval, int newval)
+{
+	int x, y;
+
+	do {
+		y = newval;
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			".set noreorder;"	/* we supply the delay slot */
+			"ll %0, 0(%2);"		/*   x = *p */
+			"bne %0, %3, 1f;"	/*   if x != oldval, give up */
+			"li %1, 1;"		/*   (delay slot) y = success */
+			"move %1, %4;"		/*   y = newval */
+			"sc %1, 0(%2);"		/*   *p = y; y = success? */
+			"1:"
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "=&r" (y)
+			: "r" (p), "r" (oldval), "r" (newval)
+			: "memory");
+	} while (y == 0);
+	return x;
+}
+
+/* Store VAL in *P; return the old value. */
+static
+int
+atomic_swap(volatile int *p, int val)
+{
+	int x, y;
+
+	do {
+		y = val;
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			"ll %0, 0(%2);"		/*   x = *p */
+			"sc %1, 0(%2);"		/*   *p = y; y = success? */
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "+r" (y) : "r" (p) : "memory");
+	} while (y == 0);
+	return x;
+}
+
+/* Add DELTA to *P; return the old value. */
+static
+int
+atomic_fetchadd(volatile int *p, int delta)
+{
+	int x, y;
+
+	do {
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			"ll %0, 0(%3);"		/*   x = *p */
+			"addu %1, %0, %2;"	/*   y = x + delta */
+			"sc %1, 0(%3);"		/*   *p = y; y = success? */
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "=&r" (y) : "r" (delta), "r" (p)
+			: "memory");
+	} while (y == 0);
+	return x;
+}
+
+////////////////////////////////////////////////////////////
+
+void
+mutex_init(struct mutex *m)
+{
+	m->m_state = 0;
+}
+
+void
+mutex_lock(struct mutex *m)
+{
+	int c;
+
+	c = atomic_cas(&m->m_state, 0, 1);
+	if (c == 0) {
+		return;
+	}
+	if (c != 2) {
+		c = atomic_swap(&m->m_state, 2);
+	}
+	while (c != 0) {
+		/* EAGAIN just means it changed before we slept. */
+		__futex(&m->m_state, FUTEX_WAIT, 2, NULL);
+		c = atomic_swap(&m->m_state, 2);
+	}
+}
+
+int
+mutex_trylock(struct mutex *m)
+{
+	return atomic_cas(&m->m_state, 0, 1) == 0 ? 0 : -1;
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+	if (atomic_fetchadd(&m->m_state, -1) != 1) {
+		/* There were waiters. */
+		m->m_state = 0;
+		__futex(&m->m_state, FUTEX_WAKE, 1, NULL);
+	}
+}
+
+void
+cond_init(struct cond *c)
+{
+	c->c_seq = 0;
+}
+
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+	int seq;
+
+	seq = c->c_seq;
+	mutex_unlock(m);
+	__futex(&c->c_seq, FUTEX_WAIT, seq, NULL);
+	while (atomic_swap(&m->m_state, 2) != 0) {
+		__futex(&m->m_state, FUTEX_WAIT, 2, NULL);
+	}
+}
+
+void
+cond_signal(struct cond *c, struct mutex *m)
+{
+	(void)m;
+	atomic_fetchadd(&c->c_seq, 1);
+	__futex(&c->c_seq, FUTEX_WAKE, 1, NULL);
+}
+
+void
+cond_broadcast(struct cond *c, struct mutex *m)
+{
+	(void)m;
+	atomic_fetchadd(&c->c_seq, 1);
+	__futex(&c->c_seq, FUTEX_WAKE, WAKE_ALL, NULL);
+}
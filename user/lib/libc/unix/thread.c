@@ -0,0 +1,56 @@
+#include <unistd.h>
+#include <errno.h>
+
+/*
+ * User threads.
+ *
+ * The kernel starts a new thread at an entry point with two arguments
+ * and a stack pointer, and knows nothing about C functions returning;
+ * thread_start is the entry point, and turns the return value of the
+ * thread's function into a call to __thread_exit.
+ *
+ * The caller supplies the stack. The MIPS calling convention wants
+ * the stack pointer 8-byte aligned, with 16 bytes reserved above it
+ * for the callee to save its argument registers in.
+ */
+
+#define STACK_ALIGN	8
+#define STACK_ARGSPACE	16
+
+static
+void
+thread_start(void *func, void *arg)
+{
+	int (*f)(void *) = (int (*)(void *))func;
+
+	__thread_exit(f(arg));
+}
+
+int
+thread_create(int (*func)(void *), void *arg, void *stack, size_t stacksize)
+{
+	unsigned long top;
+
+	if (func == NULL || stack == NULL || stacksize < 2*STACK_ARGSPACE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	top = (unsigned long)stack + stacksize;
+	top &= ~(unsigned long)(STACK_ALIGN - 1);
+	top -= STACK_ARGSPACE;
+
+	return __thread_create(thread_start, (void *)func, arg, (void *)top);
+}
+
+void
+thread_exit(int value)
+{
+	__thread_exit(value);
+}
+
+int
+thread_join(int tid, int *value)
+{
+	return __thread_join(tid, value);
+}
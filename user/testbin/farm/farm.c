@@ -50,14 +50,16 @@ static
 void
 spawnv(const char *prog, char **argv)
 {
-	int pid = fork();
+	/* vfork: the child only execs; it must _exit, not exit, if that fails */
+	int pid = vfork();
 	switch (pid) {
 	    case -1:
-		err(1, "fork");
+		err(1, "vfork");
 	    case 0:
 		/* child */
 		execv(prog, argv);
-		err(1, "%s", prog);
+		warn("%s", prog);
+		_exit(1);
 	    default:
 		/* parent */
 		pids[npids++] = pid;
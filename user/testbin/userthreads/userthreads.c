@@ -35,14 +35,11 @@
  * This won't do much of anything unless you implement user-level
  * threads.
  *
- * It also makes various assumptions about the thread API. In
- * particular, it believes (1) that you create a thread by calling
- * "threadfork()" and passing the address for execution of the new
- * thread to begin at, (2) that if the parent thread exits any child
- * threads will keep running, and (3) child threads will exit if they
- * return from the function they started in. If any or all of these
- * assumptions are not met by your user-level threads, you will need
- * to patch this test accordingly.
+ * It uses the thread_create/thread_join wrappers in libc, which take
+ * a function to run, an argument for it, and a stack for the thread
+ * to run on; a thread exits when its function returns. Since _exit
+ * takes down every thread in the process, the main thread joins the
+ * others before returning.
  *
  * This is also a rather basic test and you'll probably want to write
  * some more of your own.
@@ -51,9 +48,11 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <err.h>
 
 #define NTHREADS  3
 #define MAX       1<<25
+#define STACKSIZE 16384
 
 /* counter for the loop in the threads : 
    This variable is shared and incremented by each 
@@ -61,22 +60,32 @@
 volatile int count = 0;
 
 /* the 2 threads : */
-void ThreadRunner(void);
-void BladeRunner(void);
+int ThreadRunner(void *);
+int BladeRunner(void *);
+
+/* their stacks */
+static char stacks[NTHREADS][STACKSIZE];
 
 int
 main(int argc, char *argv[])
 {
-    int i;
+    int i, tids[NTHREADS];
 
     (void)argc;
     (void)argv;
 
     for (i=0; i<NTHREADS; i++) {
 	if (i)
-	    threadfork(ThreadRunner);
+	    tids[i] = thread_create(ThreadRunner, NULL, stacks[i], STACKSIZE);
         else
-	    threadfork(BladeRunner);
+	    tids[i] = thread_create(BladeRunner, NULL, stacks[i], STACKSIZE);
+	if (tids[i] < 0)
+	    err(1, "thread_create");
+    }
+
+    for (i=0; i<NTHREADS; i++) {
+	if (thread_join(tids[i], NULL) < 0)
+	    err(1, "thread_join");
     }
 
     printf("Parent has left.\n");
@@ -88,23 +97,27 @@ main(int argc, char *argv[])
    random results.
 */
 
-void
-BladeRunner()
+int
+BladeRunner(void *junk)
 {
+    (void)junk;
     while (count < MAX) {
 	if (count % 500 == 0)
 	    printf("Blade ");
 	count++;
     }
+    return 0;
 }
 
-void
-ThreadRunner()
+int
+ThreadRunner(void *junk)
 {
+    (void)junk;
     while (count < MAX) {
 	if (count % 513 == 0)
 	    printf(" Runner\n");
 	count++;
     }
+    return 0;
 }
     
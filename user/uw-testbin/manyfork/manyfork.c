@@ -0,0 +1,129 @@
+/*
+ * manyfork - fork and reap lots of processes, to exercise pid reuse
+ *
+ *  usage: manyfork [total [width [any]]]
+ *
+ *  Forks TOTAL (default 2000) children in all, WIDTH (default 100)
+ *  at a time: each batch is all alive at once, and is then waited for
+ *  in birth order, or, given "any", with waitpid(WAIT_ANY) in
+ *  whatever order they finish. Each child exits with a code made from
+ *  its number, which the parent checks. Waiting again for a child
+ *  already reaped must fail, as must WAIT_ANY with no children left.
+ *  With a fixed-size process table this runs out of pids long before
+ *  the end. Prints the average fork-to-reap time per child at the end.
+ *
+ *  relies on fork, _exit, waitpid, __time, and console write
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+
+#define MAXWIDTH  1000
+
+static pid_t pids[MAXWIDTH];
+static int reaped[MAXWIDTH];
+
+/*
+ * Reap one child of the current batch of N, started at number DONE.
+ * Returns the number of failures.
+ */
+static
+int
+reap(int n, int done, int i, int useany)
+{
+	pid_t pid;
+	int status, j;
+
+	pid = waitpid(useany ? WAIT_ANY : pids[i], &status, 0);
+	if (pid < 0) {
+		warn("waitpid %d", useany ? WAIT_ANY : pids[i]);
+		return 1;
+	}
+	for (j=0; j<n; j++) {
+		if (pids[j] == pid) {
+			break;
+		}
+	}
+	if (j == n || reaped[j]) {
+		warnx("waitpid returned %d, not one of ours", pid);
+		return 1;
+	}
+	reaped[j] = 1;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != (done + j) % 256) {
+		warnx("pid %d: wrong exit status %d", pid, status);
+		return 1;
+	}
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int total = 2000, width = 100, useany = 0;
+	int done, i, n, status, bad = 0;
+	time_t startsecs, endsecs;
+	unsigned long startnsecs, endnsecs, usecs;
+
+	if (argc > 1) {
+		total = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		width = atoi(argv[2]);
+	}
+	if (argc > 3) {
+		useany = !strcmp(argv[3], "any");
+	}
+	if (width < 1 || width > MAXWIDTH) {
+		errx(1, "width must be between 1 and %d", MAXWIDTH);
+	}
+
+	__time(&startsecs, &startnsecs);
+	for (done = 0; done < total; done += n) {
+		n = total - done < width ? total - done : width;
+		for (i=0; i<n; i++) {
+			pids[i] = fork();
+			if (pids[i] < 0) {
+				err(1, "fork %d", done + i);
+			}
+			if (pids[i] == 0) {
+				_exit((done + i) % 256);
+			}
+		}
+		for (i=0; i<n; i++) {
+			reaped[i] = 0;
+		}
+		for (i=0; i<n; i++) {
+			bad += reap(n, done, i, useany);
+		}
+		if (waitpid(pids[0], &status, 0) >= 0 || errno != ECHILD) {
+			warnx("second waitpid on %d didn't fail with ECHILD",
+			      pids[0]);
+			bad++;
+		}
+		if (waitpid(WAIT_ANY, &status, 0) >= 0 || errno != ECHILD) {
+			warnx("waitpid(WAIT_ANY) with no children "
+			      "didn't fail with ECHILD");
+			bad++;
+		}
+		printf("%d forked\n", done + n);
+	}
+	__time(&endsecs, &endnsecs);
+
+	usecs = (endsecs - startsecs) * 1000000;
+	usecs += endnsecs / 1000;
+	usecs -= startnsecs / 1000;
+	if (total > 0) {
+		printf("manyfork: %lu us per child (%s)\n", usecs / total,
+		       useany ? "WAIT_ANY" : "by pid");
+	}
+
+	if (bad) {
+		errx(1, "%d failures", bad);
+	}
+	printf("manyfork: passed\n");
+	return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * mutextest - check the futex-based mutexes and condition variables
+ *
+ *  usage: mutextest [nthreads]
+ *
+ *  First NTHREADS (default 4) threads each add 1 to a shared counter
+ *  NLOOPS times, under a mutex, doing a little work with it held so
+ *  that they collide; the total should come out exact. Then the
+ *  threads pass a token around a ring with a condition variable,
+ *  each waiting for its turn, which only works if cond_wait really
+ *  sleeps and cond_broadcast really wakes.
+ *
+ *  relies on thread_create/thread_join and __futex
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <mutex.h>
+#include <err.h>
+
+#define MAXTHREADS  8
+#define NLOOPS      20000
+#define NROUNDS     50
+#define STACKSIZE   16384
+
+static struct mutex lock = MUTEX_INITIALIZER;
+static struct cond turncv = COND_INITIALIZER;
+static volatile int counter;
+static volatile int turn;
+static int nthreads;
+
+static char stacks[MAXTHREADS][STACKSIZE];
+
+static
+int
+counterthread(void *arg)
+{
+	volatile int j;
+	int i, tmp;
+
+	(void)arg;
+	for (i=0; i<NLOOPS; i++) {
+		mutex_lock(&lock);
+		tmp = counter;
+		for (j=0; j<10; j++) {
+			/* give someone else a chance to barge in */
+		}
+		counter = tmp + 1;
+		mutex_unlock(&lock);
+	}
+	return 0;
+}
+
+static
+int
+ringthread(void *arg)
+{
+	int me = (int)arg;
+	int i;
+
+	for (i=0; i<NROUNDS; i++) {
+		mutex_lock(&lock);
+		while (turn != me) {
+			cond_wait(&turncv, &lock);
+		}
+		turn = (turn + 1) % nthreads;
+		counter++;
+		cond_broadcast(&turncv, &lock);
+		mutex_unlock(&lock);
+	}
+	return 0;
+}
+
+static
+void
+runthreads(int (*func)(void *))
+{
+	int tids[MAXTHREADS];
+	int i;
+
+	for (i=0; i<nthreads; i++) {
+		tids[i] = thread_create(func, (void *)i, stacks[i], STACKSIZE);
+		if (tids[i] < 0) {
+			err(1, "thread_create");
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		if (thread_join(tids[i], NULL) < 0) {
+			err(1, "thread_join");
+		}
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	int failed = 0;
+
+	nthreads = 4;
+	if (argc > 1) {
+		nthreads = atoi(argv[1]);
+	}
+	if (nthreads < 1 || nthreads > MAXTHREADS) {
+		errx(1, "usage: mutextest [nthreads (1-%d)]", MAXTHREADS);
+	}
+
+	counter = 0;
+	runthreads(counterthread);
+	printf("mutex: counter %d, expected %d\n", counter,
+	       nthreads * NLOOPS);
+	if (counter != nthreads * NLOOPS) {
+		failed = 1;
+	}
+
+	counter = 0;
+	turn = 0;
+	runthreads(ringthread);
+	printf("cond: %d turns, expected %d\n", counter, nthreads * NROUNDS);
+	if (counter != nthreads * NROUNDS) {
+		failed = 1;
+	}
+
+	printf("mutextest %s\n", failed ? "FAILED" : "passed");
+	return failed;
+}
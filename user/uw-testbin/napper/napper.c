@@ -0,0 +1,93 @@
+/*
+ * napper - check that nanosleep sleeps for the right amount of time
+ *
+ *  usage: napper [nrounds]
+ *
+ *  for each of a range of durations from 1 ms to 1.5 s, sleeps
+ *  NROUNDS (default 5) times with nanosleep, timing each sleep with
+ *  __time, and prints the shortest and longest actual sleep in
+ *  microseconds. Sleeps are rounded up to whole timer ticks (10 ms),
+ *  so a sleep should never be shorter than requested and should not
+ *  be more than about one tick longer.
+ *
+ *  Run it alongside a cpu hog (e.g. "p /uw-testbin/xhog &") to check
+ *  that sleeping doesn't use any cpu: the hog shouldn't slow down.
+ *
+ *  relies on nanosleep and __time
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <err.h>
+
+static const unsigned long durations[] = {
+  1000, 10000, 25000, 100000, 500000, 1500000,
+};
+#define NDURATIONS (sizeof(durations) / sizeof(durations[0]))
+
+static
+unsigned long
+usecs_since(time_t s0, unsigned long ns0)
+{
+  time_t s1;
+  unsigned long ns1;
+
+  __time(&s1, &ns1);
+  return (s1 - s0) * 1000000UL + ns1 / 1000 - ns0 / 1000;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct timespec ts;
+  time_t s0;
+  unsigned long ns0, us, min, max;
+  unsigned i;
+  int j, nrounds = 5, bad = 0;
+
+  if (argc > 1) {
+    nrounds = atoi(argv[1]);
+  }
+  if (nrounds <= 0) {
+    errx(1, "usage: napper [nrounds]");
+  }
+
+  for (i=0; i<NDURATIONS; i++) {
+    ts.tv_sec = durations[i] / 1000000;
+    ts.tv_nsec = (durations[i] % 1000000) * 1000;
+
+    min = (unsigned long)-1;
+    max = 0;
+    for (j=0; j<nrounds; j++) {
+      __time(&s0, &ns0);
+      if (nanosleep(&ts, NULL) < 0) {
+	err(1, "nanosleep");
+      }
+      us = usecs_since(s0, ns0);
+      if (us < min) {
+	min = us;
+      }
+      if (us > max) {
+	max = us;
+      }
+    }
+    if (min < durations[i]) {
+      bad = 1;
+    }
+    printf("napper: %7lu us requested: min %7lu us, max %7lu us%s\n",
+	   durations[i], min, max, min < durations[i] ? " (too short!)" : "");
+  }
+
+  /* invalid requests should fail */
+  ts.tv_sec = 0;
+  ts.tv_nsec = 1000000000;
+  if (nanosleep(&ts, NULL) == 0) {
+    warnx("nanosleep with tv_nsec out of range succeeded");
+    bad = 1;
+  }
+
+  printf("napper: %s\n", bad ? "FAILED" : "passed");
+  return bad;
+}
@@ -0,0 +1,107 @@
+/*
+ * shlat - measure interactive response time while cpu hogs run
+ *
+ *  usage: shlat [nhogs [nprobes]]
+ *
+ *  forks NHOGS children (default 3) that just burn cpu, then does
+ *  NPROBES (default 50) "keystrokes": each one writes a character to
+ *  the console, which blocks until the serial port has sent it, the
+ *  same way the shell blocks echoing input. Each write is timed with
+ *  __time and the min/avg/max are printed in microseconds. Run it
+ *  with 0 hogs to get a baseline.
+ *
+ *  With a round-robin scheduler every keystroke waits behind all of
+ *  the hogs; with a feedback scheduler the prober keeps getting
+ *  boosted for sleeping and should see close to baseline latency.
+ *
+ *  relies on fork, _exit, waitpid, write, and __time
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+
+#define MAXHOGS   16
+#define HOGLOOPS  4000000
+
+static
+void
+hog(void)
+{
+  volatile int i;
+
+  for (i=0; i<HOGLOOPS; i++)
+    ;
+  _exit(0);
+}
+
+static
+unsigned long
+usecs_since(time_t s0, unsigned long ns0)
+{
+  time_t s1;
+  unsigned long ns1;
+
+  __time(&s1, &ns1);
+  return (s1 - s0) * 1000000UL + ns1 / 1000 - ns0 / 1000;
+}
+
+int
+main(int argc, char *argv[])
+{
+  pid_t pids[MAXHOGS];
+  int nhogs = 3, nprobes = 50;
+  int i, status;
+  time_t s0;
+  unsigned long ns0, us, min, max, total;
+
+  if (argc > 1) {
+    nhogs = atoi(argv[1]);
+  }
+  if (argc > 2) {
+    nprobes = atoi(argv[2]);
+  }
+  if (nhogs < 0 || nhogs > MAXHOGS || nprobes <= 0) {
+    errx(1, "usage: shlat [nhogs (0-%d) [nprobes]]", MAXHOGS);
+  }
+
+  for (i=0; i<nhogs; i++) {
+    pids[i] = fork();
+    if (pids[i] < 0) {
+      err(1, "fork");
+    }
+    if (pids[i] == 0) {
+      hog();
+    }
+  }
+
+  min = (unsigned long)-1;
+  max = total = 0;
+  for (i=0; i<nprobes; i++) {
+    __time(&s0, &ns0);
+    if (write(STDOUT_FILENO, ".", 1) != 1) {
+      err(1, "write");
+    }
+    us = usecs_since(s0, ns0);
+    total += us;
+    if (us < min) {
+      min = us;
+    }
+    if (us > max) {
+      max = us;
+    }
+  }
+  printf("\n");
+
+  printf("shlat: %d hogs, %d keystrokes: "
+	 "min %lu us, avg %lu us, max %lu us\n",
+	 nhogs, nprobes, min, total / nprobes, max);
+
+  for (i=0; i<nhogs; i++) {
+    if (waitpid(pids[i], &status, 0) < 0) {
+      warn("waitpid");
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,137 @@
+/*
+ * spawnbench - compare ways of starting a program
+ *
+ *  usage: spawnbench [count [program]]
+ *
+ *  Runs PROGRAM (default /bin/true) COUNT (default 100) times, one
+ *  after another, each of three ways: with spawn, with fork and then
+ *  execv, and with vfork and then execv. Each run is waited for and
+ *  must exit with status 0. Prints the average start-to-reap time per
+ *  run for each way. Also checks that spawning something that doesn't
+ *  exist fails with ENOENT rather than making a process.
+ *
+ *  relies on spawn, fork, vfork, execv, _exit, waitpid, __time, and
+ *  console write
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <err.h>
+
+#define SPAWN  0
+#define FORK   1
+#define VFORK  2
+
+static const char *const methods[] = { "spawn", "fork+execv", "vfork+execv" };
+
+/*
+ * Start PROG one way or another; returns the child's pid.
+ */
+static
+pid_t
+start(int how, const char *prog, char **args)
+{
+	pid_t pid;
+
+	switch (how) {
+	    case SPAWN:
+		pid = spawn(prog, args, NULL);
+		if (pid < 0) {
+			err(1, "spawn %s", prog);
+		}
+		return pid;
+	    case FORK:
+		pid = fork();
+		break;
+	    default:
+		pid = vfork();
+		break;
+	}
+	if (pid < 0) {
+		err(1, "%s", methods[how]);
+	}
+	if (pid == 0) {
+		/* vfork child: must _exit, not exit, if this fails */
+		execv(prog, args);
+		warn("%s", prog);
+		_exit(1);
+	}
+	return pid;
+}
+
+/*
+ * Run PROG COUNT times using method HOW and return the microseconds
+ * per run. Counts runs that didn't exit with 0 in *BAD.
+ */
+static
+unsigned long
+bench(int how, int count, const char *prog, char **args, int *bad)
+{
+	time_t startsecs, endsecs;
+	unsigned long startnsecs, endnsecs, usecs;
+	pid_t pid;
+	int i, status;
+
+	__time(&startsecs, &startnsecs);
+	for (i=0; i<count; i++) {
+		pid = start(how, prog, args);
+		if (waitpid(pid, &status, 0) < 0) {
+			err(1, "waitpid %d", pid);
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			warnx("%s: pid %d: exit status %d", methods[how],
+			      pid, status);
+			(*bad)++;
+		}
+	}
+	__time(&endsecs, &endnsecs);
+
+	usecs = (endsecs - startsecs) * 1000000;
+	usecs += endnsecs / 1000;
+	usecs -= startnsecs / 1000;
+	return usecs / count;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *prog = "/bin/true";
+	char *args[2];
+	int count = 100, bad = 0, how, status;
+	pid_t pid;
+
+	if (argc > 1) {
+		count = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		prog = argv[2];
+	}
+	if (count < 1) {
+		errx(1, "count must be at least 1");
+	}
+	args[0] = (char *)prog;
+	args[1] = NULL;
+
+	pid = spawn("/nonexistent", args, NULL);
+	if (pid >= 0 || errno != ENOENT) {
+		warnx("spawn of a missing program didn't fail with ENOENT");
+		bad++;
+	}
+	if (waitpid(WAIT_ANY, &status, 0) >= 0 || errno != ECHILD) {
+		warnx("failed spawn left a child behind");
+		bad++;
+	}
+
+	for (how = SPAWN; how <= VFORK; how++) {
+		printf("spawnbench: %-12s %lu us per run\n", methods[how],
+		       bench(how, count, prog, args, &bad));
+	}
+
+	if (bad) {
+		errx(1, "%d failures", bad);
+	}
+	printf("spawnbench: passed\n");
+	return 0;
+}